@@ -387,6 +387,7 @@ namespace sSerId
     sImageI16             = 0x00010006,
     sStaticArray          = 0x00010007,
     sGuiTheme             = 0x00010008,
+    sBitVector            = 0x00010009,
   };
 
 
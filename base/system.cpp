@@ -1728,6 +1728,12 @@ sThreadContext *sCreateThreadContext(sThread *thread)
   return ctx;
 }
 
+void sDeleteThreadContext(sThreadContext *ctx)
+{
+  sRemoveMemCache(ctx);
+  delete[] (uint8_t *) ctx;
+}
+
 sPtr sAllocTls(sPtr bytes,int align)
 {
   sThreadContext::TlsOffset = sAlign(sThreadContext::TlsOffset,align);
@@ -1739,6 +1745,47 @@ sPtr sAllocTls(sPtr bytes,int align)
 
 /****************************************************************************/
 
+#if sPLATFORM!=sPLAT_LINUX
+
+int sGetCpuTopology(sCpuTopology *cpus,int max)
+{
+  int count = sMin(sGetCPUCount(),max);
+  for(int i=0;i<count;i++)
+  {
+    cpus[i].Cpu = i;
+    cpus[i].Core = i;
+    cpus[i].Package = 0;
+    cpus[i].Node = 0;
+    cpus[i].L2 = i;
+    cpus[i].L3 = 0;
+    cpus[i].Sibling = 0;
+  }
+  return count;
+}
+
+void *sAllocNodeMem(sPtr size,int node)
+{
+  return new uint8_t[size];
+}
+
+void sFreeNodeMem(void *mem,sPtr size)
+{
+  delete[] (uint8_t *)mem;
+}
+
+void sAdviseHugePages(void *mem,sPtr size)
+{
+}
+
+void sDumpMemProfileOnSignal(const sChar *filename)
+{
+  sLogF(L"mem",L"memory profile on signal is not supported on this platform\n");
+}
+
+#endif
+
+/****************************************************************************/
+
 sVideoWriter::~sVideoWriter()
 {
 }
@@ -140,6 +140,7 @@ uint8_t sGetDayOfWeek(const sDateAndTime &date);
 
 void sCatchCtrlC(sBool enable=1);
 sBool sGotCtrlC();
+void sDumpMemProfileOnSignal(const sChar *filename);  // linux: SIGUSR2 writes filename.n with sDumpMemProfile(). starts the profiler
 
 #if sPLATFORM==sPLAT_WINDOWS || sPLATFORM==sPLAT_LINUX 
 // system logger: writes to syslog on linux/unix (normal sLog on win)
@@ -282,6 +283,7 @@ enum sThreadConsts
 {
   sMAX_THREADCOUNT = 16,
   sMAX_APP_TLS     = 64,  // maximal bytes for thread local storage for sAllocTls
+  sSTRINGPOOL_CACHE = 64, // strings in the per thread cache of sAddToStringPool
 };
 
 enum sThreadFlags
@@ -315,6 +317,8 @@ typedef void (sThreadFunc)(class sThread *, void *);
 
 /****************************************************************************/
 
+struct sStringPoolEntry;
+
 struct sThreadContext
 {
   static sPtr TlsOffset;
@@ -326,6 +330,14 @@ struct sThreadContext
 
   int MemTypeStack[16];
   int MemTypeStackIndex;
+  sMemoryThreadCache MemCache;    // small blocks, see sMemoryHeap::SetThreadCache()
+  sPtr MemProfileSkip;            // bytes to allocate until the next sample, see sStartMemProfile()
+  uint32_t MemProfileSeed;
+
+  // used by sAddToStringPool
+  const sStringPoolEntry *StringCache[sSTRINGPOOL_CACHE];  // recently interned strings
+  uint32_t StringCacheGeneration; // cache is invalid when the pool was cleared
+  uint32_t StringCacheHits;       // not yet added to the pool statistics
 
 #if sCONFIG_DEBUGMEM
   int TagMemLine;
@@ -346,14 +358,14 @@ struct sThreadContext
   void *GetTls(sPtr offset) { if(offset<TlsOffset) return (void *)(((uint8_t *)this)+offset); else return 0; }
 
   // used by sAllocFrame
-#if sCONFIG_FRAMEMEM_MT
   uint64_t FrameFrame;                // check if data needs to be reset
   sPtr FrameCurrent;              // primary buffer for allocation (borrowed from global frame mem)
   sPtr FrameEnd;
   sPtr FrameAltCurrent;           // alternate buffer for allocation (borrowed from global frame mem)
   sPtr FrameAltEnd;
   sPtr FrameBorrow;               // sAllovFrameBegin/sAllocFrameEnd to primary buffer
-#endif
+  sPtr FrameUsed;                 // bytes allocated this frame
+  sPtr FrameMaxUsed;              // high water mark of FrameUsed over the previous frames
 
   // used by sAllocDma
   sPtr DmaCurrent;                // primary buffer for allocation (borrowed from global frame mem)
@@ -402,8 +414,25 @@ public:
 
 void sSleep(int ms);
 int sGetCPUCount();
+
+struct sCpuTopology               // one entry per logical cpu
+{
+  int Cpu;                        // index for SetHomeCore()
+  int Core;                       // physical core, unique over all packages
+  int Package;                    // socket
+  int Node;                       // numa node
+  int L2;                         // cpus with the same id share that cache
+  int L3;
+  int Sibling;                    // 0 for the first hardware thread of a core
+};
+
+int sGetCpuTopology(sCpuTopology *cpus,int max);  // returns number of cpus, without information every cpu is a core of its own
+void *sAllocNodeMem(sPtr size,int node);          // memory preferably placed on a numa node, pages are committed lazily where possible
+void sFreeNodeMem(void *mem,sPtr size);
+void sAdviseHugePages(void *mem,sPtr size);       // hint that this range is better backed by huge pages
 sThreadContext *sGetThreadContext();
 sThreadContext *sCreateThreadContext(sThread *);
+void sDeleteThreadContext(sThreadContext *);
 sPtr sAllocTls(sPtr bytes,int align);
 inline void *sGetTls(sPtr offset) { return sGetThreadContext()->GetTls(offset); }
 template <typename T> sPtr sAllocTls(T*& ptr, int align=4) { sPtr offset=sAllocTls(sizeof(T),align); ptr = sGetTls(offset); return offset; }
@@ -413,7 +442,11 @@ template <typename T> inline  T *sGetTls(sPtr offset) { return (T *) sGetThreadC
 
 class sThreadLock
 {
+#if sPLATFORM==sPLAT_LINUX
+  volatile uint32_t State;        // futex: 0 free, 1 locked, 2 locked and maybe someone sleeps
+#else
   void *CriticalSection;
+#endif
 public:
   sThreadLock();
   ~sThreadLock();
@@ -429,6 +462,7 @@ class sThreadEvent
 {
 #if sPLATFORM==sPLAT_LINUX || sPLATFORM==sPLAT_IOS
   volatile uint32_t Signaled;
+  volatile uint32_t Waiters;      // linux: skip the wake syscall when nobody sleeps
   sBool ManualReset;
 #else
   void *EventHandle;
@@ -446,6 +480,17 @@ public:
 
 /****************************************************************************/
 
+// sleep while *p==val, until woken by sFutexWake on the same address.
+// there may be spurious wakeups, so always check your condition in a loop.
+// timeout in ms, -1 for infinite wait. returns sFALSE on timeout.
+
+#if sPLATFORM==sPLAT_LINUX
+sBool sFutexWait(volatile uint32_t *p,uint32_t val,int timeout=-1);
+void sFutexWake(volatile uint32_t *p,int count=1);
+#endif
+
+/****************************************************************************/
+
 
 class sScopeLock                  // scope lock helper
 {
@@ -490,15 +535,20 @@ extern "C" __int64 _InterlockedIncrement64(__int64 volatile *);
 extern "C" __int64 _InterlockedDecrement64(__int64 volatile *);
 extern "C" __int64 _InterlockedExchangeAdd64(__int64 volatile *,__int64);
 
+extern "C" long _InterlockedCompareExchange(long volatile *,long,long);
+extern "C" __int64 _InterlockedCompareExchange64(__int64 volatile *,__int64,__int64);
+
 extern "C" void _ReadBarrier(void);
 extern "C" void _WriteBarrier(void);
-#pragma intrinsic (_WriteBarrier,_ReadBarrier,_InterlockedExchangeAdd,_InterlockedIncrement,_InterlockedDecrement)
+extern "C" void _mm_mfence(void);
+#pragma intrinsic (_WriteBarrier,_ReadBarrier,_InterlockedExchangeAdd,_InterlockedIncrement,_InterlockedDecrement,_InterlockedCompareExchange,_InterlockedCompareExchange64,_mm_mfence)
 
 
 // sWriteBarrier/sReadBarrier are not full memory barriers (_WriteBarrier/_ReadBarrier are only compiler barriers and DO NOT prevent CPU reordering)
 // practically this means that still reads can moved ahead of write by the CPU
 inline void sWriteBarrier() { _WriteBarrier(); }
 inline void sReadBarrier() { _ReadBarrier(); }
+inline void sMemoryBarrier() { _mm_mfence(); }      // full barrier, also orders stores against following loads
 
 // these functions return the NEW value after the operation was done on the memory address
 
@@ -510,12 +560,18 @@ inline uint64_t sAtomicInc(volatile uint64_t *p) { return _InterlockedIncrement6
 inline uint64_t sAtomicDec(volatile uint64_t *p) { return _InterlockedDecrement64((__int64 *)p); }
 inline uint32_t sAtomicSwap(volatile uint32_t *p, uint32_t i) { return _InterlockedExchange((long*)p,i); }
 
+// compare and swap: store val if *p==cmp. returns the OLD value, so the swap happened if result==cmp
+
+inline uint32_t sAtomicCmpSwap(volatile uint32_t *p, uint32_t cmp, uint32_t val) { return _InterlockedCompareExchange((volatile long *)p,val,cmp); }
+inline uint64_t sAtomicCmpSwap(volatile uint64_t *p, uint64_t cmp, uint64_t val) { return _InterlockedCompareExchange64((volatile __int64 *)p,val,cmp); }
+
 #endif
 
 #if sCONFIG_COMPILER_GCC
 
-inline void sWriteBarrier() { /*__sync_syncronize();*/ }
-inline void sReadBarrier() { /*__sync_syncronize();*/ }
+inline void sWriteBarrier() { __atomic_thread_fence(__ATOMIC_RELEASE); }   // compiler barrier only on x86
+inline void sReadBarrier() { __atomic_thread_fence(__ATOMIC_ACQUIRE); }
+inline void sMemoryBarrier() { __sync_synchronize(); }
 inline uint32_t sAtomicAdd(volatile uint32_t *p,uint32_t i) { return __sync_add_and_fetch(p,i); }
 inline uint32_t sAtomicInc(volatile uint32_t *p) { return __sync_add_and_fetch(p,1); }
 inline uint32_t sAtomicDec(volatile uint32_t *p) { return __sync_add_and_fetch(p,-1); }
@@ -523,6 +579,8 @@ inline uint64_t sAtomicAdd(volatile uint64_t *p,uint64_t i) { return __sync_add_
 inline uint64_t sAtomicInc(volatile uint64_t *p) { return __sync_add_and_fetch(p,1); }
 inline uint64_t sAtomicDec(volatile uint64_t *p) { return __sync_add_and_fetch(p,-1); }
 inline uint32_t sAtomicSwap(volatile uint32_t *p, uint32_t val) { return __sync_lock_test_and_set(p,val); }   // full swap supported?
+inline uint32_t sAtomicCmpSwap(volatile uint32_t *p, uint32_t cmp, uint32_t val) { return __sync_val_compare_and_swap(p,cmp,val); }
+inline uint64_t sAtomicCmpSwap(volatile uint64_t *p, uint64_t cmp, uint64_t val) { return __sync_val_compare_and_swap(p,cmp,val); }
 
 #endif
 
@@ -532,6 +590,7 @@ inline uint32_t sAtomicSwap(volatile uint32_t *p, uint32_t val) { return __sync_
 
 inline void sWriteBarrier() {}
 inline void sReadBarrier() {}
+inline void sMemoryBarrier() {}
 
 uint32_t sAtomicAdd(volatile uint32_t *p,uint32_t i);
 uint32_t sAtomicInc(volatile uint32_t *p);
@@ -540,6 +599,8 @@ uint64_t sAtomicAdd(volatile uint64_t *p,uint64_t i);
 uint64_t sAtomicInc(volatile uint64_t *p);
 uint64_t sAtomicDec(volatile uint64_t *p);
 uint32_t sAtomicSwap(volatile uint32_t *p,uint32_t val);
+uint32_t sAtomicCmpSwap(volatile uint32_t *p,uint32_t cmp,uint32_t val);
+uint64_t sAtomicCmpSwap(volatile uint64_t *p,uint64_t cmp,uint64_t val);
 
 #endif
 
@@ -548,6 +609,7 @@ uint32_t sAtomicSwap(volatile uint32_t *p,uint32_t val);
 
 inline void sWriteBarrier() { __builtin_fence(); }
 inline void sReadBarrier() { __builtin_fence(); }
+inline void sMemoryBarrier() { __builtin_fence(); }
 inline uint32_t sAtomicAdd(volatile uint32_t *p,uint32_t i) { return __builtin_cellAtomicAdd32((uint32_t*)p,i) + i; }
 inline uint32_t sAtomicInc(volatile uint32_t *p) { return __builtin_cellAtomicAdd32((uint32_t*)p,1) + 1; }
 inline uint32_t sAtomicDec(volatile uint32_t *p) { return __builtin_cellAtomicAdd32((uint32_t*)p,~0u) - 1; }
@@ -562,6 +624,20 @@ static inline uint32_t sAtomicSwap(volatile uint32_t *p, uint32_t val)
   return prev;
 }
 
+static inline uint32_t sAtomicCmpSwap(volatile uint32_t *p, uint32_t cmp, uint32_t val)
+{
+  uint32_t prev;
+  do { prev = __builtin_cellAtomicLockLine32((uint32_t*)p); if(prev!=cmp) break; } while(!__builtin_cellAtomicStoreConditional32((uint32_t*)p,val));
+  return prev;
+}
+
+static inline uint64_t sAtomicCmpSwap(volatile uint64_t *p, uint64_t cmp, uint64_t val)
+{
+  uint64_t prev;
+  do { prev = __builtin_cellAtomicLockLine64((uint64_t*)p); if(prev!=cmp) break; } while(!__builtin_cellAtomicStoreConditional64((uint64_t*)p,val));
+  return prev;
+}
+
 #endif
 
 #if sCONFIG_COMPILER_ARM
@@ -570,6 +646,7 @@ static inline uint32_t sAtomicSwap(volatile uint32_t *p, uint32_t val)
 
 inline void sWriteBarrier() { __force_stores(); }
 inline void sReadBarrier() { __memory_changed(); }
+inline void sMemoryBarrier() { __force_stores(); __memory_changed(); }
 inline uint32_t sAtomicAdd(volatile uint32_t *p,uint32_t i) { return *p+i; }
 inline uint32_t sAtomicInc(volatile uint32_t *p) { return *p+1; }
 inline uint32_t sAtomicDec(volatile uint32_t *p) { return *p-1; }
@@ -577,6 +654,8 @@ inline uint64_t sAtomicAdd(volatile uint64_t *p,uint64_t i) { return *p+i; }
 inline uint64_t sAtomicInc(volatile uint64_t *p) { return *p+1; }
 inline uint64_t sAtomicDec(volatile uint64_t *p) { return *p-1; }
 inline uint32_t sAtomicSwap(volatile uint32_t *p, uint32_t val) { uint32_t i = *p; *p = val; return i; }   // full swap supported?
+inline uint32_t sAtomicCmpSwap(volatile uint32_t *p, uint32_t cmp, uint32_t val) { uint32_t i = *p; if(i==cmp) *p = val; return i; }
+inline uint64_t sAtomicCmpSwap(volatile uint64_t *p, uint64_t cmp, uint64_t val) { uint64_t i = *p; if(i==cmp) *p = val; return i; }
 
 #endif
 
@@ -338,7 +338,7 @@ sThread::~sThread()
     pthread_join(*(pthread_t*)ThreadHandle, sNULL);
   
   delete (pthread_t*)ThreadHandle;
-  delete Context;
+  sDeleteThreadContext(Context);
 }
 
 /****************************************************************************/
@@ -33,6 +33,9 @@
 
 #include <signal.h>
 #include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -259,6 +262,67 @@ sBool sGotCtrlC()
   return sCtrlCFlag;
 }
 
+/****************************************************************************/
+
+// the dump can not be written from the signal handler, a thread polls for it
+
+static volatile sBool sMemProfileSignalFlag = sFALSE;
+static sThread *sMemProfileSignalThread;
+static sString<sMAXPATH> sMemProfileSignalFile;
+
+static void sMemProfileSignalHandler(int)
+{
+  sMemProfileSignalFlag = sTRUE;
+}
+
+static void sMemProfileSignalFunc(sThread *t,void *)
+{
+  int n = 0;
+  while(t->CheckTerminate())
+  {
+    if(sMemProfileSignalFlag)
+    {
+      sMemProfileSignalFlag = sFALSE;
+      sString<sMAXPATH> name;
+      name.PrintF(L"%s.%d",sMemProfileSignalFile,n++);
+      if(sDumpMemProfile(name))
+        sLogF(L"mem",L"memory profile written to %s\n",name);
+      else
+        sLogF(L"mem",L"could not write memory profile %s\n",name);
+      sLogMemProfile();
+    }
+    sSleep(100);
+  }
+}
+
+static void sExitMemProfileSignal()
+{
+  if(sMemProfileSignalThread)
+  {
+    signal(SIGUSR2,SIG_DFL);
+    sDelete(sMemProfileSignalThread);
+  }
+}
+
+void sDumpMemProfileOnSignal(const sChar *filename)
+{
+  sMemProfileSignalFile = filename;
+  if(!sIsMemProfiling())
+    sStartMemProfile();
+  if(!sMemProfileSignalThread)
+  {
+    sMemProfileSignalThread = new sThread(sMemProfileSignalFunc,sTHREAD_PRIORITY_LOW,0x10000);
+
+    struct sigaction action;
+    action.sa_handler = sMemProfileSignalHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &action, 0);
+  }
+}
+
+sADDSUBSYSTEM(MemProfileSignal,0x08,0,sExitMemProfileSignal);
+
 void sSetErrorCode(int code)
 {
   ErrorCode = code;
@@ -1018,6 +1082,110 @@ int sGetCPUCount()
   return sysconf(_SC_NPROCESSORS_CONF);
 }
 
+static int sReadSysInt(const char *path,int def)
+{
+  char buffer[64];
+  int fd = open(path,O_RDONLY);
+  if(fd<0)
+    return def;
+  int n = read(fd,buffer,sizeof(buffer)-1);
+  close(fd);
+  if(n<=0)
+    return def;
+  buffer[n] = 0;
+  return atoi(buffer);            // also works for cpu lists, we only need the first cpu
+}
+
+int sGetCpuTopology(sCpuTopology *cpus,int max)
+{
+  char path[128];
+  int count = sMin(sGetCPUCount(),max);
+
+  for(int i=0;i<count;i++)
+  {
+    sCpuTopology *c = &cpus[i];
+    c->Cpu = i;
+
+    sprintf(path,"/sys/devices/system/cpu/cpu%d/topology/physical_package_id",i);
+    c->Package = sMax(0,sReadSysInt(path,0));
+    sprintf(path,"/sys/devices/system/cpu/cpu%d/topology/core_id",i);
+    c->Core = (c->Package<<16) | sReadSysInt(path,i);
+
+    // caches: identify them by the first cpu sharing it
+
+    c->L2 = i;
+    c->L3 = 0;
+    for(int j=0;j<8;j++)
+    {
+      sprintf(path,"/sys/devices/system/cpu/cpu%d/cache/index%d/level",i,j);
+      int level = sReadSysInt(path,-1);
+      if(level<0)
+        break;
+      sprintf(path,"/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",i,j);
+      if(level==2)
+        c->L2 = sReadSysInt(path,i);
+      if(level==3)
+        c->L3 = sReadSysInt(path,0);
+    }
+
+    // the node shows up as a link in the cpu directory
+
+    c->Node = 0;
+    sprintf(path,"/sys/devices/system/cpu/cpu%d",i);
+    DIR *dir = opendir(path);
+    if(dir)
+    {
+      struct dirent *e;
+      while((e=readdir(dir))!=0)
+      {
+        if(strncmp(e->d_name,"node",4)==0 && e->d_name[4]>='0' && e->d_name[4]<='9')
+        {
+          c->Node = atoi(e->d_name+4);
+          break;
+        }
+      }
+      closedir(dir);
+    }
+
+    c->Sibling = 0;
+    for(int j=0;j<i;j++)
+      if(cpus[j].Core==c->Core)
+        c->Sibling++;
+  }
+  return count;
+}
+
+void *sAllocNodeMem(sPtr size,int node)
+{
+  void *mem = mmap(0,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if(mem==MAP_FAILED)
+    sFatal(L"sAllocNodeMem: out of memory");
+  if(node>=0 && node<64)          // pages are placed when first touched, ask for the node
+  {
+    unsigned long mask = 1UL<<node;
+    syscall(SYS_mbind,mem,size,MPOL_PREFERRED,&mask,64,0);
+  }
+  if(sMemoryInitFlags & sIMF_HUGEPAGES)
+    sAdviseHugePages(mem,size);
+  return mem;
+}
+
+void sFreeNodeMem(void *mem,sPtr size)
+{
+  if(mem)
+    munmap(mem,size);
+}
+
+void sAdviseHugePages(void *mem,sPtr size)
+{
+#ifdef MADV_HUGEPAGE
+  sPtr start = sAlign(sPtr(mem),2*1024*1024);    // only whole huge pages inside the range
+  sPtr end = (sPtr(mem)+size)&~sPtr(2*1024*1024-1);
+  if(start<end)
+    madvise((void *)start,end-start,MADV_HUGEPAGE);
+#endif
+}
+
 /****************************************************************************/
 
 void *sSTDCALL sThreadTrunk_pthread(void *ptr)
@@ -1098,16 +1266,15 @@ sThread::~sThread()
     pthread_join(*(pthread_t *)ThreadHandle, sNULL);
 
   delete (pthread_t *)ThreadHandle;
-  delete Context;
+  sDeleteThreadContext(Context);
 }
 
 void sThread::SetHomeCore(int core)
 {
-  /*if(this==0)
-    SetThreadIdealProcessor(GetCurrentThread(),core);
-  else
-    SetThreadIdealProcessor(ThreadHandle,core);*/
-  sDPrintF(L"[stub] sThread::SetHomeCore is not implemented on Linux\n");
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(core%CPU_SETSIZE,&set);
+  pthread_setaffinity_np(*(pthread_t *)ThreadHandle,sizeof(set),&set);  // fails harmlessly for cpus we may not use
 }
 
 /****************************************************************************/
@@ -1135,55 +1302,83 @@ void sExitThread()
 
 /****************************************************************************/
 
-sThreadLock::sThreadLock()
+// a futex lock with an uncontended fast path (one CAS to lock, one swap to
+// unlock). under contention it spins a little before it goes to sleep.
+
+static const int sThreadLockSpin = 100;
+
+static inline void sCpuRelax()
 {
-  CriticalSection = new pthread_mutex_t;
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
 
-  pthread_mutexattr_t mattr;
-  pthread_mutexattr_init(&mattr);
-  pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
-  pthread_mutex_init((pthread_mutex_t *)CriticalSection, &mattr);
+static uint64_t sGetMonotonicMS()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return uint64_t(t.tv_sec) * 1000 + t.tv_nsec / 1000000;
+}
+
+sThreadLock::sThreadLock()
+{
+  State = 0;
 }
 
 /****************************************************************************/
 
 sThreadLock::~sThreadLock()
 {
-  delete (pthread_mutex_t *)CriticalSection;
 }
 
 /****************************************************************************/
 
 void sThreadLock::Lock()
 {
-  pthread_mutex_lock((pthread_mutex_t *)CriticalSection);
+  if (sAtomicCmpSwap(&State, 0, 1) == 0)
+    return;
+
+  for (int i = 0; i < sThreadLockSpin; i++)
+  {
+    sCpuRelax();
+    if (State == 0 && sAtomicCmpSwap(&State, 0, 1) == 0)
+      return;
+  }
+
+  // mark as contended, so the owner will wake us when unlocking
+
+  while (sAtomicSwap(&State, 2) != 0)
+    sFutexWait(&State, 2);
 }
 
 /****************************************************************************/
 
 sBool sThreadLock::TryLock()
 {
-  return pthread_mutex_trylock((pthread_mutex_t *)CriticalSection) == 0;
+  return sAtomicCmpSwap(&State, 0, 1) == 0;
 }
 
 /****************************************************************************/
 
 void sThreadLock::Unlock()
 {
-  pthread_mutex_unlock((pthread_mutex_t *)CriticalSection);
+  if (sAtomicSwap(&State, 0) == 2)
+    sFutexWake(&State, 1);
 }
 
 /****************************************************************************/
 
-// THIS IS UNTESTED, MAY CONTAIN BUGS AND IS DEFINITELY INEFFICIENT.
-// It's also outright dangerous on anything that's not x86!
+// events are a futex on Signaled. the waiter count saves us the wake syscall
+// when nobody is sleeping.
 
 sThreadEvent::sThreadEvent(sBool manual)
 {
   Signaled = 0;
+  Waiters = 0;
   ManualReset = manual;
-
-  sLogF(L"system", L"WARNING! This program uses sThreadEvents on Linux. They are currently UNTESTED, probably DANGEROUS and most likely also INEFFICIENT.\n");
 }
 
 sThreadEvent::~sThreadEvent()
@@ -1192,57 +1387,43 @@ sThreadEvent::~sThreadEvent()
 
 sBool sThreadEvent::Wait(int timeout)
 {
-  if (ManualReset) // manual reset
+  uint64_t end = 0;
+  if (timeout > 0)
+    end = sGetMonotonicMS() + timeout;
+
+  for (;;)
   {
-    if (timeout == -1) // okay, just wait forever
+    if (ManualReset)
     {
-      while (!Signaled)
-        pthread_yield();
-
-      return sTRUE;
+      if (Signaled)
+        return sTRUE;
     }
-
-    int start = sGetTime();
-    uint32_t tDiff;
-    sBool okay = sFALSE;
-    do
-    {
-      okay = Signaled;
-      tDiff = uint32_t(sGetTime() - start);
-      if (!okay && uint32_t(timeout) > tDiff) // not signaled, not yet timed out
-        pthread_yield();
-    } while (!okay && uint32_t(timeout) > tDiff);
-
-    return okay;
-  }
-  else // automatic reset
-  {
-    if (timeout == -1) // okay, just wait forever
+    else
     {
-      uint32_t gotit;
-      while ((gotit = sAtomicSwap(&Signaled, 0)) == 0)
-        pthread_yield();
-
-      return sTRUE;
+      if (sAtomicCmpSwap(&Signaled, 1, 0) == 1)
+        return sTRUE;
     }
 
-    int start = sGetTime();
-    uint32_t tDiff, gotit;
-    do
+    int left = -1;
+    if (timeout >= 0)
     {
-      gotit = sAtomicSwap(&Signaled, 0);
-      tDiff = uint32_t(sGetTime() - start);
-      if (!gotit && uint32_t(timeout) > tDiff) // haven't got it, not timed out
-        pthread_yield();
-    } while (!gotit && uint32_t(timeout) > tDiff);
+      uint64_t now = timeout > 0 ? sGetMonotonicMS() : end;
+      if (now >= end)
+        return sFALSE;
+      left = int(end - now);
+    }
 
-    return gotit == 1;
+    sAtomicInc(&Waiters);
+    sFutexWait(&Signaled, 0, left);
+    sAtomicDec(&Waiters);
   }
 }
 
 void sThreadEvent::Signal()
 {
-  Signaled = 1;
+  sAtomicSwap(&Signaled, 1); // full barrier, so we see the waiters
+  if (Waiters)
+    sFutexWake(&Signaled, ManualReset ? 0x7fffffff : 1);
 }
 
 void sThreadEvent::Reset()
@@ -1250,6 +1431,27 @@ void sThreadEvent::Reset()
   Signaled = 0;
 }
 
+/****************************************************************************/
+
+sBool sFutexWait(volatile uint32_t *p, uint32_t val, int timeout)
+{
+  timespec ts;
+  timespec *tsp = 0;
+  if (timeout >= 0)
+  {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    tsp = &ts;
+  }
+  int r = syscall(SYS_futex, (uint32_t *)p, FUTEX_WAIT_PRIVATE, val, tsp, 0, 0);
+  return !(r == -1 && errno == ETIMEDOUT);
+}
+
+void sFutexWake(volatile uint32_t *p, int count)
+{
+  syscall(SYS_futex, (uint32_t *)p, FUTEX_WAKE_PRIVATE, count, 0, 0, 0);
+}
+
 /****************************************************************************/
 /***                                                                      ***/
 /***   X Windows support (disabled in commandline builds)                 ***/
@@ -2230,10 +2432,103 @@ sADDSUBSYSTEM(LinuxJoypad,0xa1,sInitLinuxJoypad,sExitLinuxJoypad);
 /***                                                                      ***/
 /****************************************************************************/
 
+/****************************************************************************/
+
+// The main heap lives in an arena of reserved address space. Memory is
+// committed in chunks: all at once, or with sIMF_GROW when the heap runs out.
+// With sIMF_HUGEPAGES the chunks are mapped with explicit huge pages if the
+// system has some reserved, with transparent huge pages otherwise.
+
+struct sMemoryArena
+{
+  uint8_t *Map;                   // the whole reservation
+  sPtr MapSize;
+  uint8_t *Base;                  // aligned to huge pages
+  sPtr Reserved;
+  sPtr Committed;
+  sBool Huge;
+
+  void Init(sPtr reserve,sPtr commit,sBool huge);
+  void Exit();
+  sPtr Commit(sPtr size);         // returns bytes committed, 0 if the reservation is exhausted
+};
+
+static const sPtr sHugePageSize = 2*1024*1024;
+static const sPtr sArenaChunk = 64*1024*1024;
+
+void sMemoryArena::Init(sPtr reserve,sPtr commit,sBool huge)
+{
+  Huge = huge;
+  Reserved = sAlign(reserve,sHugePageSize);
+  MapSize = Reserved+sHugePageSize;
+  Map = (uint8_t *)mmap(0,MapSize,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+  if(Map==(uint8_t *)MAP_FAILED)
+    sFatal(L"could not reserve %K for the heap",reserve);
+  Base = (uint8_t *)sAlign(sPtr(Map),sHugePageSize);
+  Committed = 0;
+  if(commit && Commit(commit)<commit)
+    sFatal(L"could not commit %K for the heap",commit);
+}
+
+void sMemoryArena::Exit()
+{
+  if(Map)
+    munmap(Map,MapSize);
+  Map = 0;
+  Base = 0;
+  Reserved = Committed = 0;
+}
+
+sPtr sMemoryArena::Commit(sPtr size)
+{
+  size = sMin(sAlign(size,sHugePageSize),Reserved-Committed);
+  if(size==0)
+    return 0;
+
+  uint8_t *mem = Base+Committed;
+  sBool done = 0;
+#ifdef MAP_HUGETLB
+  // explicit huge pages have to be set aside by the admin (vm.nr_hugepages).
+  // a failed MAP_FIXED leaves a hole in the reservation that must be closed.
+  if(Huge && sPtr(sReadSysInt("/sys/kernel/mm/hugepages/hugepages-2048kB/free_hugepages",0))>=size/sHugePageSize)
+  {
+    done = mmap(mem,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_HUGETLB,-1,0)!=MAP_FAILED;
+    if(!done && mmap(mem,size,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE,-1,0)==MAP_FAILED)
+      return 0;
+  }
+#endif
+  if(!done)
+  {
+    if(mprotect(mem,size,PROT_READ|PROT_WRITE)!=0)
+      return 0;
+    if(Huge)
+      sAdviseHugePages(mem,size);
+  }
+  Committed += size;
+  return size;
+}
+
+static sMemoryArena sMainArena;
+
+template <class Heap> class sArenaHeap : public Heap
+{
+public:
+  sBool Grow(sPtr size)
+  {
+    if(!(sMemoryInitFlags & sIMF_GROW))
+      return 0;
+    if(!sMainArena.Commit(sMax(size+sHugePageSize,sArenaChunk)))
+      return 0;
+    Heap::Extend(sMainArena.Base+sMainArena.Committed);
+    return 1;
+  }
+};
+
 uint8_t *sMainHeapBase;
 uint8_t *sDebugHeapBase;
-class sMemoryHeap sMainHeap;
+sArenaHeap<sMemoryHeap> sMainHeap;
 class sMemoryHeap sDebugHeap;
+sArenaHeap<sTlsfHeap> sMainTlsfHeap;
 
 class sLibcHeap_ : public sMemoryHandler
 {
@@ -2282,15 +2577,30 @@ void sInitMem1()
     else
       sRegisterMemHandler(sAMF_DEBUG, &sLibcHeap);
   }
-  if ((flags & sIMF_NORTL) && sMemoryInitSize > 0)
+  if ((flags & sIMF_NORTL) && (sMemoryInitSize > 0 || (flags & sIMF_GROW)))
   {
-    sMainHeapBase = (uint8_t *)mmap(0, sMemoryInitSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-    sVERIFY(sMainHeapBase != (uint8_t *)MAP_FAILED);
+    sPtr size = sMemoryInitSize ? sMemoryInitSize : sArenaChunk;
+    sPtr reserve = size;
+    if (flags & sIMF_GROW)        // address space for all of physical memory
+      reserve = sMax<sPtr>(size, sPtr(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE));
+    sMainArena.Init(reserve, size, (flags & sIMF_HUGEPAGES) != 0);
+    sMainHeapBase = sMainArena.Base;
+    size = sMainArena.Committed;
     if (flags & sIMF_CLEAR)
-      sSetMem(sMainHeapBase, 0x77, sMemoryInitSize);
-    sMainHeap.Init(sMainHeapBase, sMemoryInitSize);
-    sMainHeap.SetDebug((flags & sIMF_CLEAR) != 0, 0);
-    sRegisterMemHandler(sAMF_HEAP, &sMainHeap);
+      sSetMem(sMainHeapBase, 0x77, size);
+    if (flags & sIMF_TLSF)
+    {
+      sMainTlsfHeap.Init(sMainHeapBase, size);
+      sMainTlsfHeap.SetDebug((flags & sIMF_CLEAR) != 0, 0);
+      sRegisterMemHandler(sAMF_HEAP, &sMainTlsfHeap);
+    }
+    else
+    {
+      sMainHeap.Init(sMainHeapBase, size);
+      sMainHeap.SetDebug((flags & sIMF_CLEAR) != 0, 0);
+      sMainHeap.SetThreadCache(1);
+      sRegisterMemHandler(sAMF_HEAP, &sMainHeap);
+    }
   }
   else
   {
@@ -2303,8 +2613,8 @@ void sExitMem1()
   printf("%d\n", DebugHeapSize);
   if (sDebugHeapBase)
     munmap(sDebugHeapBase, DebugHeapSize);
-  if (sMainHeapBase)
-    munmap(sMainHeapBase, sMemoryInitSize);
+  sMainArena.Exit();
+  sMainHeapBase = 0;
 
   sUnregisterMemHandler(sAMF_DEBUG);
   sUnregisterMemHandler(sAMF_HEAP);
@@ -3520,7 +3520,7 @@ sThread::~sThread()
   if(TerminateFlag==1)
     WaitForSingleObject(ThreadHandle,INFINITE);
   CloseHandle(ThreadHandle);
-  delete Context;
+  sDeleteThreadContext(Context);
 }
 
 void sInitEmergencyThread()
@@ -3677,6 +3677,7 @@ uint8_t *sMainHeapBase;
 uint8_t *sDebugHeapBase;
 class sMemoryHeap sMainHeap;
 class sMemoryHeap sDebugHeap;
+class sTlsfHeap sMainTlsfHeap;
 
 class sVSHeapBase : public sMemoryHandler
 {
@@ -3804,9 +3805,19 @@ void sInitMem1()
     sMainHeapBase = (uint8_t *)VirtualAlloc(0,sMemoryInitSize,MEM_COMMIT,PAGE_READWRITE);
     if(flags & sIMF_CLEAR)
       sSetMem(sMainHeapBase,0x77,sMemoryInitSize);
-    sMainHeap.Init(sMainHeapBase,sMemoryInitSize);
-    sMainHeap.SetDebug((flags & sIMF_CLEAR)!=0,0);
-    sRegisterMemHandler(sAMF_HEAP,&sMainHeap);
+    if(flags & sIMF_TLSF)
+    {
+      sMainTlsfHeap.Init(sMainHeapBase,sMemoryInitSize);
+      sMainTlsfHeap.SetDebug((flags & sIMF_CLEAR)!=0,0);
+      sRegisterMemHandler(sAMF_HEAP,&sMainTlsfHeap);
+    }
+    else
+    {
+      sMainHeap.Init(sMainHeapBase,sMemoryInitSize);
+      sMainHeap.SetDebug((flags & sIMF_CLEAR)!=0,0);
+      sMainHeap.SetThreadCache(1);
+      sRegisterMemHandler(sAMF_HEAP,&sMainHeap);
+    }
   }
   else
   {
@@ -585,6 +585,34 @@ double sFExp(double f)
 /***                                                                      ***/
 /****************************************************************************/
 
+// decimal digits, two at a time. writes backwards from end, returns the first digit
+
+static const char sDigitPairs[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+template<typename Type> static sINLINE sChar *sFormatDecimal(sChar *end,Type val)
+{
+  while(val>=100)
+  {
+    int r = int(val%100);
+    val /= 100;
+    *--end = sDigitPairs[r*2+1];
+    *--end = sDigitPairs[r*2];
+  }
+  if(val>=10)
+  {
+    *--end = sDigitPairs[val*2+1];
+    *--end = sDigitPairs[val*2];
+  }
+  else
+  {
+    *--end = sChar('0'+val);
+  }
+  return end;
+}
+
 void sFloatInfo::FloatToAscii(uint32_t fu,int digits)
 {
   int e2 = ((fu&0x7f800000)>>23);
@@ -787,6 +815,430 @@ void sFloatInfo::DoubleToAscii(uint64_t fu,int digits)
   Exponent = e10;
 }
 
+/****************************************************************************/
+
+// shortest roundtrip digits, after Ulf Adams, "Ryu: Fast Float-to-String
+// Conversion", PLDI 2018. the tables hold 5^i and 2^k/5^i with 125
+// significant bits, they are built on first use.
+
+enum
+{
+  sRYU_POW5_INV_COUNT = 342,
+  sRYU_POW5_COUNT = 326,
+  sRYU_POW5_BITS = 125,
+  sRYU_BIGWORDS = 28,             // 5^341 has 792 bits
+};
+
+static uint64_t sRyuPow5Inv[sRYU_POW5_INV_COUNT][2];   // low, high
+static uint64_t sRyuPow5[sRYU_POW5_COUNT][2];
+static volatile uint32_t sRyuState;                     // 0 empty, 1 building, 2 ready
+
+static sINLINE int sRyuPow5Bits(int e)    { return int(((uint32_t(e)*1217359)>>19)+1); }  // bits of 5^e
+static sINLINE int sRyuLog10Pow2(int e)   { return int((uint32_t(e)*78913)>>18); }
+static sINLINE int sRyuLog10Pow5(int e)   { return int((uint32_t(e)*732923)>>20); }
+
+static uint64_t sRyuBigBits(const uint32_t *b,int pos)   // bits pos..pos+63 of a big number
+{
+  uint64_t r = 0;
+  for(int i=0;i<64;i++)
+  {
+    int p = pos+i;
+    if(p>=0 && p<sRYU_BIGWORDS*32 && ((b[p>>5]>>(p&31))&1))
+      r |= 1ULL<<i;
+  }
+  return r;
+}
+
+static sBool sRyuBigGreaterEqual(const uint32_t *a,const uint32_t *b)
+{
+  for(int i=sRYU_BIGWORDS-1;i>=0;i--)
+    if(a[i]!=b[i])
+      return a[i]>b[i];
+  return 1;
+}
+
+static void sRyuInit()
+{
+  if(sAtomicCmpSwap(&sRyuState,0,1)!=0)
+  {
+    while(sRyuState!=2)           // someone else is building the tables
+      ;
+    sReadBarrier();
+    return;
+  }
+
+  uint32_t pow[sRYU_BIGWORDS];    // 5^i
+  uint32_t rem[sRYU_BIGWORDS];
+  sClear(pow);
+  pow[0] = 1;
+  for(int i=0;i<sRYU_POW5_INV_COUNT;i++)
+  {
+    int bits = sRyuPow5Bits(i);
+
+    if(i<sRYU_POW5_COUNT)         // top 125 bits of 5^i
+    {
+      sRyuPow5[i][0] = sRyuBigBits(pow,bits-sRYU_POW5_BITS);
+      sRyuPow5[i][1] = sRyuBigBits(pow,bits-sRYU_POW5_BITS+64);
+    }
+
+    // 2^(bits-1+125) / 5^i + 1 by long division. the first bits-1 steps
+    // can't subtract anything, so start with 2^(bits-1).
+
+    uint64_t qlo = 0;
+    uint64_t qhi = 0;
+    sClear(rem);
+    rem[(bits-1)>>5] = 1U<<((bits-1)&31);
+    for(int k=0;k<=sRYU_POW5_BITS;k++)
+    {
+      if(k>0)
+      {
+        for(int w=sRYU_BIGWORDS-1;w>0;w--)
+          rem[w] = (rem[w]<<1)|(rem[w-1]>>31);
+        rem[0] <<= 1;
+        qhi = (qhi<<1)|(qlo>>63);
+        qlo <<= 1;
+      }
+      if(sRyuBigGreaterEqual(rem,pow))
+      {
+        uint64_t borrow = 0;
+        for(int w=0;w<sRYU_BIGWORDS;w++)
+        {
+          uint64_t d = uint64_t(rem[w]) - pow[w] - borrow;
+          rem[w] = uint32_t(d);
+          borrow = (d>>32)&1;
+        }
+        qlo |= 1;
+      }
+    }
+    qlo++;
+    if(qlo==0)
+      qhi++;
+    sRyuPow5Inv[i][0] = qlo;
+    sRyuPow5Inv[i][1] = qhi;
+
+    uint64_t carry = 0;
+    for(int w=0;w<sRYU_BIGWORDS;w++)
+    {
+      uint64_t d = uint64_t(pow[w])*5+carry;
+      pow[w] = uint32_t(d);
+      carry = d>>32;
+    }
+  }
+
+  sWriteBarrier();
+  sRyuState = 2;
+}
+
+// (m * mul) >> j, with mul a 128 bit number and 64 < j < 128
+
+static sINLINE uint64_t sRyuMulShift(uint64_t m,const uint64_t *mul,int j)
+{
+#if sCONFIG_COMPILER_GCC && sCONFIG_64BIT
+  unsigned __int128 b0 = (unsigned __int128)m*mul[0];
+  unsigned __int128 b2 = (unsigned __int128)m*mul[1];
+  return uint64_t(((b0>>64)+b2)>>(j-64));
+#else
+  uint64_t b0hi,b2lo,b2hi;
+  {
+    uint64_t a0 = uint32_t(m), a1 = m>>32;
+    uint64_t c0 = uint32_t(mul[0]), c1 = mul[0]>>32;
+    uint64_t mid = (a0*c0>>32) + uint32_t(a1*c0) + uint32_t(a0*c1);
+    b0hi = a1*c1 + (a1*c0>>32) + (a0*c1>>32) + (mid>>32);
+  }
+  {
+    uint64_t a0 = uint32_t(m), a1 = m>>32;
+    uint64_t c0 = uint32_t(mul[1]), c1 = mul[1]>>32;
+    uint64_t lo = a0*c0;
+    uint64_t mid = (lo>>32) + uint32_t(a1*c0) + uint32_t(a0*c1);
+    b2lo = (mid<<32) | uint32_t(lo);
+    b2hi = a1*c1 + (a1*c0>>32) + (a0*c1>>32) + (mid>>32);
+  }
+  uint64_t lo = b2lo+b0hi;
+  uint64_t hi = b2hi + (lo<b2lo ? 1 : 0);
+  int s = j-64;
+  return (lo>>s) | (hi<<(64-s));
+#endif
+}
+
+static sINLINE sBool sRyuMultipleOfPow5(uint64_t v,int p)
+{
+  int n = 0;
+  while(v%5==0)
+  {
+    v /= 5;
+    n++;
+  }
+  return n>=p;
+}
+
+// digits*10^exp is the shortest decimal in the rounding interval of the double.
+// e2 and man are the raw fields, not zero, not inf or nan.
+
+static void sRyuDouble(uint64_t ieeeman,int ieeeexp,uint64_t &digits,int &exp)
+{
+  // integers below 2^53 need no tables
+
+  int shift = 1075-ieeeexp;
+  if(ieeeexp!=0 && shift>=0 && shift<=52)
+  {
+    uint64_t m2 = (1ULL<<52)|ieeeman;
+    if((m2&((1ULL<<shift)-1))==0)
+    {
+      digits = m2>>shift;
+      exp = 0;
+      while(digits%10==0)
+      {
+        digits /= 10;
+        exp++;
+      }
+      return;
+    }
+  }
+
+  if(sRyuState!=2)
+    sRyuInit();
+
+  int e2;
+  uint64_t m2;
+  if(ieeeexp==0)
+  {
+    e2 = 1-1023-52-2;
+    m2 = ieeeman;
+  }
+  else
+  {
+    e2 = ieeeexp-1023-52-2;
+    m2 = (1ULL<<52)|ieeeman;
+  }
+  sBool even = (m2&1)==0;
+  uint64_t mv = 4*m2;
+  int mmshift = (ieeeman!=0 || ieeeexp<=1) ? 1 : 0;
+
+  // the interval, scaled to decimal
+
+  uint64_t vr,vp,vm;
+  int e10;
+  sBool vmzeros = 0;
+  sBool vrzeros = 0;
+  if(e2>=0)
+  {
+    int q = sRyuLog10Pow2(e2) - (e2>3 ? 1 : 0);
+    e10 = q;
+    int k = sRYU_POW5_BITS + sRyuPow5Bits(q) - 1;
+    int i = -e2+q+k;
+    vr = sRyuMulShift(4*m2,sRyuPow5Inv[q],i);
+    vp = sRyuMulShift(4*m2+2,sRyuPow5Inv[q],i);
+    vm = sRyuMulShift(4*m2-1-mmshift,sRyuPow5Inv[q],i);
+    if(q<=21)
+    {
+      if(mv%5==0)
+        vrzeros = sRyuMultipleOfPow5(mv,q);
+      else if(even)
+        vmzeros = sRyuMultipleOfPow5(mv-1-mmshift,q);
+      else
+        vp -= sRyuMultipleOfPow5(mv+2,q);
+    }
+  }
+  else
+  {
+    int q = sRyuLog10Pow5(-e2) - (-e2>1 ? 1 : 0);
+    e10 = q+e2;
+    int i = -e2-q;
+    int k = sRyuPow5Bits(i) - sRYU_POW5_BITS;
+    int j = q-k;
+    vr = sRyuMulShift(4*m2,sRyuPow5[i],j);
+    vp = sRyuMulShift(4*m2+2,sRyuPow5[i],j);
+    vm = sRyuMulShift(4*m2-1-mmshift,sRyuPow5[i],j);
+    if(q<=1)
+    {
+      vrzeros = 1;
+      if(even)
+        vmzeros = mmshift==1;
+      else
+        vp--;
+    }
+    else if(q<63)
+    {
+      vrzeros = (mv&((1ULL<<q)-1))==0;
+    }
+  }
+
+  // remove digits while the interval still holds a shorter number
+
+  int removed = 0;
+  int last = 0;
+  uint64_t out;
+  if(vmzeros || vrzeros)
+  {
+    while(vp/10000>vm/10000)
+    {
+      vmzeros &= vm%10000==0;
+      vrzeros &= last==0 && vr%1000==0;
+      last = int(vr%10000/1000);
+      vr /= 10000; vp /= 10000; vm /= 10000;
+      removed += 4;
+    }
+    while(vp/10>vm/10)
+    {
+      vmzeros &= vm%10==0;
+      vrzeros &= last==0;
+      last = int(vr%10);
+      vr /= 10; vp /= 10; vm /= 10;
+      removed++;
+    }
+    if(vmzeros)
+    {
+      while(vm%10==0)
+      {
+        vrzeros &= last==0;
+        last = int(vr%10);
+        vr /= 10; vp /= 10; vm /= 10;
+        removed++;
+      }
+    }
+    if(vrzeros && last==5 && vr%2==0)   // exactly halfway: round to even
+      last = 4;
+    out = vr + (((vr==vm && (!even || !vmzeros)) || last>=5) ? 1 : 0);
+  }
+  else                            // the common case
+  {
+    sBool roundup = 0;
+    while(vp/10000>vm/10000)
+    {
+      roundup = vr%10000>=5000;
+      vr /= 10000; vp /= 10000; vm /= 10000;
+      removed += 4;
+    }
+    if(vp/100>vm/100)
+    {
+      roundup = vr%100>=50;
+      vr /= 100; vp /= 100; vm /= 100;
+      removed += 2;
+    }
+    while(vp/10>vm/10)
+    {
+      roundup = vr%10>=5;
+      vr /= 10; vp /= 10; vm /= 10;
+      removed++;
+    }
+    out = vr + ((vr==vm || roundup) ? 1 : 0);
+  }
+  digits = out;
+  exp = e10+removed;
+}
+
+void sFloatInfo::DoubleToShortest(uint64_t fu)
+{
+  int e2 = int((fu>>52)&0x7ff);
+  uint64_t man = fu&0x000fffffffffffffULL;
+
+  Digits[0] = 0;
+  Negative = (fu&0x8000000000000000ULL) ? 1 : 0;
+  NaN = 0;
+  Exponent = 0;
+  Infinite = 0;
+  Denormal = 0;
+  if(e2==2047)
+  {
+    if(man==0)
+      Infinite = 1;
+    else
+      NaN = man;
+    return;
+  }
+  if(e2==0)
+  {
+    if(man==0)
+    {
+      Digits[0] = '0';
+      Digits[1] = 0;
+      return;
+    }
+    Denormal = 1;
+  }
+
+  uint64_t digits;
+  int exp;
+  sRyuDouble(man,e2,digits,exp);
+
+  sChar buf[20];
+  sChar *s = sFormatDecimal(buf+sCOUNTOF(buf),digits);
+  int len = int(buf+sCOUNTOF(buf)-s);
+  sCopyMem(Digits,s,len*sizeof(sChar));
+  Digits[len] = 0;
+  Exponent = exp+len-1;
+}
+
+static sINLINE uint32_t sBigWord(const uint32_t *n,int words,int i)
+{
+  return i<words ? n[i] : 0;
+}
+
+void sFloatInfo::RoundFractions(uint64_t fu,int fractions)
+{
+  if(Infinite || NaN || Exponent>50 || Exponent<-50)
+    return;                       // PrintF() uses PrintE()
+  if(sGetStringLen(Digits)-1-Exponent<=fractions)
+    return;                       // all digits are printed
+
+  int e2 = int((fu>>52)&0x7ff);
+  uint64_t man = fu&0x000fffffffffffffULL;
+  if(e2)
+    man |= 1ULL<<52;
+  else
+    e2 = 1;
+  int shift = 1075-e2;            // value is man / 2^shift
+  if(shift<=0)
+    return;                       // integers have no digits to cut
+
+  // man * 10^fractions. fractions stays below 70 here, so 320 bits do
+
+  uint32_t n[10];
+  int words = 2;
+  n[0] = uint32_t(man);
+  n[1] = uint32_t(man>>32);
+  for(int f=fractions;f>0;)
+  {
+    uint32_t mul = 1;
+    for(int i=0;i<9 && f>0;i++,f--)
+      mul *= 10;
+    uint64_t carry = 0;
+    for(int i=0;i<words;i++)
+    {
+      carry += uint64_t(n[i])*mul;
+      n[i] = uint32_t(carry);
+      carry >>= 32;
+    }
+    if(carry)
+      n[words++] = uint32_t(carry);
+  }
+
+  // q = n>>shift, the bits below decide the rounding
+
+  int w = shift>>5;
+  int b = shift&31;
+  uint64_t q = uint64_t(sBigWord(n,words,w+1))<<32 | sBigWord(n,words,w);
+  if(b)
+    q = (q>>b) | (uint64_t(sBigWord(n,words,w+2))<<(64-b));
+  int h = shift-1;
+  uint32_t hw = sBigWord(n,words,h>>5);
+  if((hw>>(h&31))&1)
+  {
+    sBool above = (hw&((1U<<(h&31))-1))!=0;
+    for(int i=0;i<(h>>5) && i<words && !above;i++)
+      above = n[i]!=0;
+    if(above || (q&1))
+      q++;
+  }
+
+  sChar buf[24];
+  sChar *s = sFormatDecimal(buf+sCOUNTOF(buf),q);
+  int len = int(buf+sCOUNTOF(buf)-s);
+  sCopyMem(Digits,s,len*sizeof(sChar));
+  Digits[len] = 0;
+  Exponent = len-1-fractions;
+}
+
 uint32_t sFloatInfo::AsciiToFloat()
 {
   uint64_t man;
@@ -1058,7 +1510,7 @@ void sFloatInfo::PrintE(const sStringDesc &desc)
   else if(NaN)
     sSPrintF(desc,L"%c#nan%d",Negative?'-':'+',NaN);
   else
-    sSPrintF(desc,L"%c%c.%se%d",Negative?'-':'+',Digits[0],Digits+1,Exponent);
+    sSPrintF(desc,L"%c%c.%se%d",Negative?'-':'+',Digits[0],Digits[1] ? Digits+1 : L"0",Exponent);
 }
 
 
@@ -2319,8 +2771,8 @@ sBool sFormatString(const sStringDesc &desc,const sChar *s,const sChar **fp)
 
   sChar *d = desc.Buffer;
   int left = desc.Size;
-  static sChar hex[17] = L"0123456789abcdef";
-  static sChar HEX[17] = L"0123456789ABCDEF";
+  static const sChar hex[17] = L"0123456789abcdef";
+  static const sChar HEX[17] = L"0123456789ABCDEF";
 
   arg = 0;
   left--;
@@ -2648,15 +3100,29 @@ void sPrintScreen(const sChar *text)
 
 sBool sFormatStringBuffer::Fill()
 {
-loop:
-  while(*Format!='%' && *Format!=0 && Dest<End-1)
-    *Dest++ = *Format++;
-  if(Format[0]=='%' && Format[1]=='%' && Dest<End-1)
+  const sChar *f = Format;
+  sChar *d = Dest;
+  sChar *e = End-1;
+  for(;;)
   {
-    *Dest++ = '%';
-    Format+=2;
-    goto loop;
+    while(d<e)
+    {
+      sChar c = *f;
+      if(c<='%' && (c=='%' || c==0))
+        break;
+      *d++ = c;
+      f++;
+    }
+    if(f[0]=='%' && f[1]=='%' && d<e)
+    {
+      *d++ = '%';
+      f+=2;
+      continue;
+    }
+    break;
   }
+  Format = f;
+  Dest = d;
 
   sVERIFY(Dest<End);
 
@@ -2732,9 +3198,23 @@ void sFormatStringBuffer::GetInfo(sFormatStringInfo &info)
 
 void sFormatStringBuffer::Add(const sFormatStringInfo &info,const sChar *buffer,sBool sign)
 {
-  int len = sGetStringLen(buffer);
+  Add(info,buffer,sGetStringLen(buffer),sign);
+}
+
+void sFormatStringBuffer::Add(const sFormatStringInfo &info,const sChar *buffer,int len,sBool sign)
+{
   int field = info.Field;
 
+  if(field==0 && !info.Truncate) // no padding
+  {
+    if(sign && Dest<End-1)
+      *Dest++ = '-';
+    int n = sMin<int>(len,int(End-1-Dest));
+    sCopyMem(Dest,buffer,n*sizeof(sChar));
+    Dest += n;
+    return;
+  }
+
   if(!info.Minus && !info.Null)
   {
     while(field>(sign?len+1:len) && Dest<End-1)
@@ -2794,8 +3274,8 @@ template<typename Type>
 void sFormatStringBuffer::PrintInt(const sFormatStringInfo &info,Type val,sBool sign)
 {
   sChar buf[32];
-  static sChar hex[17] = L"0123456789abcdef";
-  static sChar HEX[17] = L"0123456789ABCDEF";
+  static const sChar hex[17] = L"0123456789abcdef";
+  static const sChar HEX[17] = L"0123456789ABCDEF";
   static sChar units[] = L" kmgtpe";
   static sChar UNITS[] = L" KMGTPE";
   int len=0,komma=0,unit=0;
@@ -2864,18 +3344,17 @@ void sFormatStringBuffer::PrintInt(const sFormatStringInfo &info,Type val,sBool
 
   case 'x':
   case 'X':
-    len = sCOUNTOF(buf);
-    buf[--len] = 0;
-    do
     {
-      if(info.Format=='x')
-        buf[--len] = hex[val&15];
-      else
-        buf[--len] = HEX[val&15];
-      val = (val>>4);
+      const sChar *digits = info.Format=='x' ? hex : HEX;
+      len = sCOUNTOF(buf);
+      do
+      {
+        buf[--len] = digits[val&15];
+        val = (val>>4);
+      }
+      while(val!=0);
+      Add(info,buf+len,sCOUNTOF(buf)-len,sign);
     }
-    while(val!=0);
-    Add(info,buf+len,sign);
     break;
 
   case 'r':   // radis "12.34"
@@ -2902,16 +3381,10 @@ void sFormatStringBuffer::PrintInt(const sFormatStringInfo &info,Type val,sBool
   case 'i':
   case 'd':
   default:
-    len = sCOUNTOF(buf);
-    buf[--len] = 0;
-
-    do
     {
-      buf[--len] = val%10+'0';
-      val = val/10;
+      sChar *s = sFormatDecimal(buf+sCOUNTOF(buf),val);
+      Add(info,s,int(buf+sCOUNTOF(buf)-s),sign);
     }
-    while(val!=0);
-    Add(info,buf+len,sign);
     break;
 
   case 'h':     // 4h3d1w , a weak is 5 days, a day is 8 hours
@@ -2979,6 +3452,7 @@ void sFormatStringBuffer::PrintFloat(const sFormatStringInfo &info,float v)
       if(info.Format=='F' && frac>0)
         frac--;
 
+      fi.RoundFractions(sRawCast<uint64_t,double>(double(v)),frac);
       fi.PrintF(buf,frac);
       if(info.Format=='F')     // special format: add trailing 'f'
       {
@@ -3008,7 +3482,7 @@ void sFormatStringBuffer::PrintFloat(const sFormatStringInfo &info,double v)
   sFloatInfo fi;
   sString<256> buf;
 
-  fi.DoubleToAscii(sRawCast<uint64_t,double>(v));
+  fi.DoubleToShortest(sRawCast<uint64_t,double>(v));
   int sign = fi.Negative;
   fi.Negative = 0;
 
@@ -3026,6 +3500,7 @@ void sFormatStringBuffer::PrintFloat(const sFormatStringInfo &info,double v)
     if(frac==-1) frac = sMax(0,field-2-fi.Exponent-sign);
   }
 
+  fi.RoundFractions(sRawCast<uint64_t,double>(v),frac);
   fi.PrintF(buf,frac);
 
   Add(info,buf,sign);   
@@ -4341,6 +4816,16 @@ static sMemoryLeakTracker *sMemoryLeaks;
 static sBool sMemoryLeakCheck;
 static sMemoryHandler *sMemoryHandlers[sAMF_MASK+1];
 static int sMemoryHandlerMax;
+static sThreadLock *sMemoryCacheLock;     // protects sMemoryCaches. no thread caching without it
+static sMemoryThreadCache *sMemoryCaches; // all thread caches bound to a heap
+static volatile int sMemProfileRate;      // bytes per sample, 0 when the profiler is not sampling
+static uint8_t *sMemProfileFilter;        // samples per pointer hash, checked without lock when freeing
+
+static sPtr sMemProfileNextSkip(sThreadContext *tx,int rate);
+static void sMemProfileAlloc(sThreadContext *tx,int rate,void *ptr,sPtr size,int heapid,const char *file,int line);
+static void sMemProfileFree(void *ptr);
+static uint32_t sMemProfileFilterIndex(void *ptr);
+static void sExitMemProfile();
 
 int sOutOfMemory=0; // set to heap id upon out of memory condition
 
@@ -4495,6 +4980,8 @@ void sInitMem0()
 
   if(sMemoryHandlers[sAMF_DEBUG])
     sMemoryHandlers[sAMF_DEBUG]->MakeThreadSafe();
+  if(sMemoryHandlers[sAMF_HEAP] && (sMemoryInitFlags & sIMF_NORTL))
+    sMemoryHandlers[sAMF_HEAP]->MakeThreadSafe();   // the altona heap is shared by all threads
 
   if(sCONFIG_DEBUGMEM && (sIsMemTypeAvailable(sAMF_DEBUG) || (sPLATFORM==sPLAT_WINDOWS || sPLATFORM==sPLAT_LINUX)))
   {
@@ -4514,6 +5001,11 @@ void sInitMem0()
 
   sDumpMemoryMap();
 
+  sMemoryCacheLock = new sThreadLock;
+
+  if(sMemoryInitFlags & sIMF_PROFILE)
+    sStartMemProfile();
+
 #if sCFG_MEMDBG_LOCKING
   sDbgMemRangesLock = new sThreadLock;
   sDbgMemRanges = new sStaticArray<sDbgMemRange>;
@@ -4541,6 +5033,13 @@ void sExitMem0()
 
   sPartitionMemory(0,0,0);
 
+  sFlushMemCache();
+  sThreadLock *cl = sMemoryCacheLock;
+  sMemoryCacheLock = 0;           // no more caching from here on
+  delete cl;
+
+  sExitMemProfile();
+
   for(int i=1;i<=sMemoryHandlerMax;i++)
     if(sMemoryHandlers[i])
       sMemoryHandlers[i]->sMemoryHandler::MakeThreadUnsafe();
@@ -4683,9 +5182,22 @@ void *sAllocMem_(sPtr size,int align,int flags)
   }
 #endif
 
-  h->Lock();
-  p = h->Alloc(size,align,flags);
-  h->Unlock();
+  p = h->CacheAlloc(size,align,flags);
+  if(!p)
+  {
+    h->Lock();
+    p = h->Alloc(size,align,flags);
+    if(!p && h->Grow(size+align))
+      p = h->Alloc(size,align,flags);
+    h->Unlock();
+  }
+  if(!p && sMemoryCaches)        // blocks held by thread caches might help
+  {
+    sFlushMemCache();
+    h->Lock();
+    p = h->Alloc(size,align,flags);
+    h->Unlock();
+  }
   if(!p)
   {
     if(h->MayFail || (flags & sAMF_MAYFAIL))
@@ -4721,6 +5233,20 @@ void *sAllocMem_(sPtr size,int align,int flags)
         sFatal(L"out of mem - tried %K, align %d, flags %08x\n(free: %K of %K, largest: %K)",size,align,flags,(uint64_t)free,(uint64_t)hsize,(uint64_t)largest);
     }
   }
+  int rate = sMemProfileRate;
+  if(rate && !(flags & sAMF_NOLEAK))
+  {
+    if(tx->MemProfileSkip==0)     // first allocation of this thread
+      tx->MemProfileSkip = sMemProfileNextSkip(tx,rate);
+    if(tx->MemProfileSkip>size)
+      tx->MemProfileSkip -= size;
+    else
+#if sCONFIG_DEBUGMEM
+      sMemProfileAlloc(tx,rate,p,size,flags&(sAMF_MASK|sAMF_ALT),tx->TagMemFile,tx->TagMemLine);
+#else
+      sMemProfileAlloc(tx,rate,p,size,flags&(sAMF_MASK|sAMF_ALT),0,0);
+#endif
+  }
 #if sCONFIG_DEBUGMEM
   if(sMemoryLeakCheck && !(flags & sAMF_NOLEAK) && !h->NoLeaks)
     sMemoryLeaks->AddLeak(p,size,tx->TagMemFile,tx->TagMemLine,sMemoryAllocId,flags&(sAMF_MASK|sAMF_ALT),tx->MemLeakDescBuffer2,tx->MLDBCRC);
@@ -4738,6 +5264,11 @@ void sFreeMem(void *ptr)
     sThreadContext *tx = sGetThreadContext();
     sMemoryHandler *h=0;
 
+    // remove the profile sample before the block can be allocated and sampled again
+
+    if(sMemProfileFilter && sMemProfileFilter[sMemProfileFilterIndex(ptr)])
+      sMemProfileFree(ptr);
+
     sPtr p = sPtr(ptr);
     for(int i=sMemoryHandlerMax;i>=1;i--)
     {
@@ -4747,6 +5278,8 @@ void sFreeMem(void *ptr)
         if(p>=h->Start && p<h->End)
         {
           sVERIFY(h->Owner==0 || h->Owner==tx);
+          if(h->CacheFree(ptr))
+            break;
           h->Lock();
           sBool r= h->Free(ptr);
           h->Unlock();
@@ -4823,6 +5356,31 @@ sPtr sMemSize(void *ptr)
   return 0;
 }
 
+/****************************************************************************/
+
+void sFlushMemCache(sThreadContext *tx)
+{
+  if(!sMemoryCacheLock) return;
+  sScopeLock sl(sMemoryCacheLock);
+  for(sMemoryThreadCache *c=sMemoryCaches;c;c=c->Next)
+    if(tx==0 || c==&tx->MemCache)
+      c->Heap->FlushCache(c);
+}
+
+void sRemoveMemCache(sThreadContext *tx)
+{
+  sMemoryThreadCache *c = &tx->MemCache;
+  if(!sMemoryCacheLock || !c->Heap) return;
+  sScopeLock sl(sMemoryCacheLock);
+  c->Heap->FlushCache(c);
+  sMemoryThreadCache **p = &sMemoryCaches;
+  while(*p!=c)
+    p = &(*p)->Next;
+  *p = c->Next;
+  c->Next = 0;
+  c->Heap = 0;
+}
+
 void sCheckMem_()
 {
   sThreadContext *tx = sGetThreadContext();
@@ -4851,6 +5409,7 @@ void sMemMark(sBool fatal/*=sTRUE*/)
 
   sMemFlushHook->Call(sMemoryMarkFlushVertexFormat);
   sMemoryMarkFlushVertexFormat = sTRUE;
+  sFlushMemCache();
 
   // calculate hash over all handlers, excluding debug
   sThreadContext *tx = sGetThreadContext();
@@ -5011,6 +5570,16 @@ ptrdiff_t sMemStatMaxDMAUsed=0;
 
 //void sRender3DFlush();
 
+static sPtr sAllocPartition(sPtr size,int align,int flags)
+{
+  if(sMemoryInitFlags & sIMF_HUGEPAGES)
+    align = sMax(align,2*1024*1024);          // start on a huge page
+  void *mem = sAllocMem(size,align,flags);
+  if(sMemoryInitFlags & sIMF_HUGEPAGES)
+    sAdviseHugePages(mem,size);
+  return sPtr(mem);
+}
+
 void sPartitionMemory(sPtr frame,sPtr dma,sPtr gfx)
 {
   // delete old
@@ -5041,9 +5610,9 @@ void sPartitionMemory(sPtr frame,sPtr dma,sPtr gfx)
   {
     sPushMemLeakDesc(L"FrameMemory");
     sMemFrameSize = frame;
-    sMemFramePtr[0] =  (sPtr)sAllocMem(sMemFrameSize,16,sAMF_HEAP);
+    sMemFramePtr[0] = sAllocPartition(sMemFrameSize,16,sAMF_HEAP);
     if(sFrameMemDoubleBuffered)
-      sMemFramePtr[1] =  (sPtr)sAllocMem(sMemFrameSize,16,sAMF_HEAP);
+      sMemFramePtr[1] = sAllocPartition(sMemFrameSize,16,sAMF_HEAP);
     sMemFrameToggle = 0;
     sPopMemLeakDesc();
   }
@@ -5052,8 +5621,8 @@ void sPartitionMemory(sPtr frame,sPtr dma,sPtr gfx)
   {
     sPushMemLeakDesc(L"DMAMemory");
     sMemDmaSize = dma;
-    sMemDmaPtr[0] = (sPtr)sAllocMem(sMemDmaSize,4096,sAMF_GFX);
-    sMemDmaPtr[1] = (sPtr)sAllocMem(sMemDmaSize,4096,sAMF_GFX);
+    sMemDmaPtr[0] = sAllocPartition(sMemDmaSize,4096,sAMF_GFX);
+    sMemDmaPtr[1] = sAllocPartition(sMemDmaSize,4096,sAMF_GFX);
     sMemDmaToggle = 0;
     sPopMemLeakDesc();
   }
@@ -5076,7 +5645,7 @@ void sFrameMemDoubleBuffer(sBool enable)
       sMemFramePtr[1] = 0;
     }
     else
-      sMemFramePtr[1] =  (sPtr)sAllocMem(sMemFrameSize,16,sAMF_HEAP);
+      sMemFramePtr[1] = sAllocPartition(sMemFrameSize,16,sAMF_HEAP);
     sMemFrameToggle = 0;
     sFrameMemDoubleBuffered=enable;
     sFlipMem();
@@ -5085,58 +5654,41 @@ void sFrameMemDoubleBuffer(sBool enable)
 
 /****************************************************************************/
 
-#if !sCONFIG_FRAMEMEM_MT
-
-// single-threaded implementations
+// Every thread bump allocates from a segment of the frame memory that it
+// owns, so sAllocFrame() is lock free and any thread may use it. Segments
+// are grabbed from the shared buffer with a single atomic add. Up to two
+// segments are remembered, so a large or strongly aligned allocation does
+// not throw away the rest of the current segment. All segments are
+// forgotten when sFlipMem() changes sMemFlipFrame.
 
-sBool sRender3DLockOwner();
+static const sPtr sMemFrameSegment = 16*1024;  // smallest segment grabbed from the frame buffer
 
-void *sAllocFrame(sPtr size,int align)
+static sPtr sAllocFrameSegment(sPtr size)
 {
-  sVERIFY(sRender3DLockOwner());
-
   if(sMemFrameUsed==0)
     sFatal(L"please use sPartitionMemory() in sMain() to allocate frame memory");
 
-  size = sAlign(size,align);
-  sMemFrameUsed = sAlign(sMemFrameUsed,align);
-  sMemFrameUsed += size;
-  if(sMemFrameUsed > sMemFramePtr[sMemFrameToggle]+sMemFrameSize)
+  sPtr end = sAtomicAdd(&sMemFrameUsed,size);
+  if(end > sMemFramePtr[sMemFrameToggle]+sMemFrameSize)
     sFatal(L"out of frame mem");
-  return (void*)(sMemFrameUsed-size);
+  return end-size;
 }
 
-void *sAllocFrameBegin(int size,int align)
+static sINLINE void sAllocFrameReset(sThreadContext *ctx)
 {
-  sVERIFY(sRender3DLockOwner());
-  if(sMemFrameUsed==0)
-    sFatal(L"please use sPartitionMemory() in sMain() to allocate frame memory");
-
-  size = sAlign(size,align);
-  sMemFrameUsed = sAlign(sMemFrameUsed,align);
-
-  if((sMemFrameUsed+size) > sMemFramePtr[sMemFrameToggle]+sMemFrameSize)
-    sFatal(L"out of frame mem");
-  return (void*)(sMemFrameUsed);
+  if(ctx->FrameFrame!=sMemFlipFrame)
+  {
+    // first alloc frame this frame, reset state
+    ctx->FrameFrame = sMemFlipFrame;
+    ctx->FrameBorrow = 0;
+    ctx->FrameCurrent = ctx->FrameEnd = 0;
+    ctx->FrameAltCurrent = ctx->FrameAltEnd =0;
+    ctx->FrameMaxUsed = sMax(ctx->FrameMaxUsed,ctx->FrameUsed);
+    ctx->FrameUsed = 0;
+  }
 }
 
-void sAllocFrameEnd(void *ptr)
-{
-  sVERIFY(sRender3DLockOwner());
-  sPtr end = (sPtr) ptr;
-  if (end<sMemFrameUsed || end>sMemFramePtr[sMemFrameToggle]+sMemFrameSize)
-    sFatal(L"sAllocFrameEnd: illegal pointer");
-
-  sMemFrameUsed = end;
-}
-
-#else
-
-/****************************************************************************/
-#define sCFG_ALLOCFRAME_FAST 0                            // multithread safe but may waste more memory then the slow version
-                                                          // generally shouldn't be an issue for allocframe (most of the time small allocs with 16 byte alignment)
-
-static void *sAllocFrameBeginImpl(sThreadContext *ctx,int size,int align)
+static void *sAllocFrameBeginImpl(sThreadContext *ctx,sPtr size,int align)
 {
 retry:
   // we remember up to two borrowed memory segments, enough free memory in one of them?
@@ -5163,13 +5715,13 @@ retry:
       sSwap(ctx->FrameEnd,ctx->FrameAltEnd);
     }
 
-    // allocate new segment
+    // grab new segment
     sPtr old_fc = 0;
     sPtr old_fe = 0;
     sSwap(old_fc,ctx->FrameCurrent);
     sSwap(old_fe,ctx->FrameEnd);
-    int size2 = sAlign(sMax(size+align,sMin(256*1024,size*2+align)),16);    // try to borrow up to size*2+align memory but at least requested size+align
-    ctx->FrameCurrent = (sPtr) sAllocFrame(size2,16);
+    sPtr size2 = sAlign(sMax<sPtr>(size+align,sMin<sPtr>(sMemFrameSegment,sMemFrameSize/64)),16);
+    ctx->FrameCurrent = sAllocFrameSegment(size2);
     ctx->FrameEnd = ctx->FrameCurrent + size2;
 
      // if possible merged new segment with existing ones
@@ -5187,7 +5739,8 @@ retry:
     }
 
     // can not be merged, we have wasted some memory
-    sAtomicAdd(&sMemFrameWasted,old_fe-old_fc);
+    if(old_fe!=old_fc)
+      sAtomicAdd(&sMemFrameWasted,old_fe-old_fc);
     ctx->FrameCurrent = sAlign(ctx->FrameCurrent,align);
   }
 
@@ -5202,6 +5755,7 @@ static sINLINE void sAllocFrameEndImpl(sThreadContext *ctx,void *ptr)
   sPtr end = (sPtr) ptr;
 
   sVERIFY(end <= ctx->FrameBorrow);
+  ctx->FrameUsed += end-ctx->FrameCurrent;
   ctx->FrameCurrent = end;
   ctx->FrameBorrow = 0;
 
@@ -5215,84 +5769,21 @@ static sINLINE void sAllocFrameEndImpl(sThreadContext *ctx,void *ptr)
   }
 }
 
-#if sCFG_ALLOCFRAME_FAST
-sINLINE void *sAllocFrame(sPtr size,int align/*=16*/)
-{
-  // multithread safe but may waste more memory then the slow version
-  // generally shouldn't be an issue for allocframe (most of the time small allocs with 16 byte alignment)
-
-  if(sMemFrameUsed==0)
-    sFatal(L"please use sPartitionMemory() in sMain() to allocate frame memory");
-
-  size = sAlign(size,16);
-  if(align>16)
-    size += sAlign(align,16);
-  sPtr end = sAtomicAdd(&sMemFrameUsed,size);
-  sWriteBarrier();
-  if(end > sMemFramePtr[sMemFrameToggle]+sMemFrameSize)
-    sFatal(L"out of frame mem");
-  sPtr result = sAlign(end-size,align);
-  return (void *) result;
-}
-
-#else
-
 void *sAllocFrame(sPtr size,int align)
 {
-  if(sMemFrameUsed==0)
-    sFatal(L"please use sPartitionMemory() in sMain() to allocate frame memory");
-
-  sPtr result = 0;
   sThreadContext *ctx = sGetThreadContext();
-  if(ctx->FrameFrame!=sMemFlipFrame)
-  {
-    // first alloc frame this frame, reset state
-    ctx->FrameFrame = sMemFlipFrame;
-    ctx->FrameBorrow = 0;
-    ctx->FrameCurrent = ctx->FrameEnd = 0;
-    ctx->FrameAltCurrent = ctx->FrameAltEnd =0;
-  }
+  sAllocFrameReset(ctx);
   if(ctx->FrameBorrow) sFatal(L"can't call sAllocFrame() between sAllocFrameBegin() and sAllocFrameEnd()");
-  if(ctx->FrameCurrent || align!=16)
-  {
-    if(align==16)
-    {
-      sBool fit = ctx->FrameCurrent ? sAlign(ctx->FrameCurrent,align)+size<=ctx->FrameEnd : 0;
-      sBool fitalt = ctx->FrameAltCurrent ? sAlign(ctx->FrameAltCurrent,align)+size<=ctx->FrameAltEnd : 0;
-      if(!fit&&!fitalt)
-        goto nonborrowed;   // don't discard borrowed segments for non-fitting allocation with native alignment
-    }
 
-    // we have or want borrowed memory, use it
-    result = (sPtr) sAllocFrameBeginImpl(ctx,size,align);
-    sAllocFrameEndImpl(ctx,(void *)(result+size));
-  }
-  else
-  {
-nonborrowed:
-    // no borrowed memory and native alignment
-    size = sAlign(size,16);
-    sPtr end = sAtomicAdd(&sMemFrameUsed,size);
-    sWriteBarrier();
-    if(end > sMemFramePtr[sMemFrameToggle]+sMemFrameSize)
-      sFatal(L"out of frame mem");
-    result = end-size;
-  }
-  return (void *) result;
+  void *result = sAllocFrameBeginImpl(ctx,size,align);
+  sAllocFrameEndImpl(ctx,(uint8_t *)result+size);
+  return result;
 }
-#endif // sCFG_ALLOCFRAME_FAST
 
 void *sAllocFrameBegin(int size,int align)
 {
   sThreadContext *ctx = sGetThreadContext();
-  if(ctx->FrameFrame!=sMemFlipFrame)
-  {
-    // first alloc frame this frame, reset state
-    ctx->FrameFrame = sMemFlipFrame;
-    ctx->FrameBorrow = 0;
-    ctx->FrameCurrent = ctx->FrameEnd = 0;
-    ctx->FrameAltCurrent = ctx->FrameAltEnd =0;
-  }
+  sAllocFrameReset(ctx);
   if(ctx->FrameBorrow) sFatal(L"can't call sAllocFrameBegin() between sAllocFrameBegin() and sAllocFrameEnd()");
 
   return sAllocFrameBeginImpl(ctx,size,align);
@@ -5303,7 +5794,13 @@ void sAllocFrameEnd(void *ptr)
   return sAllocFrameEndImpl(sGetThreadContext(),ptr);
 }
 
-#endif
+void sGetFrameMemStats(sPtr &used,sPtr &maxused)
+{
+  sThreadContext *ctx = sGetThreadContext();
+  sAllocFrameReset(ctx);
+  used = ctx->FrameUsed;
+  maxused = sMax(ctx->FrameMaxUsed,ctx->FrameUsed);
+}
 
 /****************************************************************************/
 
@@ -5632,6 +6129,7 @@ void sMemoryPool::Push()
   sStackItem *item = Stack.AddMany(1);
   item->CBuffer = Current;
   item->CPtr = Current->Current;
+  item->CFirst = First;
 }
 
 void sMemoryPool::Pop()
@@ -5639,6 +6137,12 @@ void sMemoryPool::Pop()
   int count = Stack.GetCount();
   sVERIFY(count);
   sStackItem *item = &Stack[count-1];
+  while(First!=item->CFirst)      // very large objects allocated after Push()
+  {
+    sMemoryPoolBuffer *n = First->Next;
+    delete First;
+    First = n;
+  }
   Current = item->CBuffer;
   sMemoryPoolBuffer *buf = item->CBuffer;
   buf->Current = item->CPtr;
@@ -5675,6 +6179,64 @@ sPtr sMemoryPool::BytesReserved() const
   return memsize;
 }
 
+/****************************************************************************/
+/***                                                                      ***/
+/***   Arena                                                              ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+sArena::sArena(sPtr defaultsize,int allocflags,int maxstacksize) : Pool(defaultsize,allocflags,maxstacksize)
+{
+  Dtors = 0;
+  Stack.HintSize(maxstacksize);
+}
+
+sArena::~sArena()
+{
+  RunDtors(0);
+}
+
+void sArena::AddDtor(void (*func)(void *,int),void *ptr,int count)
+{
+  Dtor *d = Pool.Alloc<Dtor>();
+  d->Func = func;
+  d->Ptr = ptr;
+  d->Count = count;
+  d->Next = Dtors;
+  Dtors = d;
+}
+
+void sArena::RunDtors(Dtor *last)
+{
+  while(Dtors!=last)
+  {
+    Dtor *d = Dtors;
+    Dtors = d->Next;              // before calling, the destructor may create objects
+    (*d->Func)(d->Ptr,d->Count);
+  }
+}
+
+void sArena::Reset()
+{
+  RunDtors(0);
+  Stack.Clear();
+  Pool.Reset();
+}
+
+void sArena::Push()
+{
+  Stack.AddTail(Dtors);
+  Pool.Push();
+}
+
+void sArena::Pop()
+{
+  sVERIFY(Stack.GetCount());
+  RunDtors(Stack.GetTail());
+  Stack.RemTail();
+  Pool.Pop();
+}
+
 /****************************************************************************/
 /***                                                                      ***/
 /***   Memory Leak Counter                                                ***/
@@ -6358,6 +6920,327 @@ sChar8 *sMemoryLeakTracker2::GetPersistentString8(const sChar *informationString
   return result;
 }
 
+/****************************************************************************/
+/***                                                                      ***/
+/***   Memory Profiler                                                    ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+struct sMemProfileSample
+{
+  void *Ptr;
+  sMemProfileSample *NextHash;    // also used for the free list
+  sMemProfileSite *Site;
+  uint64_t Bytes;                 // estimated bytes and allocations this sample stands for
+  uint64_t Count;
+  uint64_t Time;
+};
+
+static const int sMemProfileMaxSites = 0x1000;      // power of 2, one more site collects the overflow
+static const int sMemProfileMaxSamples = 0x10000;
+static const int sMemProfileFilterBits = 16;
+static const int sMemProfileHashShift = 2;          // hash uses the upper bits of the filter index
+
+static sThreadLock *sMemProfileLock;
+static sMemProfileSite *sMemProfileSites;
+static int sMemProfileSiteCount;
+static sMemProfileSample *sMemProfileSamples;
+static sMemProfileSample *sMemProfileFreeSamples;
+static sMemProfileSample **sMemProfileHash;
+static int sMemProfileLive;
+static int sMemProfileDropped;
+
+static const sChar *sMemProfileLifetimeNames[sMPL_BUCKETS] =
+{
+  L"<1us",L"<4us",L"<16us",L"<64us",L"<256us",L"<1ms",L"<4ms",L"<16ms",
+  L"<66ms",L"<262ms",L"<1s",L"<4s",L"<17s",L"<67s",L"<268s",L">268s",
+};
+
+static uint32_t sMemProfileFilterIndex(void *ptr)
+{
+  return uint32_t((uint64_t(sPtr(ptr))*0x9e3779b97f4a7c15ULL)>>(64-sMemProfileFilterBits));
+}
+
+// exponentially distributed distance to the next sample, so that every
+// byte has the same chance to be sampled regardless of allocation pattern
+
+static sPtr sMemProfileNextSkip(sThreadContext *tx,int rate)
+{
+  uint32_t x = tx->MemProfileSeed;
+  if(x==0)
+    x = uint32_t(sPtr(tx)>>4)|1;
+  x ^= x<<13;
+  x ^= x>>17;
+  x ^= x<<5;
+  tx->MemProfileSeed = x;
+  float u = ((x>>8)+1)*(1.0f/16777216.0f);      // (0..1]
+  return sPtr(-sFLog(u)*rate)+1;
+}
+
+static sMemProfileSite *sMemProfileFindSite(const char *file,int line,int heapid)
+{
+  if(!file)
+    line = 0;                     // the line of an untagged allocation is left over from an earlier one
+  uint32_t h = uint32_t(sPtr(file)>>3)*0x9e3779b1U + uint32_t(line)*0x85ebca6bU + heapid;
+  h ^= h>>15;
+  for(;;)
+  {
+    sMemProfileSite *site = &sMemProfileSites[h&(sMemProfileMaxSites-1)];
+    if(site->HeapId==heapid && site->File==file && site->Line==line)
+      return site;
+    if(site->HeapId<0)
+    {
+      if(sMemProfileSiteCount>=sMemProfileMaxSites*3/4)
+        return &sMemProfileSites[sMemProfileMaxSites];
+      sMemProfileSiteCount++;
+      site->File = file;
+      site->Line = line;
+      site->HeapId = heapid;
+      return site;
+    }
+    h++;
+  }
+}
+
+static void sMemProfileAlloc(sThreadContext *tx,int rate,void *ptr,sPtr size,int heapid,const char *file,int line)
+{
+  tx->MemProfileSkip = sMemProfileNextSkip(tx,rate);
+
+  // scale by the probability of sampling an allocation of this size
+
+  float x = float(sMax<sPtr>(size,1))/rate;
+  float p = x<0.01f ? x*(1-x*0.5f) : 1-sFExp(-x);
+  uint64_t bytes = uint64_t(size/p+0.5f);
+  uint64_t count = uint64_t(1/p);
+  if((1/p-count)*256>(tx->MemProfileSeed&255))    // round randomly, large allocations are often sampled
+    count++;
+  uint64_t time = sGetTimeUS();
+
+  sScopeLock lock(sMemProfileLock);
+  sMemProfileSample *s = sMemProfileFreeSamples;
+  if(!s)
+  {
+    sMemProfileDropped++;
+    return;
+  }
+  sMemProfileFreeSamples = s->NextHash;
+
+  sMemProfileSite *site = sMemProfileFindSite(file,line,heapid);
+  site->AllocBytes += bytes;
+  site->AllocCount += count;
+  site->LiveBytes += bytes;
+  site->LiveCount += count;
+
+  uint32_t f = sMemProfileFilterIndex(ptr);
+  s->Ptr = ptr;
+  s->Site = site;
+  s->Bytes = bytes;
+  s->Count = count;
+  s->Time = time;
+  s->NextHash = sMemProfileHash[f>>sMemProfileHashShift];
+  sMemProfileHash[f>>sMemProfileHashShift] = s;
+  if(sMemProfileFilter[f]<255)                      // saturated entries stay set
+    sMemProfileFilter[f]++;
+  sMemProfileLive++;
+}
+
+static void sMemProfileFree(void *ptr)
+{
+  uint32_t f = sMemProfileFilterIndex(ptr);
+  uint64_t time = sGetTimeUS();
+
+  sScopeLock lock(sMemProfileLock);
+  sMemProfileSample **sp = &sMemProfileHash[f>>sMemProfileHashShift];
+  while(*sp && (*sp)->Ptr!=ptr)
+    sp = &(*sp)->NextHash;
+  sMemProfileSample *s = *sp;
+  if(!s)
+    return;
+  *sp = s->NextHash;
+  if(sMemProfileFilter[f]<255)
+    sMemProfileFilter[f]--;
+
+  sMemProfileSite *site = s->Site;
+  site->LiveBytes -= s->Bytes;
+  site->LiveCount -= s->Count;
+  uint64_t us = time-s->Time;
+  site->Lifetime[us ? sMin(sMPL_BUCKETS-1,sFindHighestBit(us)/2+1) : 0]++;
+
+  s->NextHash = sMemProfileFreeSamples;
+  sMemProfileFreeSamples = s;
+  sMemProfileLive--;
+}
+
+static void sExitMemProfile()
+{
+  sMemProfileRate = 0;
+  if(!sMemProfileLock)
+    return;
+
+  uint8_t *filter = sMemProfileFilter;
+  sMemProfileFilter = 0;
+  sFreeMem(filter);
+  sFreeMem(sMemProfileHash);
+  sFreeMem(sMemProfileSamples);
+  sFreeMem(sMemProfileSites);
+  sDelete(sMemProfileLock);
+}
+
+/****************************************************************************/
+
+void sStartMemProfile(int rate)
+{
+  sVERIFY(rate>0);
+  if(!sMemProfileLock)
+  {
+    int memtype = (sIsMemTypeAvailable(sAMF_DEBUG) ? sAMF_DEBUG : sAMF_HEAP)|sAMF_NOLEAK;
+    sMemProfileSites = (sMemProfileSite *) sAllocMem(sizeof(sMemProfileSite)*(sMemProfileMaxSites+1),16,memtype);
+    sMemProfileSamples = (sMemProfileSample *) sAllocMem(sizeof(sMemProfileSample)*sMemProfileMaxSamples,16,memtype);
+    sMemProfileHash = (sMemProfileSample **) sAllocMem(sizeof(sMemProfileSample *)<<(sMemProfileFilterBits-sMemProfileHashShift),16,memtype);
+    uint8_t *filter = (uint8_t *) sAllocMem(1<<sMemProfileFilterBits,16,memtype);
+
+    sSetMem(sMemProfileSites,0,sizeof(sMemProfileSite)*(sMemProfileMaxSites+1));
+    for(int i=0;i<sMemProfileMaxSites;i++)
+      sMemProfileSites[i].HeapId = -1;
+    sMemProfileSiteCount = 0;
+    for(int i=0;i<sMemProfileMaxSamples;i++)
+      sMemProfileSamples[i].NextHash = i+1<sMemProfileMaxSamples ? &sMemProfileSamples[i+1] : 0;
+    sMemProfileFreeSamples = sMemProfileSamples;
+    sSetMem(sMemProfileHash,0,sizeof(sMemProfileSample *)<<(sMemProfileFilterBits-sMemProfileHashShift));
+    sSetMem(filter,0,1<<sMemProfileFilterBits);
+    sMemProfileLive = 0;
+    sMemProfileDropped = 0;
+
+    sMemProfileLock = new sThreadLock;
+    sMemoryBarrier();
+    sMemProfileFilter = filter;
+  }
+  sLogF(L"mem",L"memory profiler: one sample per %K\n",rate);
+  sMemProfileRate = rate;
+}
+
+void sStopMemProfile()
+{
+  sMemProfileRate = 0;
+}
+
+sBool sIsMemProfiling()
+{
+  return sMemProfileRate!=0;
+}
+
+void sGetMemProfile(sStaticArray<sMemProfileSite> &sites)
+{
+  sites.Clear();
+  if(!sMemProfileLock)
+    return;
+
+  // allocating with the lock held might sample and deadlock. sites
+  // added in between are missed.
+
+  sites.HintSize(sMemProfileSiteCount+1);
+
+  sScopeLock lock(sMemProfileLock);
+  for(int i=0;i<=sMemProfileMaxSites && sites.GetCount()<sites.GetSize();i++)
+    if(sMemProfileSites[i].HeapId>=0 && sMemProfileSites[i].AllocCount>0)
+      *sites.AddMany(1) = sMemProfileSites[i];
+}
+
+static void sMemProfileFrames(sTextBuffer &tb,const sMemProfileSite *site)
+{
+  if(site->HeapId==0)
+  {
+    tb.Print(L"other");
+    return;
+  }
+  tb.PrintF(L"memtype%02x%s",site->HeapId&sAMF_MASK,(site->HeapId&sAMF_ALT)?L"alt":L"");
+  if(!site->File)
+  {
+    tb.Print(L";untagged");
+    return;
+  }
+
+  // directories become frames, so the graph can be folded by path
+
+  sString<512> path;
+  sCopyString(path,site->File,512);
+  sChar *name = path;
+  for(sChar *c=path;*c;c++)
+  {
+    if(*c=='/' || *c=='\\')
+    {
+      *c = ';';
+      name = c+1;
+    }
+  }
+  const sChar *dirs = path;
+  while(*dirs==';')
+    dirs++;
+  tb.PrintF(L";%s;%s(%d)",dirs,name,site->Line);
+}
+
+sBool sDumpMemProfile(const sChar *filename,sBool total)
+{
+  sStaticArray<sMemProfileSite> sites;
+  sMemProfileSite *site;
+  sTextBuffer tb;
+
+  sGetMemProfile(sites);
+  sFORALL(sites,site)
+  {
+    uint64_t bytes = total ? site->AllocBytes : site->LiveBytes;
+    if(bytes>0)
+    {
+      sMemProfileFrames(tb,site);
+      tb.PrintF(L" %d\n",int64_t(bytes));
+    }
+  }
+  return sSaveTextAnsi(filename,tb.Get());
+}
+
+void sLogMemProfile(int maxsites)
+{
+  sStaticArray<sMemProfileSite> sites;
+  sMemProfileSite *site;
+  uint64_t live[sAMF_MASK+1];
+  uint64_t alloc[sAMF_MASK+1];
+
+  sGetMemProfile(sites);
+  sClear(live);
+  sClear(alloc);
+  sFORALL(sites,site)
+  {
+    live[site->HeapId&sAMF_MASK] += site->LiveBytes;
+    alloc[site->HeapId&sAMF_MASK] += site->AllocBytes;
+  }
+
+  sLogF(L"mem",L"memory profile: %d sites, %d samples live, %d dropped\n",sites.GetCount(),sMemProfileLive,sMemProfileDropped);
+  for(int i=0;i<=sAMF_MASK;i++)
+    if(alloc[i])
+      sLogF(L"mem",L"memtype %02x: %K live, %K allocated\n",i,live[i],alloc[i]);
+
+  sSortDown(sites,&sMemProfileSite::LiveBytes);
+  for(int i=0;i<sMin(maxsites,sites.GetCount());i++)
+  {
+    site = &sites[i];
+    sString<128> s,b;
+    if(site->File)
+      sCopyString(s,site->File,128);
+    else
+      s = site->HeapId ? L"untagged" : L"other";
+    b.PrintF(L"%p(%d):",s,site->Line);
+    sLogF(L"mem",L"%s%_ %5K live in %5K, %5K total in %5K, memtype %02x\n",b,60-sGetStringLen(b),
+      site->LiveBytes,site->LiveCount,site->AllocBytes,site->AllocCount,site->HeapId);
+
+    sTextBuffer tb;
+    for(int j=0;j<sMPL_BUCKETS;j++)
+      if(site->Lifetime[j])
+        tb.PrintF(L" %s:%d",sMemProfileLifetimeNames[j],site->Lifetime[j]);
+    if(tb.GetCount()>0)
+      sLogF(L"mem",L"  lifetime%s\n",tb.Get());
+  }
+}
+
 /****************************************************************************/
 /***                                                                      ***/
 /***   Memory Heap (simple, slow, efficient)                              ***/
@@ -6385,6 +7268,7 @@ sMemoryHeap::sMemoryHeap()
   TotalFree = 0;
   LastFreeNode = 0;
   Clear = MEMVERBOSE;
+  ThreadCache = 0;
 }
 
 void sMemoryHeap::Init(uint8_t *start,sPtr size)
@@ -6407,11 +7291,41 @@ void sMemoryHeap::Init(uint8_t *start,sPtr size)
   MinTotalFree = GetFree();
 }
 
+void sMemoryHeap::Extend(uint8_t *end)
+{
+  sPtr e = ((sPtr(end)+HEADER)&(~MASK))-HEADER;
+  if(e<=End) return;
+  sPtr size = e-End;
+
+  if(Clear) sSetMem((void *)End,0xaa,size);
+
+  sMemoryHeapFreeNode *last = FreeList.IsEmpty() ? 0 : FreeList.GetTail();
+  if(last && sPtr(last)+last->Size==End)
+  {
+    last->Size += size;
+  }
+  else
+  {
+    sMemoryHeapFreeNode *node = (sMemoryHeapFreeNode *) End;
+    node->Size = size;
+    FreeList.AddTail(node);
+  }
+  TotalFree += size;
+  End = e;
+}
+
 void sMemoryHeap::SetDebug(sBool clear,int memwall)
 {
   Clear = clear;
 }
 
+void sMemoryHeap::SetThreadCache(sBool enable)
+{
+  if(!enable)
+    sFlushMemCache();
+  ThreadCache = enable;
+}
+
 /****************************************************************************/
 
 sCONFIG_SIZET sMemoryHeap::GetFree()
@@ -6809,10 +7723,622 @@ sPtr sMemoryHeap::MemSize(void *ptr)
 
 /****************************************************************************/
 
+// Blocks of up to sMTC_CLASSES granules are cached per thread, one list per
+// size. Cached blocks stay allocated in the heap and keep their header, so
+// they can be handed out again by just rewriting the requested size. 
+// Batches are taken from and returned to the heap with a single lock.
+//
+// Busy is only ever contended by sFlushMemCache(). The owner does not wait
+// for it, it uses the heap directly instead. Releasing it needs no full
+// barrier, the swap that takes it is one.
+//
+// Threads not created with sThread all share the emergency context, they
+// never cache.
+
+static sINLINE int sMemoryCacheBatch(int cl)
+{
+  return sClamp(4096/((cl+1)*ALIGN),4,32);
+}
+
+void *sMemoryHeap::Refill(sMemoryThreadCache *c,int cl)
+{
+  sPtr bytes = (cl+1)*ALIGN-HEADER;
+  int n = sMemoryCacheBatch(cl);
+  void *list = 0;
+  Lock();
+  for(int i=0;i<n;i++)
+  {
+    void *p = Alloc(bytes,0,0);
+    if(!p) break;
+    *(void **)p = list;
+    list = p;
+    c->Count[cl]++;
+  }
+  Unlock();
+  return list;
+}
+
+void sMemoryHeap::Drain(sMemoryThreadCache *c,int cl,int keep)
+{
+  if(c->Count[cl]<=keep) return;
+  Lock();
+  while(c->Count[cl]>keep)
+  {
+    void *p = c->List[cl];
+    c->List[cl] = *(void **)p;
+    c->Count[cl]--;
+    Free(p);
+  }
+  Unlock();
+}
+
+void *sMemoryHeap::CacheAlloc(sPtr bytes,int align,int flags)
+{
+  if(!ThreadCache || !IsThreadSafe() || Clear || align>ALIGN || (flags & sAMF_ALT) || !sMemoryCacheLock)
+    return 0;
+  sPtr size = ((bytes+HEADER+MASK)&(~MASK));
+  int cl = int(size/ALIGN)-1;
+  if(cl>=sMTC_CLASSES || bytes>=size)
+    return 0;
+
+  sThreadContext *tx = sGetThreadContext();
+  if(!tx->Thread)                 // the emergency context is shared by all foreign threads
+    return 0;
+  sMemoryThreadCache *c = &tx->MemCache;
+  if(c->Heap!=this)
+  {
+    if(c->Heap) return 0;         // bound to another heap
+    sScopeLock sl(sMemoryCacheLock);
+    if(c->Heap) return 0;
+    c->Heap = this;
+    c->Next = sMemoryCaches;
+    sMemoryCaches = c;
+  }
+  if(sAtomicSwap(&c->Busy,1))
+    return 0;
+
+  void *p = c->List[cl];
+  if(!p)
+    p = Refill(c,cl);
+  if(p)
+  {
+    c->List[cl] = *(void **)p;
+    c->Count[cl]--;
+    ((sPtr *)p)[-1] = bytes;
+  }
+  sWriteBarrier();
+  c->Busy = 0;
+  return p;
+}
+
+sBool sMemoryHeap::CacheFree(void *ptr)
+{
+  if(!ThreadCache || !IsThreadSafe() || Clear || !sMemoryCacheLock)
+    return 0;
+  sPtr bytes = ((sPtr *)ptr)[-1];
+  sPtr size = ((bytes+HEADER+MASK)&(~MASK));
+  int cl = int(size/ALIGN)-1;
+  if(cl>=sMTC_CLASSES)
+    return 0;
+
+  sMemoryThreadCache *c = &sGetThreadContext()->MemCache;
+  if(c->Heap!=this || sAtomicSwap(&c->Busy,1))
+    return 0;
+
+  *(void **)ptr = c->List[cl];
+  c->List[cl] = ptr;
+  c->Count[cl]++;
+  int batch = sMemoryCacheBatch(cl);
+  if(c->Count[cl]>2*batch)
+    Drain(c,cl,batch);
+  sWriteBarrier();
+  c->Busy = 0;
+  return 1;
+}
+
+void sMemoryHeap::FlushCache(sMemoryThreadCache *c)
+{
+  while(sAtomicSwap(&c->Busy,1))   // the owner holds it only for a short time
+    sSleep(0);
+  for(int i=0;i<sMTC_CLASSES;i++)
+    Drain(c,i,0);
+  sWriteBarrier();
+  c->Busy = 0;
+}
+
+/****************************************************************************/
+
 #undef HEADER
 #undef OFFSET
 #undef MASK
 
+/****************************************************************************/
+/***                                                                      ***/
+/***   two level segregated fit heap                                      ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+// Free blocks are kept in lists by size: the first level is the power of
+// two, the second level splits that into 16 ranges. Two bitmaps find the
+// smallest non empty list that is guaranteed to fit without walking it.
+// Every block knows its physical neighbours, so free blocks are merged
+// immediately.
+//
+// Used blocks keep the bytes they have beyond the requested size, so
+// MemSize() returns the requested size like sMemoryHeap does. With 64 bit
+// pointers they go to the top byte of Size, 32 bit sizes have no room for
+// that and use a field of their own.
+
+#define TLSFHEADER  (sPtr(sOFFSET(sTlsfHeapBlock,NextFree)))
+#define TLSFMIN     (sPtr((sizeof(sTlsfHeapBlock)+Granule-1)&~(Granule-1)))
+#if sCONFIG_64BIT
+#define TLSFSLACK   56
+#define TLSFSIZE(b) ((b)->Size&((sPtr(1)<<TLSFSLACK)-Granule))
+#define TLSFGETSLACK(b) ((b)->Size>>TLSFSLACK)
+#define TLSFSETSLACK(b,s) ((b)->Size |= sPtr(s)<<TLSFSLACK)
+#else
+#define TLSFSIZE(b) ((b)->Size&~sPtr(Granule-1))
+#define TLSFGETSLACK(b) ((b)->Slack)
+#define TLSFSETSLACK(b,s) ((b)->Slack = sPtr(s))
+#endif
+#define TLSFFREE    1
+
+void sTlsfHeap::Mapping(sPtr size,int &fl,int &sl)
+{
+  if(size<(sPtr(1)<<FLShift))
+  {
+    fl = 0;
+    sl = int(size/Granule);
+  }
+  else
+  {
+    int t = sFindHighestBit(size);
+    sl = int(size>>(t-SLLog2))-SLCount;
+    fl = t-(FLShift-1);
+  }
+}
+
+sTlsfHeap::sTlsfHeap()
+{
+  Start = 0;
+  End = 0;
+  TotalFree = 0;
+  Clear = 0;
+  FLBitmap = 0;
+  sClear(SLBitmap);
+  sClear(Lists);
+  LastPhys = 0;
+}
+
+void sTlsfHeap::Init(uint8_t *start,sPtr size)
+{
+  sVERIFY(start);
+  Start = sPtr(start);
+  End = Start + size;
+
+  Start = ((Start+TLSFHEADER+Granule-1)&~sPtr(Granule-1))-TLSFHEADER;   // user data is aligned
+  End = ((End+TLSFHEADER)&~sPtr(Granule-1))-TLSFHEADER;
+  sVERIFY(End-Start>=TLSFMIN);
+
+  if(Clear) sSetMem((void *)Start,0xaa,End-Start);
+
+  FLBitmap = 0;
+  sClear(SLBitmap);
+  sClear(Lists);
+
+  sTlsfHeapBlock *b = (sTlsfHeapBlock *) Start;
+  b->PrevPhys = 0;
+  b->Size = (End-Start)|TLSFFREE;
+  AddFree(b);
+  LastPhys = b;
+  TotalFree = End-Start;
+  MinTotalFree = GetFree();
+}
+
+void sTlsfHeap::Extend(uint8_t *end)
+{
+  sPtr e = ((sPtr(end)+TLSFHEADER)&~sPtr(Granule-1))-TLSFHEADER;
+  if(e<End+TLSFMIN) return;
+  sPtr size = e-End;
+
+  if(Clear) sSetMem((void *)End,0xaa,size);
+
+  sTlsfHeapBlock *b = (sTlsfHeapBlock *) End;
+  if(LastPhys->Size & TLSFFREE)
+  {
+    b = LastPhys;
+    RemFree(b);
+    b->Size += size;
+  }
+  else
+  {
+    b->PrevPhys = LastPhys;
+    b->Size = size|TLSFFREE;
+    LastPhys = b;
+  }
+  AddFree(b);
+  TotalFree += size;
+  End = e;
+}
+
+void sTlsfHeap::SetDebug(sBool clear,int)
+{
+  Clear = clear;
+}
+
+/****************************************************************************/
+
+sTlsfHeapBlock *sTlsfHeap::GetNextPhys(sTlsfHeapBlock *b) const
+{
+  sPtr n = sPtr(b)+TLSFSIZE(b);
+  return n<End ? (sTlsfHeapBlock *) n : 0;
+}
+
+void sTlsfHeap::AddFree(sTlsfHeapBlock *b)
+{
+  int fl,sl;
+  Mapping(TLSFSIZE(b),fl,sl);
+  b->PrevFree = 0;
+  b->NextFree = Lists[fl][sl];
+  if(b->NextFree)
+    b->NextFree->PrevFree = b;
+  Lists[fl][sl] = b;
+  FLBitmap |= uint64_t(1)<<fl;
+  SLBitmap[fl] |= 1U<<sl;
+}
+
+void sTlsfHeap::RemFree(sTlsfHeapBlock *b)
+{
+  int fl,sl;
+  Mapping(TLSFSIZE(b),fl,sl);
+  if(b->NextFree)
+    b->NextFree->PrevFree = b->PrevFree;
+  if(b->PrevFree)
+    b->PrevFree->NextFree = b->NextFree;
+  else
+  {
+    Lists[fl][sl] = b->NextFree;
+    if(!b->NextFree)
+    {
+      SLBitmap[fl] &= ~(1U<<sl);
+      if(!SLBitmap[fl])
+        FLBitmap &= ~(uint64_t(1)<<fl);
+    }
+  }
+}
+
+sTlsfHeapBlock *sTlsfHeap::FindFree(sPtr size)
+{
+  if(size>=(sPtr(1)<<FLShift))    // round up, so every block in the list is large enough
+    size += (sPtr(1)<<(sFindHighestBit(size)-SLLog2))-1;
+
+  int fl,sl;
+  Mapping(size,fl,sl);
+  if(fl>=FLCount) return 0;
+
+  uint32_t slmap = SLBitmap[fl] & (~0U<<sl);
+  if(!slmap)
+  {
+    uint64_t flmap = fl+1<FLCount ? FLBitmap & (~uint64_t(0)<<(fl+1)) : 0;
+    if(!flmap) return 0;
+    fl = sFindLowestBit(flmap);
+    slmap = SLBitmap[fl];
+  }
+  sl = sFindLowestBit(slmap);
+  return Lists[fl][sl];
+}
+
+void sTlsfHeap::Split(sTlsfHeapBlock *b,sPtr size)   // b is not in a list, rest will be free
+{
+  sPtr bsize = TLSFSIZE(b);
+  if(bsize-size<TLSFMIN) return;
+
+  sTlsfHeapBlock *r = (sTlsfHeapBlock *) (sPtr(b)+size);
+  r->PrevPhys = b;
+  r->Size = (bsize-size)|TLSFFREE;
+  b->Size = size | (b->Size&TLSFFREE);
+  sTlsfHeapBlock *n = GetNextPhys(r);
+  if(n) n->PrevPhys = r;
+  else LastPhys = r;
+  AddFree(r);
+}
+
+/****************************************************************************/
+
+void *sTlsfHeap::Alloc(sPtr bytes,int align,int flags)
+{
+  sPtr size = (bytes+TLSFHEADER+Granule-1)&~sPtr(Granule-1);
+  sVERIFY(bytes<size);                        // overflow check
+  size = sMax(size,TLSFMIN);
+  if(align<Granule) align = Granule;
+
+  sPtr search = size;
+  if(align>Granule)                           // room to split off the misaligned start
+    search += align+TLSFMIN;
+  if(search>TotalFree) return 0;
+
+  sTlsfHeapBlock *b = FindFree(search);
+  if(!b) return 0;
+  RemFree(b);
+
+  sPtr bs = sPtr(b);
+  sPtr be = bs+TLSFSIZE(b);
+  sPtr as;
+  if(!(flags & sAMF_ALT))
+  {
+    as = sAlign(bs+TLSFHEADER,align)-TLSFHEADER;
+    if(as!=bs && as-bs<TLSFMIN)
+      as = sAlign(bs+TLSFMIN+TLSFHEADER,align)-TLSFHEADER;
+  }
+  else
+  {
+    as = ((be-size+TLSFHEADER)&~sPtr(align-1))-TLSFHEADER;
+    if(as-bs<TLSFMIN)                         // only possible with default alignment
+      as = bs;
+  }
+  sVERIFY(as>=bs && as+size<=be);
+
+  if(as!=bs)                                  // free block in front
+  {
+    sTlsfHeapBlock *a = (sTlsfHeapBlock *) as;
+    a->PrevPhys = b;
+    a->Size = be-as;
+    b->Size = (as-bs)|TLSFFREE;
+    sTlsfHeapBlock *n = GetNextPhys(a);
+    if(n) n->PrevPhys = a;
+    else LastPhys = a;
+    AddFree(b);
+    b = a;
+  }
+  b->Size &= ~sPtr(TLSFFREE);
+  Split(b,size);
+
+  size = TLSFSIZE(b);
+  sVERIFY(size-TLSFHEADER-bytes<256);
+  TLSFSETSLACK(b,size-TLSFHEADER-bytes);
+  TotalFree -= size;
+  MinTotalFree = sMin(TotalFree,MinTotalFree);
+  sAtomicAdd(&sMemoryUsed,size);
+
+  void *ptr = (void *)(sPtr(b)+TLSFHEADER);
+  if(Clear) sSetMem(ptr,0xcc,size-TLSFHEADER);
+  return ptr;
+}
+
+sBool sTlsfHeap::Free(void *ptr)
+{
+  sTlsfHeapBlock *b = (sTlsfHeapBlock *) (sPtr(ptr)-TLSFHEADER);
+  sVERIFY(sPtr(b)>=Start && sPtr(b)<End);
+  sVERIFY(!(b->Size & TLSFFREE));
+
+  sPtr size = TLSFSIZE(b);
+  TotalFree += size;
+  sAtomicAdd(&sMemoryUsed,-(ptrdiff_t)size);
+  if(Clear) sSetMem(ptr,0xee,size-TLSFHEADER);
+
+  b->Size = size|TLSFFREE;
+
+  sTlsfHeapBlock *p = b->PrevPhys;
+  if(p && (p->Size & TLSFFREE))               // merge with the block before
+  {
+    RemFree(p);
+    p->Size += TLSFSIZE(b);
+    b = p;
+  }
+  sTlsfHeapBlock *n = GetNextPhys(b);
+  if(n && (n->Size & TLSFFREE))               // merge with the block after
+  {
+    RemFree(n);
+    b->Size += TLSFSIZE(n);
+    n = GetNextPhys(b);
+  }
+  if(n) n->PrevPhys = b;
+  else LastPhys = b;
+  AddFree(b);
+
+  return 1;
+}
+
+sPtr sTlsfHeap::MemSize(void *ptr)
+{
+  sTlsfHeapBlock *b = (sTlsfHeapBlock *) (sPtr(ptr)-TLSFHEADER);
+  return TLSFSIZE(b)-TLSFHEADER-TLSFGETSLACK(b);
+}
+
+/****************************************************************************/
+
+sCONFIG_SIZET sTlsfHeap::GetFree()
+{
+  return TotalFree;
+}
+
+sCONFIG_SIZET sTlsfHeap::GetLargestFree()
+{
+  Lock();
+  sPtr max = 0;
+  if(FLBitmap)
+  {
+    int fl = sFindHighestBit(FLBitmap);
+    int sl = sFindHighestBit(SLBitmap[fl]);
+    for(sTlsfHeapBlock *b=Lists[fl][sl];b;b=b->NextFree)
+      max = sMax(max,TLSFSIZE(b));
+  }
+  Unlock();
+  return max>TLSFHEADER ? max-TLSFHEADER : 0;
+}
+
+sPtr sTlsfHeap::GetUsed()
+{
+  return End-Start-TotalFree;
+}
+
+void sTlsfHeap::DumpStats(int verbose)
+{
+  int count = 0;
+  int fcount = 0;
+  int ucount = 0;
+  sPtr largest = 0;
+  sPtr free = 0;
+  sPtr smallest = 0x7fffffff;
+  sPtr fragged = 0;
+
+  for(sTlsfHeapBlock *b=(sTlsfHeapBlock *)Start;b;b=GetNextPhys(b))
+  {
+    sPtr size = TLSFSIZE(b);
+    if(!(b->Size & TLSFFREE))
+    {
+      ucount++;
+      continue;
+    }
+    count++;
+    free += size;
+    if(size<64*1024)
+    {
+      fragged += size;
+      fcount++;
+    }
+    largest = sMax(largest,size);
+    smallest = sMin(smallest,size);
+  }
+  if(count==0)
+    smallest = 0;
+
+  uint32_t hash = MakeSnapshot();
+  sLogF(L"mem",L"TlsfHeapStats: %08x..%08x, HASH %08x\n",Start,End,hash);
+  sLogF(L"mem",L"%08x(%5K) Free in %d nodes, %d used nodes\n",free,free,count,ucount);
+  sLogF(L"mem",L"%08x(%5K) Largest\n",largest,largest);
+  sLogF(L"mem",L"%08x(%5K) Smallest\n",smallest,smallest);
+  sLogF(L"mem",L"%08x(%5K) Fragged in %d nodes\n",fragged,fragged,fcount);
+  sLogF(L"mem",L"%08x(%5K) Unfragged in %d nodes\n",free-fragged,free-fragged,count-fcount);
+  if(verbose)
+  {
+    for(int fl=0;fl<FLCount;fl++)
+    {
+      if(!SLBitmap[fl]) continue;
+      int n = 0;
+      for(int sl=0;sl<SLCount;sl++)
+        for(sTlsfHeapBlock *b=Lists[fl][sl];b;b=b->NextFree)
+          n++;
+      sLogF(L"mem",L"level %2d: %d free nodes\n",fl,n);
+    }
+  }
+  if(free!=TotalFree)
+    sLogF(L"mem",L"Heap Corrupted! (%08x free, %08x should)\n",free,TotalFree);
+}
+
+uint32_t sTlsfHeap::MakeSnapshot()
+{
+  int freeNodeCount = 0;
+  sChecksumAdler32Begin();
+  for(sTlsfHeapBlock *b=(sTlsfHeapBlock *)Start;b;b=GetNextPhys(b))
+  {
+    if(b->Size & TLSFFREE)
+    {
+      sPtr node[2] = { sPtr(b),b->Size };     // the list links depend on the order of freeing
+      sChecksumAdler32Add((const uint8_t *)node,sizeof(node));
+      freeNodeCount++;
+    }
+  }
+  sLogF(L"mem", L"Free mem nodes: %d\n", freeNodeCount);
+  return sChecksumAdler32End();
+}
+
+void sTlsfHeap::Validate()
+{
+  sPtr free = 0;
+  int freecount = 0;
+  int errors = 0;
+  sTlsfHeapBlock *prev = 0;
+
+  // physical order
+
+  for(sTlsfHeapBlock *b=(sTlsfHeapBlock *)Start;b;b=GetNextPhys(b))
+  {
+    sPtr size = TLSFSIZE(b);
+    if(b->PrevPhys!=prev)
+    {
+      sLogF(L"mem",L"block %08x: wrong previous block %08x, should be %08x\n",sPtr(b),sPtr(b->PrevPhys),sPtr(prev));
+      errors++;
+    }
+    if(size<TLSFMIN || sPtr(b)+size>End)
+    {
+      sLogF(L"mem",L"invalid block size! %08x for %08x\n",sPtr(b),size);
+      errors++;
+      break;
+    }
+    if(b->Size & TLSFFREE)
+    {
+      if(prev && (prev->Size & TLSFFREE))
+      {
+        sLogF(L"mem",L"nodes not merged! %08x..%08x\n",sPtr(prev),sPtr(b));
+        errors++;
+      }
+      free += size;
+      freecount++;
+    }
+    prev = b;
+  }
+  if(prev!=LastPhys)
+  {
+    sLogF(L"mem",L"last block is %08x, should be %08x\n",sPtr(LastPhys),sPtr(prev));
+    errors++;
+  }
+
+  // lists and bitmaps
+
+  for(int fl=0;fl<FLCount;fl++)
+  {
+    if(((FLBitmap>>fl)&1)!=(SLBitmap[fl]!=0))
+    {
+      sLogF(L"mem",L"first level bitmap wrong at %d\n",fl);
+      errors++;
+    }
+    for(int sl=0;sl<SLCount;sl++)
+    {
+      if(((SLBitmap[fl]>>sl)&1)!=(Lists[fl][sl]!=0))
+      {
+        sLogF(L"mem",L"second level bitmap wrong at %d/%d\n",fl,sl);
+        errors++;
+      }
+      sTlsfHeapBlock *last = 0;
+      for(sTlsfHeapBlock *b=Lists[fl][sl];b;b=b->NextFree)
+      {
+        int bfl,bsl;
+        Mapping(TLSFSIZE(b),bfl,bsl);
+        if(!(b->Size & TLSFFREE) || bfl!=fl || bsl!=sl || b->PrevFree!=last)
+        {
+          sLogF(L"mem",L"block %08x in wrong free list %d/%d\n",sPtr(b),fl,sl);
+          errors++;
+          break;
+        }
+        last = b;
+        freecount--;
+      }
+    }
+  }
+
+  if(freecount!=0)
+  {
+    sLogF(L"mem",L"%d free blocks not in a free list\n",freecount);
+    errors++;
+  }
+  if(free!=TotalFree)
+  {
+    sLogF(L"mem",L"%08x free, %08x expected\n",free,TotalFree);
+    errors++;
+  }
+  if(errors)
+    sFatal(L"heap corrupted");
+}
+
+#undef TLSFHEADER
+#undef TLSFMIN
+#undef TLSFSLACK
+#undef TLSFSIZE
+#undef TLSFGETSLACK
+#undef TLSFSETSLACK
+#undef TLSFFREE
+
 
 /****************************************************************************/
 /***                                                                      ***/
@@ -19,6 +19,8 @@
 #endif
 
 #include <cstdint>
+#include <new>                    // placement new, see sPlacementNew()
+#include <type_traits>            // sMoveElements(), sArena
 
 #ifndef NN_COMPILER_RVCT
 ; // if this semicolon causes an error, then something is wrong BEFORE
@@ -214,7 +216,6 @@
 #if defined(_WIN32)
 #define sCONFIG_SYSTEM_WINDOWS 1
 #define sPLATFORM sPLAT_WINDOWS
-#define sCONFIG_FRAMEMEM_MT 1
 #else
 
 
@@ -225,7 +226,6 @@
 
 #define sCONFIG_SYSTEM_LINUX 1
 #define sPLATFORM sPLAT_LINUX
-#define sCONFIG_FRAMEMEM_MT 1
 
 #endif
 #endif
@@ -775,6 +775,13 @@ sINLINE uint64_t sAlign(uint64_t a,int b)                                  {retu
 template <class Type> sINLINE Type sSquare(Type a)                  {return a*a;}
 int sFindLowerPower(int x);
 int sFindHigherPower(int x);
+#if sCONFIG_COMPILER_GCC
+sINLINE int sFindLowestBit(uint64_t x)                             {return __builtin_ctzll(x);}   // x must not be 0
+sINLINE int sFindHighestBit(uint64_t x)                            {return 63-__builtin_clzll(x);}
+#else
+sINLINE int sFindLowestBit(uint64_t x)                             {int n=0; while(!(x&1)) { x>>=1; n++; } return n;}
+sINLINE int sFindHighestBit(uint64_t x)                            {int n=0; while(x>>=1) n++; return n;}
+#endif
 uint32_t sMakeMask(uint32_t max);
 uint64_t sMakeMask(uint64_t max);
 inline sBool sIsPower2(int x)                                      {return (x&(x-1)) == 0;}
@@ -1133,6 +1140,16 @@ struct sFloatInfo
 
   void DoubleToAscii(uint64_t f,int digits=17); 
   uint64_t AsciiToDouble();
+
+  // fewest digits that still read back as the same double (Ryu), exact
+
+  void DoubleToShortest(uint64_t f);
+
+  // when PrintF(fractions) would cut the digits, replace them with the
+  // double rounded exactly to that many fractions. ties go to even, as in
+  // the C library. rounding the digits again could round twice.
+
+  void RoundFractions(uint64_t f,int fractions);
 };
 
 /****************************************************************************/
@@ -1161,6 +1178,7 @@ struct sFormatStringBuffer
   sBool Fill();
   void GetInfo(sFormatStringInfo &);
   void Add(const sFormatStringInfo &info,const sChar *buffer,sBool sign);
+  void Add(const sFormatStringInfo &info,const sChar *buffer,int len,sBool sign);
   void Print(const sChar *str);
   template<typename Type> void PrintInt(const sFormatStringInfo &info,Type v,sBool sign);
   void PrintFloat(const sFormatStringInfo &info,float v);
@@ -1170,9 +1188,9 @@ struct sFormatStringBuffer
 
 sFormatStringBuffer sFormatStringBase(const sStringDesc &buffer,const sChar *format);
 void sFormatStringBaseCtx(sFormatStringBuffer &buf,const sChar *format); // size of buffer is sPRINTBUFFERSIZE
-//sFormatStringBuffer& operator% (sFormatStringBuffer &,int);
+sFormatStringBuffer& operator% (sFormatStringBuffer &,int);
 //sFormatStringBuffer& operator% (sFormatStringBuffer &,ptrdiff_t);
-//sFormatStringBuffer& operator% (sFormatStringBuffer &,uint32_t);
+sFormatStringBuffer& operator% (sFormatStringBuffer &,uint32_t);
 sFormatStringBuffer& operator% (sFormatStringBuffer &,uint64_t);
 sFormatStringBuffer& operator% (sFormatStringBuffer &,int64_t);
 sFormatStringBuffer& operator% (sFormatStringBuffer &,void *);
@@ -1181,6 +1199,10 @@ sFormatStringBuffer& operator% (sFormatStringBuffer &,double);
 sFormatStringBuffer& operator% (sFormatStringBuffer &,const sChar *);
 
 //inline sFormatStringBuffer& operator% (sFormatStringBuffer & buf,uint32_t v)     { return buf%(int)v; }
+#if sCONFIG_COMPILER_GCC && sCONFIG_64BIT && sPLATFORM==sPLAT_LINUX   // int64_t is long here, but sPtr is long long
+inline sFormatStringBuffer& operator% (sFormatStringBuffer &f,long long v)           { return f%int64_t(v); }
+inline sFormatStringBuffer& operator% (sFormatStringBuffer &f,unsigned long long v)  { return f%uint64_t(v); }
+#endif
 
 // we want to get rid of the variable arg thing and have a typesafe solution
 // three examples:
@@ -1569,6 +1591,10 @@ enum sInitMemFlags                // sInitMem() flags
   sIMF_NORTL        = 0x0004,     // pc only: use altona heap instead of RTL heap.
   sIMF_CLEAR        = 0x0008,     // debugging: clear memory on allocation and freeing
   sIMF_NOLEAKTRACK  = 0x0010,     // prevent initialization of leaktracker
+  sIMF_TLSF         = 0x0020,     // pc only: with sIMF_NORTL, use sTlsfHeap instead of sMemoryHeap
+  sIMF_HUGEPAGES    = 0x0040,     // linux only: back heap and frame memory with 2 MB pages
+  sIMF_GROW         = 0x0080,     // linux only: with sIMF_NORTL, the heap starts at sMemoryInitSize and grows on demand
+  sIMF_PROFILE      = 0x0100,     // start the sampling memory profiler, see sStartMemProfile()
 };
 
 class sMemoryHandler              // used by system to register memory handlers
@@ -1593,6 +1619,7 @@ public:
   virtual sPtr MemSize(void *) { return 0; } // exact size of allocation
   virtual void Validate() {}      // check integrity of memory lists
   virtual uint32_t MakeSnapshot() { return 0; }
+  virtual sBool Grow(sPtr) { return 0; }       // make room for an allocation that failed, called locked
 
   // statistics
   virtual sCONFIG_SIZET GetSize() { return End-Start; }
@@ -1601,6 +1628,10 @@ public:
 
   sBool Contains(void *ptr) { return sPtr(ptr)>=Start&&sPtr(ptr)<End; }
 
+  // per thread caches, called by sAllocMem() and sFreeMem() without locking
+  virtual void *CacheAlloc(sPtr,int,int) { return 0; }
+  virtual sBool CacheFree(void *) { return 0; }
+
   // thread safety
   void MakeThreadSafe();          // set up threadsafe locking
   virtual void MakeThreadUnsafe();// sometimes you need always thread safe memory
@@ -1614,6 +1645,19 @@ public:
 
 /****************************************************************************/
 
+enum { sMTC_CLASSES = 16 };       // size classes of sMemoryThreadCache, in heap granules
+
+struct sMemoryThreadCache         // small blocks cached by one thread, part of sThreadContext
+{
+  sMemoryThreadCache *Next;       // all caches in use, for sFlushMemCache()
+  class sMemoryHeap *Heap;        // all blocks are from this heap
+  volatile uint32_t Busy;         // owner is using the cache, or sFlushMemCache() empties it
+  int Count[sMTC_CLASSES];
+  void *List[sMTC_CLASSES];       // single linked through the first word after the header
+};
+
+/****************************************************************************/
+
 extern sPtr sMemoryUsed;
 extern int sMemoryInitFlags;
 extern sPtr sMemoryInitSize;
@@ -1645,6 +1689,9 @@ inline void sEndAlt() { sPopMemType(sAMF_HEAP|sAMF_ALT); }
 void sSetInfoForAlloc(void *ptr, const sChar *infostring);
 
 
+void sFlushMemCache(struct sThreadContext *tx=0); // return small blocks cached by a thread (or all threads) to their heaps
+void sRemoveMemCache(struct sThreadContext *tx);  // thread context is going away, flush and forget its cache
+
 void sMemMark(sBool fatal=sTRUE);  // first call: set memmark. subsequent call: restore memmark
 void sResetMemChecksum();          // reset the checksum for memory management. 
 void sMemMarkPush(int id=-1);   // pushes the current memmark on the memmarkstack
@@ -1779,9 +1826,10 @@ T* sPlacementNew(void *ptr, ARG0 arg0, ARG1 arg1, ARG2 arg2){ return new (ptr) T
 
 void sPartitionMemory(sPtr frame=0,sPtr dma=0,sPtr gfx=0);    // allocate buffers for sAllocFrame and sAllocDma, and partition gpu/cpu memory for unified architectures
 void sFrameMemDoubleBuffer(sBool enable);                     // change frame mem double buffering (useful for multithreading), results in sFlipMem
-void *sAllocFrame(sPtr size,int align=16);   // cpu accessable memory, not double buffered
+void *sAllocFrame(sPtr size,int align=16);   // cpu accessable memory, not double buffered. lock free, any thread may use it
 void *sAllocFrameBegin(int max,int align);
 void sAllocFrameEnd(void *);
+void sGetFrameMemStats(sPtr &used,sPtr &maxused);  // frame memory of the calling thread: this frame and high water mark
 sBool sIsFrameMem(void *);
 sBool sIsDmaMem(void *);
 void *sAllocDma(sPtr size,int align=16);     // gpu accessable memory (cpu is write only), double buffered
@@ -2222,6 +2270,24 @@ void sGetCaller(const sStringDesc &filename, int &line);
 
 #define TRACK_ARRAY_USAGE sDEBUG
 
+//! \ingroup altona_base_types_arrays
+//! Move elements to new storage when an array grows. Plain types are copied
+//! with sCopyMem, others are move assigned, the old elements are left empty.
+template <class Type> 
+void sMoveElements(Type *dest,Type *src,int count)
+{
+  if(std::is_trivially_copy_assignable<Type>::value)
+  {
+    if(count>0)
+      sCopyMem(dest,src,count*sizeof(Type));
+  }
+  else
+  {
+    for(int i=0;i<count;i++)
+      dest[i] = (Type &&) src[i];
+  }
+}
+
 /************************************************************************/ /*! 
 
 \ingroup altona_base_types_arrays
@@ -2308,6 +2374,11 @@ public:
   sStaticArray(const sStaticArray &a)   { sTAG_CALLER(); Data = 0; Used = 0; Alloc = 0; UsageTrackingInit(); Copy(a); }
   //! Create a copy of all elements.
   sStaticArray &operator=(const sStaticArray &a)  { sTAG_CALLER(); if (this != &a) Copy(a); return *this; }
+  //! Take over the elements of another array, which is left empty.
+  //! Arrays that don't own their storage (sSmallArray, sArenaArray) copy instead.
+  sStaticArray(sStaticArray &&a)        { Data = a.Data; Used = a.Used; Alloc = a.Alloc; UsageTrackingInit(); a.Data = 0; a.Used = 0; a.Alloc = 0; }
+  //! Take over the elements of another array, which is left empty.
+  sStaticArray &operator=(sStaticArray &&a)  { if (this != &a) { delete[] Data; Data = a.Data; Used = a.Used; Alloc = a.Alloc; UsageTrackingUpdate(); a.Data = 0; a.Used = 0; a.Alloc = 0; } return *this; }
   //! reset deallocates memory and resets container,
   //! - use Clear instead if you want to reuse your container afterwards
   //! - this is the only way to Resize an sStaticArray
@@ -2338,9 +2409,9 @@ public:
 //  void Add(const Type &e)               { sVERIFY(&e<Data || &e>=Data+Alloc); Grow(1); Data[Used++]=e; }
 //  Type *Add()                           { Grow(1); return &Data[Used++]; }
   //! Add all elements from another array
-  void Add(const sStaticArray<Type> &a) { Grow(a.Used); for(int i=0;i<a.Used;i++) Data[Used++]=a.Data[i]; UsageTrackingUpdate(); }
+  void Add(const sStaticArray<Type> &a) { if(Used+a.Used>Alloc) Grow(a.Used); for(int i=0;i<a.Used;i++) Data[Used++]=a.Data[i]; UsageTrackingUpdate(); }
   //! Advance the Used counter, increasing the array count. The returned pointer points to the first of the new elements
-  Type *AddMany(int count)             { Grow(count); Type *r=Data+Used; Used+=count; UsageTrackingUpdate(); return r; }
+  Type *AddMany(int count)             { if(Used+count>Alloc) Grow(count); Type *r=Data+Used; Used+=count; UsageTrackingUpdate(); return r; }
   Type *AddManyInit(int count, const Type *prototype = sNULL)  { Type *r=AddMany(count); 
                                                                       if (prototype) for (int i=0;i<count;i++) r[i] = *prototype;
                                                                       else           for (int i=0;i<count;i++) r[i] = Type();
@@ -2348,13 +2419,14 @@ public:
   Type *AddFull()                       { return AddMany(GetSize()-GetCount()); }
   Type *AddFullInit(const Type *prototype = sNULL) { return AddManyInit(GetSize()-GetCount(), prototype); }
   //! Insert element into array, preserving order (requires copying elements around)
-  void AddBefore(const Type &e,int p)  { sVERIFY(&e<Data || &e>=Data+Alloc); sVERIFY(p>=0 && p<=Used); Grow(1); for(int i=Used;i>p;i--) Data[i]=Data[i-1]; Data[p]=e; Used++; UsageTrackingUpdate(); }
+  void AddBefore(const Type &e,int p)  { sVERIFY(&e<Data || &e>=Data+Alloc); sVERIFY(p>=0 && p<=Used); if(Used>=Alloc) Grow(1); for(int i=Used;i>p;i--) Data[i]=Data[i-1]; Data[p]=e; Used++; UsageTrackingUpdate(); }
   //! Insert element into array, preserving order (requires copying elements around)
   void AddAfter(const Type &e,int p)   { sVERIFY(&e<Data || &e>=Data+Alloc); AddBefore(e,p+1); UsageTrackingUpdate(); }
   //! Insert element into array, preserving order (requires copying elements around)
   void AddHead(const Type &e)           { sVERIFY(&e<Data || &e>=Data+Alloc); AddBefore(e,0); UsageTrackingUpdate(); }
   //! Insert element into array, preserving order (which is trivial)
-  void AddTail(const Type &e)           { sVERIFY(&e<Data || &e>=Data+Alloc); Grow(1); Data[Used++]=e; UsageTrackingUpdate(); }
+  //! - Grow() is only called when the array is full, which keeps the virtual call out of the common case
+  void AddTail(const Type &e)           { sVERIFY(&e<Data || &e>=Data+Alloc); if(Used>=Alloc) Grow(1); Data[Used++]=e; UsageTrackingUpdate(); }
 
   Type &GetTail() const                 { sVERIFY(!IsEmpty()); return Data[Used-1]; }
 
@@ -2560,76 +2632,449 @@ see sFORALL for details
 /***                                                                      ***/
 /****************************************************************************/
 
-//! sort up, using '>' operator (ineffecient but compact)
+// The sorting templates work on indices through an order object that
+// provides Less(i,j) and Swap(i,j), so they need nothing from the
+// elements but the comparison operator and sSwap().
+//
+// sSortRange() is a pattern defeating quicksort: insertion sort for small
+// ranges, median of 3 (or 9) pivots, a cheap exit for sorted runs,
+// shuffling on bad partitions and heapsort as worst case guarantee.
+// sSortStable() is a merge sort on an index array, the elements are
+// permuted in place at the end.
+
+enum
+{
+  sSORT_INSERTION = 24,           // ranges up to this size are insertion sorted
+  sSORT_NINTHER = 128,            // from this size on the pivot is a median of 9
+  sSORT_MERGERUN = 16,            // sSortStable() starts with runs of this size
+};
+
+template <class ArrayType> struct sSortOrderUp          // only '>', like the old exchange sort
+{
+  ArrayType &A;
+  sSortOrderUp(ArrayType &a) : A(a) {}
+  sBool Less(int i,int j) const   { return A[j] > A[i]; }
+  void Swap(int i,int j) const    { sSwap(A[i],A[j]); }
+};
+
+template <class ArrayType> struct sSortOrderDown        // only '<'
+{
+  ArrayType &A;
+  sSortOrderDown(ArrayType &a) : A(a) {}
+  sBool Less(int i,int j) const   { return A[j] < A[i]; }
+  void Swap(int i,int j) const    { sSwap(A[i],A[j]); }
+};
+
+template <class ArrayType,class CmpType> struct sSortOrderCmpUp     // only cmp()>0
+{
+  ArrayType &A;
+  int (*Cmp)(CmpType,CmpType);
+  sSortOrderCmpUp(ArrayType &a,int (*cmp)(CmpType,CmpType)) : A(a),Cmp(cmp) {}
+  sBool Less(int i,int j) const   { return Cmp(A[j],A[i]) > 0; }
+  void Swap(int i,int j) const    { sSwap(A[i],A[j]); }
+};
+
+template <class ArrayType,class CmpType> struct sSortOrderCmpDown   // only cmp()<0
+{
+  ArrayType &A;
+  int (*Cmp)(CmpType,CmpType);
+  sSortOrderCmpDown(ArrayType &a,int (*cmp)(CmpType,CmpType)) : A(a),Cmp(cmp) {}
+  sBool Less(int i,int j) const   { return Cmp(A[j],A[i]) < 0; }
+  void Swap(int i,int j) const    { sSwap(A[i],A[j]); }
+};
+
+template <class ArrayType,class BaseType,class MemberType> struct sSortOrderMemberUp
+{
+  ArrayType &A;
+  MemberType BaseType::*O;
+  sSortOrderMemberUp(ArrayType &a,MemberType BaseType::*o) : A(a),O(o) {}
+  sBool Less(int i,int j) const   { return sGetPtr(A,j)->*O > sGetPtr(A,i)->*O; }
+  void Swap(int i,int j) const    { sSwap(A[i],A[j]); }
+};
+
+template <class ArrayType,class BaseType,class MemberType> struct sSortOrderMemberDown
+{
+  ArrayType &A;
+  MemberType BaseType::*O;
+  sSortOrderMemberDown(ArrayType &a,MemberType BaseType::*o) : A(a),O(o) {}
+  sBool Less(int i,int j) const   { return sGetPtr(A,j)->*O < sGetPtr(A,i)->*O; }
+  void Swap(int i,int j) const    { sSwap(A[i],A[j]); }
+};
+
+/****************************************************************************/
+
+template <class Order> 
+void sSortInsertion(const Order &o,int lo,int hi)
+{
+  for(int i=lo+1;i<hi;i++)
+    for(int j=i;j>lo && o.Less(j,j-1);j--)
+      o.Swap(j,j-1);
+}
+
+// gives up when too many elements are out of place
+template <class Order> 
+sBool sSortPartialInsertion(const Order &o,int lo,int hi)
+{
+  int moves = 0;
+  for(int i=lo+1;i<hi;i++)
+  {
+    for(int j=i;j>lo && o.Less(j,j-1);j--)
+    {
+      o.Swap(j,j-1);
+      moves++;
+    }
+    if(moves>8)
+      return 0;
+  }
+  return 1;
+}
+
+template <class Order> 
+void sSortSift(const Order &o,int lo,int root,int end)
+{
+  int child;
+  while((child=root*2+1)<end)
+  {
+    if(child+1<end && o.Less(lo+child,lo+child+1))
+      child++;
+    if(!o.Less(lo+root,lo+child))
+      break;
+    o.Swap(lo+root,lo+child);
+    root = child;
+  }
+}
+
+template <class Order> 
+void sSortHeap(const Order &o,int lo,int hi)
+{
+  int count = hi-lo;
+  for(int i=count/2-1;i>=0;i--)
+    sSortSift(o,lo,i,count);
+  while(--count>0)
+  {
+    o.Swap(lo,lo+count);
+    sSortSift(o,lo,0,count);
+  }
+}
+
+template <class Order> 
+void sSort3(const Order &o,int a,int b,int c)
+{
+  if(o.Less(b,a)) o.Swap(a,b);
+  if(o.Less(c,b))
+  {
+    o.Swap(b,c);
+    if(o.Less(b,a)) o.Swap(a,b);
+  }
+}
+
+template <class Order> 
+void sSortRange(const Order &o,int lo,int hi,int bad,sBool leftmost)
+{
+  for(;;)
+  {
+    int n = hi-lo;
+    if(n<=sSORT_INSERTION)
+    {
+      sSortInsertion(o,lo,hi);
+      return;
+    }
+
+    // pivot goes to lo
+
+    int mid = lo+n/2;
+    if(n>sSORT_NINTHER)
+    {
+      sSort3(o,lo,mid,hi-1);
+      sSort3(o,lo+1,mid-1,hi-2);
+      sSort3(o,lo+2,mid+1,hi-3);
+      sSort3(o,mid-1,mid,mid+1);
+      o.Swap(lo,mid);
+    }
+    else
+    {
+      sSort3(o,mid,lo,hi-1);
+    }
+
+    // many elements equal to the pivot: put them left and skip them.
+    // the element before the range is not larger than anything in it.
+
+    if(!leftmost && !o.Less(lo-1,lo))
+    {
+      int i = lo;
+      int j = hi;
+      while(o.Less(lo,--j)) {}
+      if(j+1==hi)
+        while(i<j && !o.Less(lo,++i)) {}
+      else
+        while(!o.Less(lo,++i)) {}
+      while(i<j)
+      {
+        o.Swap(i,j);
+        while(o.Less(lo,--j)) {}
+        while(!o.Less(lo,++i)) {}
+      }
+      o.Swap(lo,j);
+      lo = j+1;
+      continue;
+    }
+
+    // partition, elements equal to the pivot go right
+
+    int i = lo;
+    int j = hi;
+    while(o.Less(++i,lo)) {}
+    if(i-1==lo)
+      while(i<j && !o.Less(--j,lo)) {}
+    else
+      while(!o.Less(--j,lo)) {}
+    sBool partitioned = i>=j;
+    while(i<j)
+    {
+      o.Swap(i,j);
+      while(o.Less(++i,lo)) {}
+      while(!o.Less(--j,lo)) {}
+    }
+    int p = i-1;
+    o.Swap(lo,p);
+
+    int ls = p-lo;
+    int rs = hi-p-1;
+    if(ls<n/8 || rs<n/8)
+    {
+      // bad pivot: after too many of them, heapsort. otherwise break
+      // up the pattern that caused it.
+
+      if(--bad==0)
+      {
+        sSortHeap(o,lo,hi);
+        return;
+      }
+      if(ls>=sSORT_INSERTION)
+      {
+        o.Swap(lo,lo+ls/4);
+        o.Swap(p-1,p-ls/4);
+        if(ls>sSORT_NINTHER)
+        {
+          o.Swap(lo+1,lo+ls/4+1);
+          o.Swap(lo+2,lo+ls/4+2);
+          o.Swap(p-2,p-ls/4-1);
+          o.Swap(p-3,p-ls/4-2);
+        }
+      }
+      if(rs>=sSORT_INSERTION)
+      {
+        o.Swap(p+1,p+1+rs/4);
+        o.Swap(hi-1,hi-rs/4);
+        if(rs>sSORT_NINTHER)
+        {
+          o.Swap(p+2,p+2+rs/4);
+          o.Swap(p+3,p+3+rs/4);
+          o.Swap(hi-2,hi-1-rs/4);
+          o.Swap(hi-3,hi-2-rs/4);
+        }
+      }
+    }
+    else if(partitioned)
+    {
+      // nothing was swapped, the input may be sorted already
+
+      if(sSortPartialInsertion(o,lo,p) && sSortPartialInsertion(o,p+1,hi))
+        return;
+    }
+
+    // recurse into the smaller part
+
+    if(ls<rs)
+    {
+      sSortRange(o,lo,p,bad,leftmost);
+      lo = p+1;
+      leftmost = 0;
+    }
+    else
+    {
+      sSortRange(o,p+1,hi,bad,0);
+      hi = p;
+    }
+  }
+}
+
+template <class Order> 
+void sSortRange(const Order &o,int lo,int hi)
+{
+  int bad = 1;
+  while((1<<bad)<=hi-lo)
+    bad++;
+  sSortRange(o,lo,hi,bad,1);
+}
+
+/****************************************************************************/
+
+// merge two sorted runs of indices, taking from the left on equal elements
+template <class Order> 
+void sSortMergeIndices(const Order &o,const int *src,int *dest,int lo,int mid,int hi)
+{
+  int i = lo;
+  int j = mid;
+  int k = lo;
+  while(i<mid && j<hi)
+    dest[k++] = o.Less(src[j],src[i]) ? src[j++] : src[i++];
+  while(i<mid)
+    dest[k++] = src[i++];
+  while(j<hi)
+    dest[k++] = src[j++];
+}
+
+// perm[k] is the index of the element that goes to k, perm is destroyed
+template <class Order> 
+void sSortPermute(const Order &o,int *perm,int count)
+{
+  for(int k=0;k<count;k++)
+  {
+    int j = k;
+    for(;;)
+    {
+      int n = perm[j];
+      perm[j] = j;
+      if(n==k)
+        break;
+      o.Swap(j,n);
+      j = n;
+    }
+  }
+}
+
+template <class Order> 
+void sSortStable(const Order &o,int count)
+{
+  if(count<2)
+    return;
+  int *idx = new int[count*2];
+  int *tmp = idx+count;
+  for(int i=0;i<count;i++)
+    idx[i] = i;
+
+  // the array itself does not change until all indices are sorted
+
+  for(int lo=0;lo<count;lo+=sSORT_MERGERUN)
+  {
+    int hi = sMin<int>(lo+sSORT_MERGERUN,count);
+    for(int i=lo+1;i<hi;i++)
+    {
+      int v = idx[i];
+      int j = i;
+      for(;j>lo && o.Less(v,idx[j-1]);j--)
+        idx[j] = idx[j-1];
+      idx[j] = v;
+    }
+  }
+  for(int width=sSORT_MERGERUN;width<count;width*=2)
+  {
+    for(int lo=0;lo<count;lo+=width*2)
+      sSortMergeIndices(o,idx,tmp,lo,sMin(lo+width,count),sMin(lo+width*2,count));
+    sSwap(idx,tmp);
+  }
+
+  sSortPermute(o,idx,count);
+  delete[] (idx<tmp ? idx : tmp);
+}
+
+/****************************************************************************/
+
+//! sort up, using '>' operator
 //! \ingroup altona_base_types_arrays
 template <class ArrayType> 
 void sSortUp(ArrayType &a)
 {
-  int max = a.GetCount();
-  for(int i=0;i<max-1;i++)
-    for(int j=i+1;j<max;j++)
-      if(a[i] > a[j])
-        sSwap(a[i],a[j]);
+  sSortRange(sSortOrderUp<ArrayType>(a),0,a.GetCount());
 }
 
-//! sort down, using '<' operator (ineffecient but compact)
+//! sort down, using '<' operator
 //! \ingroup altona_base_types_arrays
 template <class ArrayType> 
 void sSortDown(ArrayType &a)
 {
-  int max = a.GetCount();
-  for(int i=0;i<max-1;i++)
-    for(int j=i+1;j<max;j++)
-      if(a[i] < a[j])
-        sSwap(a[i],a[j]);
+  sSortRange(sSortOrderDown<ArrayType>(a),0,a.GetCount());
 }
 
-//! sort up using functor (ineffecient but compact)
+//! sort up using functor
 //! \ingroup altona_base_types_arrays
 template <class ArrayType, class CmpType> 
 void sCmpSortUp(ArrayType &a, int (*cmp) (CmpType, CmpType))
 {
-  int max = a.GetCount();
-  for(int i=0;i<max-1;i++)
-    for(int j=i+1;j<max;j++)
-      if(cmp(a[i], a[j]) > 0)
-        sSwap(a[i],a[j]);
+  sSortRange(sSortOrderCmpUp<ArrayType,CmpType>(a,cmp),0,a.GetCount());
 }
 
-//! sort down using functor (ineffecient but compact)
+//! sort down using functor
 //! \ingroup altona_base_types_arrays
 template <class ArrayType, class CmpType> 
 void sCmpSortDown(ArrayType &a, int (*cmp) (CmpType, CmpType))
 {
-  int max = a.GetCount();
-  for(int i=0;i<max-1;i++)
-    for(int j=i+1;j<max;j++)
-      if(cmp(a[i], a[j]) < 0)
-        sSwap(a[i],a[j]);
+  sSortRange(sSortOrderCmpDown<ArrayType,CmpType>(a,cmp),0,a.GetCount());
 }
 
-//! sort up using '>' operator on a member variable (ineffecient but compact)
+//! sort up using '>' operator on a member variable
 //! \ingroup altona_base_types_arrays
 template <class ArrayType,class BaseType,class MemberType> 
 void sSortUp(ArrayType &a,MemberType BaseType::*o)
 {
-  int max = a.GetCount();
-  for(int i=0;i<max-1;i++)
-    for(int j=i+1;j<max;j++)
-      if(sGetPtr(a,i)->*o > sGetPtr(a,j)->*o)
-        sSwap(a[i],a[j]);
+  sSortRange(sSortOrderMemberUp<ArrayType,BaseType,MemberType>(a,o),0,a.GetCount());
 }
 
-//! sort down using '<' operator on a member variable (ineffecient but compact)
+//! sort down using '<' operator on a member variable
 //! \ingroup altona_base_types_arrays
 template <class ArrayType,class BaseType,class MemberType> 
 void sSortDown(ArrayType &a,MemberType BaseType::*o)
 {
-  int max = a.GetCount();
-  for(int i=0;i<max-1;i++)
-    for(int j=i+1;j<max;j++)
-      if(sGetPtr(a,i)->*o < sGetPtr(a,j)->*o)
-        sSwap(a[i],a[j]);
+  sSortRange(sSortOrderMemberDown<ArrayType,BaseType,MemberType>(a,o),0,a.GetCount());
+}
+
+//! stable sort up, using '>' operator (allocates two ints per element)
+//! \ingroup altona_base_types_arrays
+template <class ArrayType> 
+void sStableSortUp(ArrayType &a)
+{
+  sSortStable(sSortOrderUp<ArrayType>(a),a.GetCount());
+}
+
+//! stable sort down, using '<' operator
+//! \ingroup altona_base_types_arrays
+template <class ArrayType> 
+void sStableSortDown(ArrayType &a)
+{
+  sSortStable(sSortOrderDown<ArrayType>(a),a.GetCount());
+}
+
+//! stable sort up using functor
+//! \ingroup altona_base_types_arrays
+template <class ArrayType, class CmpType> 
+void sCmpStableSortUp(ArrayType &a, int (*cmp) (CmpType, CmpType))
+{
+  sSortStable(sSortOrderCmpUp<ArrayType,CmpType>(a,cmp),a.GetCount());
+}
+
+//! stable sort down using functor
+//! \ingroup altona_base_types_arrays
+template <class ArrayType, class CmpType> 
+void sCmpStableSortDown(ArrayType &a, int (*cmp) (CmpType, CmpType))
+{
+  sSortStable(sSortOrderCmpDown<ArrayType,CmpType>(a,cmp),a.GetCount());
+}
+
+//! stable sort up using '>' operator on a member variable
+//! \ingroup altona_base_types_arrays
+template <class ArrayType,class BaseType,class MemberType> 
+void sStableSortUp(ArrayType &a,MemberType BaseType::*o)
+{
+  sSortStable(sSortOrderMemberUp<ArrayType,BaseType,MemberType>(a,o),a.GetCount());
+}
+
+//! stable sort down using '<' operator on a member variable
+//! \ingroup altona_base_types_arrays
+template <class ArrayType,class BaseType,class MemberType> 
+void sStableSortDown(ArrayType &a,MemberType BaseType::*o)
+{
+  sSortStable(sSortOrderMemberDown<ArrayType,BaseType,MemberType>(a,o),a.GetCount());
 }
 
 
@@ -3388,11 +3833,16 @@ protected:
 
   sDList<sMemoryHeapFreeNode,&sMemoryHeapFreeNode::Node> FreeList;
   sMemoryHeapFreeNode *LastFreeNode;
+  sBool ThreadCache;             // cache small blocks per thread
 
+  void *Refill(sMemoryThreadCache *c,int cl);
+  void Drain(sMemoryThreadCache *c,int cl,int keep);
 public:
   sMemoryHeap();
   void Init(uint8_t *start,sPtr size);
   void SetDebug(sBool clear,int memwall);
+  void SetThreadCache(sBool enable); // only used while thread safe. blocks in caches count as used.
+  void Extend(uint8_t *end);      // memory from the current end up to this is added to the heap
 
   sCONFIG_SIZET GetFree();
   sCONFIG_SIZET GetLargestFree();
@@ -3406,6 +3856,70 @@ public:
   sPtr MemSize(void *);
   void Validate();
   uint32_t MakeSnapshot();
+
+  void *CacheAlloc(sPtr bytes,int align,int flags);
+  sBool CacheFree(void *);
+  void FlushCache(sMemoryThreadCache *c);
+};
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   two level segregated fit heap: O(1) alloc and free                 ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+struct sTlsfHeapBlock
+{
+  sTlsfHeapBlock *PrevPhys;       // block before this in memory, 0 for the first
+  sPtr Size;                      // including header. bit 0: free, 64 bit: top byte holds the unused bytes of used blocks
+#if !sCONFIG_64BIT
+  sPtr Slack;                     // unused bytes of used blocks
+#endif
+  sTlsfHeapBlock *NextFree;       // free blocks only, the user data of used blocks
+  sTlsfHeapBlock *PrevFree;
+};
+
+class sTlsfHeap : public sMemoryHandler
+{
+protected:
+  enum
+  {
+    SLLog2 = 4,                   // 16 second level lists per power of two
+    SLCount = 1<<SLLog2,
+    Granule = 16,                 // block sizes and user data alignment
+    FLShift = SLLog2+4,           // below 256 bytes, sizes map linearly to one first level
+    FLCount = sizeof(sPtr)*8-FLShift+1,
+  };
+
+  sPtr TotalFree;
+  int Clear;                      // clear memory on allocation and freeing
+  uint64_t FLBitmap;              // bit set if any list in this first level is not empty
+  uint32_t SLBitmap[FLCount];
+  sTlsfHeapBlock *Lists[FLCount][SLCount];
+  sTlsfHeapBlock *LastPhys;       // block at the end of the heap
+
+  static void Mapping(sPtr size,int &fl,int &sl);
+  sTlsfHeapBlock *GetNextPhys(sTlsfHeapBlock *b) const;
+  void AddFree(sTlsfHeapBlock *b);
+  void RemFree(sTlsfHeapBlock *b);
+  sTlsfHeapBlock *FindFree(sPtr size);
+  void Split(sTlsfHeapBlock *b,sPtr size);
+public:
+  sTlsfHeap();
+  void Init(uint8_t *start,sPtr size);
+  void SetDebug(sBool clear,int memwall);
+  void Extend(uint8_t *end);      // memory from the current end up to this is added to the heap
+
+  sCONFIG_SIZET GetFree();
+  sCONFIG_SIZET GetLargestFree();
+  sPtr GetUsed();
+  void DumpStats(int verbose=0);
+
+  void *Alloc(sPtr bytes,int align,int flags=0);   // sAMF_ALT takes the upper end of the block found
+  sBool Free(void *);
+  sPtr MemSize(void *);
+  void Validate();
+  uint32_t MakeSnapshot();
 };
 
 /****************************************************************************/
@@ -3534,6 +4048,7 @@ class sMemoryPool
   {
     sMemoryPoolBuffer *CBuffer;
     uint8_t *CPtr;
+    sMemoryPoolBuffer *CFirst;    // very large objects are added in front
   };
   sStaticArray<sStackItem> Stack;
 public:
@@ -3554,6 +4069,68 @@ public:
   sChar *AllocString(const sChar *,int len);
 };
 
+/****************************************************************************/
+/***                                                                      ***/
+/***   Arena                                                              ***/
+/***                                                                      ***/
+/****************************************************************************/
+/***                                                                      ***/
+/***   A sMemoryPool for objects with constructors and destructors.       ***/
+/***   - New() constructs, objects with a destructor are registered       ***/
+/***   - Pop() and Reset() destroy objects in reverse order of creation   ***/
+/***   - objects with trivial destructors cost nothing to free            ***/
+/***   - Alloc() is raw memory, like sMemoryPool                          ***/
+/***   see sArenaArray and sArenaString for containers in the arena.      ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+class sArena
+{
+  struct Dtor
+  {
+    void (*Func)(void *ptr,int count);
+    void *Ptr;
+    int Count;
+    Dtor *Next;
+  };
+  sMemoryPool Pool;
+  Dtor *Dtors;                    // newest first
+  sStaticArray<Dtor *> Stack;     // Dtors at Push()
+
+  template <typename T> static void Destruct(void *ptr,int count) { T *p = (T *) ptr; for(int i=count-1;i>=0;i--) p[i].~T(); }
+  template <typename T> void Register(T *p,int count) { if(!std::is_trivially_destructible<T>::value) AddDtor(Destruct<T>,p,count); }
+  void AddDtor(void (*func)(void *,int),void *ptr,int count);
+  void RunDtors(Dtor *last);
+public:
+  sArena(sPtr defaultsize = 65536,int allocflags=sAMF_HEAP,int maxstacksize=16);
+  ~sArena();
+
+  void Reset();     // destroys all objects, frees all memory
+  void Push();      // pushes the current allocation cfg to internal stack
+  void Pop();       // everything created after last push is destroyed and freed
+
+  uint8_t *Alloc(sPtr size,int align)   { return Pool.Alloc(size,align); }
+  sChar *AllocString(const sChar *s)   { return Pool.AllocString(s); }
+  sChar *AllocString(const sChar *s,int len) { return Pool.AllocString(s,len); }
+  sPtr BytesAllocated() const           { return Pool.BytesAllocated(); }
+  sPtr BytesReserved() const            { return Pool.BytesReserved(); }
+
+  template <typename T> T *New()        { T *p = sPlacementNew<T>(Alloc(sizeof(T),sALIGNOF(T))); Register(p,1); return p; }
+  template <typename T,typename A> T *New(A a) { T *p = sPlacementNew<T>(Alloc(sizeof(T),sALIGNOF(T)),a); Register(p,1); return p; }
+  template <typename T,typename A,typename B> T *New(A a,B b) { T *p = sPlacementNew<T>(Alloc(sizeof(T),sALIGNOF(T)),a,b); Register(p,1); return p; }
+  template <typename T,typename A,typename B,typename C> T *New(A a,B b,C c) { T *p = sPlacementNew<T>(Alloc(sizeof(T),sALIGNOF(T)),a,b,c); Register(p,1); return p; }
+  template <typename T> T *NewArray(int n) { T *p = (T *) Alloc(sizeof(T)*n,sALIGNOF(T)); for(int i=0;i<n;i++) sPlacementNew<T>(p+i); Register(p,n); return p; }
+};
+
+/****************************************************************************/
+
+struct sArenaScope               // sArena::Push() / Pop() for a scope
+{
+  sArena *Arena;
+  explicit sArenaScope(sArena *arena) { Arena = arena; Arena->Push(); }
+  ~sArenaScope() { Arena->Pop(); }
+};
+
 /****************************************************************************/
 /***                                                                      ***/
 /***  Compression algorithms                                              ***/
@@ -3869,6 +4446,44 @@ typedef sMemoryLeakTracker2 sMemoryLeakTracker;
 // For debugging purposes only. May and will return zero in eg. stripped builds
 sMemoryLeakTracker * sGetMemoryLeakTracker();
 
+/****************************************************************************/
+/***                                                                      ***/
+/***   Memory Profiler                                                    ***/
+/***                                                                      ***/
+/***   Samples about one allocation per Rate bytes and records it with    ***/
+/***   its sTagMem() location, memtype and time. Sizes and counts are     ***/
+/***   scaled up by the sampling probability, so a site shows an estimate ***/
+/***   of all its allocations. Unlike the leak tracker this is cheap      ***/
+/***   enough to run in production, and works in stripped builds (where   ***/
+/***   all allocations are untagged).                                     ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+enum sMemProfileConsts
+{
+  sMPL_BUCKETS = 16,              // lifetime histogram: bucket i counts lifetimes in [4^(i-1),4^i) us
+  sMP_DEFAULTRATE = 512*1024,     // default bytes per sample
+};
+
+struct sMemProfileSite            // all sampled allocations of one location and memtype
+{
+  const sChar8 *File;             // 0 for untagged allocations
+  int Line;
+  int HeapId;                     // memtype, with sAMF_ALT
+  uint64_t AllocBytes;            // estimated, since sStartMemProfile()
+  uint64_t AllocCount;
+  uint64_t LiveBytes;             // estimated, still allocated
+  uint64_t LiveCount;
+  uint32_t Lifetime[sMPL_BUCKETS];  // sampled frees by lifetime
+};
+
+void sStartMemProfile(int rate=sMP_DEFAULTRATE);
+void sStopMemProfile();           // stop sampling. live samples are tracked until they are freed
+sBool sIsMemProfiling();
+void sGetMemProfile(sStaticArray<sMemProfileSite> &sites);
+sBool sDumpMemProfile(const sChar *filename,sBool total=0);  // folded stacks for flamegraph.pl, live or total bytes
+void sLogMemProfile(int maxsites=32);  // largest sites with lifetimes to the "mem" log
+
 /****************************************************************************/
 /***                                                                      ***/
 /***   Intrinsics MSC (Windows)                                           ***/
@@ -304,11 +304,13 @@ void sMessageTimerThread(sThread *t,void *v)
   sMessageTimer *timer = (sMessageTimer *) v;
   do
   {
-    sSleep(timer->Delay);
+    timer->Event->Wait(timer->Delay);
+    if(!t->CheckTerminate())
+      break;
     if(timer->Msg.Target)
       timer->Msg.PostASync();
   }
-  while(t->CheckTerminate() && timer->Loop);
+  while(timer->Loop);
 }
 
 sMessageTimer::sMessageTimer(const sMessage &msg,int delay,int loop)
@@ -316,13 +318,17 @@ sMessageTimer::sMessageTimer(const sMessage &msg,int delay,int loop)
   Msg = msg;
   Delay = delay;
   Loop = loop;
+  Event = new sThreadEvent;
   Thread = new sThread(sMessageTimerThread,0,0x4000,this,0);
 }
 
 sMessageTimer::~sMessageTimer()
 {
   Msg = sMessage();
+  Thread->Terminate();
+  Event->Signal();
   delete Thread;
+  delete Event;
 }
 
 /****************************************************************************/
@@ -351,6 +357,7 @@ sTextBuffer::sTextBuffer(const sChar* t)
 sTextBuffer::~sTextBuffer()
 {
   delete[] Buffer;
+  delete[] Store;
 }
 
 sTextBuffer& sTextBuffer::operator=(const sTextBuffer& tb)
@@ -377,6 +384,7 @@ sTextBuffer& sTextBuffer::operator=(const sChar* t)
 template <class streamer> void sTextBuffer::Serialize_(streamer &s)
 {
   sVERIFY(sizeof(sChar)==sizeof(uint16_t));
+  Flatten();
   int len = Used;
   s | len;
   if(s.IsReading())
@@ -387,6 +395,12 @@ template <class streamer> void sTextBuffer::Serialize_(streamer &s)
   s.ArrayU16((uint16_t*)Buffer, Used);
   s.Align();
   Buffer[Used] = 0;
+  if(s.IsReading())
+  {
+    LinesValid = 0;
+    if(EditMode)
+      Rebase();
+  }
 }
 
 void sTextBuffer::Serialize(sReader &stream)
@@ -415,6 +429,15 @@ void sTextBuffer::Init()
   Alloc = 1024;
   Used = 0;
   Buffer = new sChar[Alloc];
+  EditMode = 0;
+  Dirty = 0;
+  Store = 0;
+  StoreUsed = 0;
+  StoreAlloc = 0;
+  Root = -1;
+  FreePiece = -1;
+  Seed = 0x12345678;
+  LinesValid = 0;
 }
 
 void sTextBuffer::Grow(int add)
@@ -428,6 +451,14 @@ void sTextBuffer::Grow(int add)
 void sTextBuffer::Clear()
 {
   Used = 0;
+  LinesValid = 0;
+  if(EditMode)
+  {
+    FreeTree(Root);
+    Root = -1;
+    StoreUsed = 0;
+    Dirty = 0;
+  }
 }
 
 void sTextBuffer::SetSize(int count)
@@ -435,7 +466,8 @@ void sTextBuffer::SetSize(int count)
   if(Alloc<count)
   {
     sChar *n = new sChar[count];
-    sCopyMem(n,Buffer,Used*sizeof(sChar));
+    if(!Dirty)
+      sCopyMem(n,Buffer,Used*sizeof(sChar));
     delete[] Buffer;
 
     Buffer = n;
@@ -445,6 +477,7 @@ void sTextBuffer::SetSize(int count)
 
 const sChar *sTextBuffer::Get() const
 {
+  const_cast<sTextBuffer*>(this)->Flatten();
   sVERIFY(Used<Alloc);
   const_cast<sChar*>(Buffer)[Used] = 0;
   return Buffer;
@@ -454,6 +487,7 @@ sChar *sTextBuffer::Get()
 {
   static sChar empty[] = L"";
   if(Used==0 && Buffer==0) return empty;
+  Flatten();
   sVERIFY(Used<Alloc);
   const_cast<sChar*>(Buffer)[Used] = 0;
   return Buffer;
@@ -465,56 +499,551 @@ int sTextBuffer::GetLength() {
 
 void sTextBuffer::Insert(int pos,sChar c)
 {
-  sVERIFY(pos>=0 && pos<=Used);
-  Grow(1);
-
-  Used++;
-  for(int i=Used;i>pos;i--)
-    Buffer[i] = Buffer[i-1];
-  Buffer[pos] = c;
+  Insert(pos,&c,1);
 }
 
 void sTextBuffer::Insert(int pos,const sChar *c,int len)
 {
   sVERIFY(pos>=0 && pos<=Used);
   if(len==-1) len = sGetStringLen(c);
+  if(EditMode)
+  {
+    PieceInsert(pos,c,len);
+    return;
+  }
 
   Grow(len);
 
+  sMoveMem(Buffer+pos+len,Buffer+pos,(Used-pos)*sizeof(sChar));
+  sCopyMem(Buffer+pos,c,len*sizeof(sChar));
   Used+=len;
-  for(int i=Used;i>pos;i--)
-    Buffer[i] = Buffer[i-len];
-  for(int i=0;i<len;i++)
-    Buffer[pos+i] = c[i];
+  LinesValid = 0;
 }
 
 
 void sTextBuffer::Delete(int pos)
 {
-  sVERIFY(pos>=0 && pos<Used);
-  Used--;
-  for(int i=pos;i<Used;i++)
-    Buffer[i] = Buffer[i+1];
+  Delete(pos,1);
 }
 
 void sTextBuffer::Delete(int pos,int count)
 {
-  sVERIFY(pos>=0 && pos<Used);
+  sVERIFY(pos>=0 && pos<Used && pos+count<=Used);
+  if(EditMode)
+  {
+    PieceDelete(pos,count);
+    return;
+  }
+  sMoveMem(Buffer+pos,Buffer+pos+count,(Used-pos-count)*sizeof(sChar));
   Used-=count;
-  for(int i=pos;i<Used;i++)
-    Buffer[i] = Buffer[i+count];
+  LinesValid = 0;
 }
 
 void sTextBuffer::Set(int pos,sChar c)
 {
   sVERIFY(pos>=0 && pos<Used);
+  if(EditMode)
+  {
+    PieceSet(pos,c);
+    return;
+  }
   Buffer[pos] = c;
+  LinesValid = 0;
+}
+
+/****************************************************************************/
+
+void sTextBuffer::SetEditMode(sBool enable)
+{
+  if(!enable==!EditMode)
+    return;
+  if(enable)
+  {
+    EditMode = 1;
+    Rebase();
+  }
+  else
+  {
+    Flatten();
+    EditMode = 0;
+    Pieces.Reset();
+    delete[] Store;
+    Store = 0;
+    StoreUsed = 0;
+    StoreAlloc = 0;
+    Root = -1;
+    FreePiece = -1;
+    LinesValid = 0;
+  }
+}
+
+static int sCountLinefeeds(const sChar *s,int len)
+{
+  int n = 0;
+  for(int i=0;i<len;i++)
+    if(s[i]=='\n')
+      n++;
+  return n;
+}
+
+int sTextBuffer::NewPiece(int start,int len)
+{
+  int t = FreePiece;
+  if(t>=0)
+    FreePiece = Pieces[t].Left;
+  else
+  {
+    t = Pieces.GetCount();
+    Pieces.AddMany(1);
+  }
+  Seed ^= Seed<<13; Seed ^= Seed>>17; Seed ^= Seed<<5;
+
+  Piece &p = Pieces[t];
+  p.Left = -1;
+  p.Right = -1;
+  p.Prio = Seed;
+  p.Start = start;
+  p.Len = len;
+  p.Lines = sCountLinefeeds(Store+start,len);
+  p.SubLen = p.Len;
+  p.SubLines = p.Lines;
+  return t;
+}
+
+void sTextBuffer::FreeTree(int t)
+{
+  if(t<0)
+    return;
+  FreeTree(Pieces[t].Left);
+  FreeTree(Pieces[t].Right);
+  Pieces[t].Left = FreePiece;
+  FreePiece = t;
+}
+
+void sTextBuffer::UpdatePiece(int t)
+{
+  Piece &p = Pieces[t];
+  p.SubLen = p.Len;
+  p.SubLines = p.Lines;
+  if(p.Left>=0)
+  {
+    p.SubLen += Pieces[p.Left].SubLen;
+    p.SubLines += Pieces[p.Left].SubLines;
+  }
+  if(p.Right>=0)
+  {
+    p.SubLen += Pieces[p.Right].SubLen;
+    p.SubLines += Pieces[p.Right].SubLines;
+  }
+}
+
+// the first pos characters of tree t go to l, the rest to r
+
+void sTextBuffer::Split(int t,int pos,int &l,int &r)
+{
+  if(t<0)
+  {
+    l = r = -1;
+    return;
+  }
+  int left = Pieces[t].Left>=0 ? Pieces[Pieces[t].Left].SubLen : 0;
+  if(pos<=left)
+  {
+    int a;
+    Split(Pieces[t].Left,pos,l,a);
+    Pieces[t].Left = a;
+    UpdatePiece(t);
+    r = t;
+  }
+  else if(pos>=left+Pieces[t].Len)
+  {
+    int a;
+    Split(Pieces[t].Right,pos-left-Pieces[t].Len,a,r);
+    Pieces[t].Right = a;
+    UpdatePiece(t);
+    l = t;
+  }
+  else                            // split the piece itself
+  {
+    int off = pos-left;
+    int n = NewPiece(Pieces[t].Start+off,Pieces[t].Len-off);
+    Piece &p = Pieces[t];
+    p.Len = off;
+    p.Lines -= Pieces[n].Lines;
+    r = Merge(n,p.Right);
+    Pieces[t].Right = -1;
+    UpdatePiece(t);
+    l = t;
+  }
+}
+
+int sTextBuffer::Merge(int l,int r)
+{
+  if(l<0) return r;
+  if(r<0) return l;
+  if(Pieces[l].Prio>Pieces[r].Prio)
+  {
+    int m = Merge(Pieces[l].Right,r);
+    Pieces[l].Right = m;
+    UpdatePiece(l);
+    return l;
+  }
+  else
+  {
+    int m = Merge(l,Pieces[r].Left);
+    Pieces[r].Left = m;
+    UpdatePiece(r);
+    return r;
+  }
+}
+
+int sTextBuffer::StoreText(const sChar *text,int len)
+{
+  if(StoreUsed+len>StoreAlloc)
+  {
+    int alloc = sMax(StoreUsed+len,sMax(StoreAlloc*2,1024));
+    sChar *n = new sChar[alloc];
+    sCopyMem(n,Store,StoreUsed*sizeof(sChar));
+    delete[] Store;
+    Store = n;
+    StoreAlloc = alloc;
+  }
+  int start = StoreUsed;
+  sCopyMem(Store+start,text,len*sizeof(sChar));
+  StoreUsed += len;
+  return start;
+}
+
+// returns the piece containing character pos, and the offset into it in pos
+
+int sTextBuffer::FindPiece(int &pos) const
+{
+  int t = Root;
+  for(;;)
+  {
+    const Piece &p = Pieces[t];
+    int left = p.Left>=0 ? Pieces[p.Left].SubLen : 0;
+    if(pos<left)
+    {
+      t = p.Left;
+    }
+    else
+    {
+      pos -= left;
+      if(pos<p.Len)
+        return t;
+      pos -= p.Len;
+      t = p.Right;
+    }
+  }
+}
+
+void sTextBuffer::Rebase()
+{
+  Pieces.Clear();
+  FreePiece = -1;
+  Root = -1;
+  StoreUsed = 0;
+  StoreText(Buffer,Used);
+  for(int i=0;i<Used;i+=PieceMax)
+    Root = Merge(Root,NewPiece(i,sMin<int>(PieceMax,Used-i)));
+  Dirty = 0;
+}
+
+void sTextBuffer::Flatten()
+{
+  if(!Dirty)
+    return;
+  if(Used+1>Alloc)
+  {
+    delete[] Buffer;
+    Alloc = sMax(Used+1,Alloc*2);
+    Buffer = new sChar[Alloc];
+  }
+  sChar *dest = Buffer;
+  FlattenTree(Root,dest);
+  Dirty = 0;
+
+  // get rid of deleted text when it dominates the store
+
+  if(StoreUsed>Used*2+PieceMax*4)
+    Rebase();
+}
+
+void sTextBuffer::FlattenTree(int t,sChar *&dest) const
+{
+  while(t>=0)
+  {
+    const Piece &p = Pieces[t];
+    FlattenTree(p.Left,dest);
+    sCopyMem(dest,Store+p.Start,p.Len*sizeof(sChar));
+    dest += p.Len;
+    t = p.Right;
+  }
+}
+
+void sTextBuffer::PieceInsert(int pos,const sChar *c,int len)
+{
+  if(len<=0)
+    return;
+  int start = StoreText(c,len);
+
+  if(!Dirty && pos==Used)         // appending keeps Buffer up to date
+  {
+    Grow(len);
+    sCopyMem(Buffer+Used,Store+start,len*sizeof(sChar));
+  }
+  else
+  {
+    Dirty = 1;
+  }
+
+  // typing: the piece that ends at pos was the last thing stored, so it just grows
+
+  if(pos>0)
+  {
+    int off = pos-1;
+    int t = FindPiece(off);
+    Piece &p = Pieces[t];
+    if(off==p.Len-1 && p.Start+p.Len==start && p.Len+len<=PieceMax)
+    {
+      int lines = sCountLinefeeds(Store+start,len);
+      int q = pos-1;
+      t = Root;
+      for(;;)
+      {
+        Piece &n = Pieces[t];
+        n.SubLen += len;
+        n.SubLines += lines;
+        int left = n.Left>=0 ? Pieces[n.Left].SubLen : 0;
+        if(q<left)
+        {
+          t = n.Left;
+        }
+        else if(q<left+n.Len)
+        {
+          n.Len += len;
+          n.Lines += lines;
+          break;
+        }
+        else
+        {
+          q -= left+n.Len;
+          t = n.Right;
+        }
+      }
+      Used += len;
+      return;
+    }
+  }
+
+  int a,b;
+  Split(Root,pos,a,b);
+  for(int i=0;i<len;i+=PieceMax)
+    a = Merge(a,NewPiece(start+i,sMin<int>(PieceMax,len-i)));
+  Root = Merge(a,b);
+  Used += len;
+}
+
+void sTextBuffer::PieceDelete(int pos,int count)
+{
+  if(count<=0)
+    return;
+  if(pos+count<Used)              // deleting the tail keeps Buffer up to date
+    Dirty = 1;
+
+  int a,b,c;
+  Split(Root,pos,a,b);
+  Split(b,count,b,c);
+  FreeTree(b);
+  Root = Merge(a,c);
+  Used -= count;
+}
+
+void sTextBuffer::PieceSet(int pos,sChar c)
+{
+  int off = pos;
+  int t = FindPiece(off);
+  sChar &old = Store[Pieces[t].Start+off];
+  int delta = (c=='\n') - (old=='\n');
+  old = c;
+  if(!Dirty)
+    Buffer[pos] = c;
+
+  if(delta)
+  {
+    t = Root;
+    for(;;)
+    {
+      Piece &n = Pieces[t];
+      n.SubLines += delta;
+      int left = n.Left>=0 ? Pieces[n.Left].SubLen : 0;
+      if(pos<left)
+      {
+        t = n.Left;
+      }
+      else if(pos<left+n.Len)
+      {
+        n.Lines += delta;
+        break;
+      }
+      else
+      {
+        pos -= left+n.Len;
+        t = n.Right;
+      }
+    }
+  }
+}
+
+int sTextBuffer::PieceChar(int pos) const
+{
+  int t = FindPiece(pos);
+  return Store[Pieces[t].Start+pos];
+}
+
+void sTextBuffer::Copy(int pos,int count,sChar *dest) const
+{
+  sVERIFY(pos>=0 && count>=0 && pos+count<=Used);
+  if(!Dirty)
+  {
+    sCopyMem(dest,Buffer+pos,count*sizeof(sChar));
+    return;
+  }
+  while(count>0)
+  {
+    int off = pos;
+    const Piece &p = Pieces[FindPiece(off)];
+    int n = sMin(count,p.Len-off);
+    sCopyMem(dest,Store+p.Start+off,n*sizeof(sChar));
+    dest += n;
+    pos += n;
+    count -= n;
+  }
+}
+
+/****************************************************************************/
+
+void sTextBuffer::BuildLines()
+{
+  if(LinesValid)
+    return;
+  LineStarts.Clear();
+  LineStarts.AddTail(0);
+  for(int i=0;i<Used;i++)
+    if(Buffer[i]=='\n')
+      LineStarts.AddTail(i+1);
+  LinesValid = 1;
+}
+
+int sTextBuffer::GetLineCount()
+{
+  if(EditMode)
+    return (Root>=0 ? Pieces[Root].SubLines : 0) + 1;
+  BuildLines();
+  return LineStarts.GetCount();
+}
+
+int sTextBuffer::GetLineStart(int line)
+{
+  if(line<=0)
+    return 0;
+  if(!EditMode)
+  {
+    BuildLines();
+    return line<LineStarts.GetCount() ? LineStarts[line] : Used;
+  }
+
+  // find the line-th linefeed
+
+  int t = Root;
+  int pos = 0;
+  while(t>=0)
+  {
+    const Piece &p = Pieces[t];
+    int leftlen = 0, leftlines = 0;
+    if(p.Left>=0)
+    {
+      leftlen = Pieces[p.Left].SubLen;
+      leftlines = Pieces[p.Left].SubLines;
+    }
+    if(line<=leftlines)
+    {
+      t = p.Left;
+    }
+    else
+    {
+      line -= leftlines;
+      pos += leftlen;
+      if(line<=p.Lines)
+      {
+        const sChar *s = Store+p.Start;
+        for(int i=0;;i++)
+          if(s[i]=='\n' && --line==0)
+            return pos+i+1;
+      }
+      line -= p.Lines;
+      pos += p.Len;
+      t = p.Right;
+    }
+  }
+  return Used;
+}
+
+int sTextBuffer::GetLine(int pos)
+{
+  if(pos<=0)
+    return 0;
+  if(pos>Used)
+    pos = Used;
+  if(!EditMode)
+  {
+    BuildLines();
+    int lo = 0;
+    int hi = LineStarts.GetCount();
+    while(hi-lo>1)
+    {
+      int mid = (lo+hi)/2;
+      if(LineStarts[mid]<=pos)
+        lo = mid;
+      else
+        hi = mid;
+    }
+    return lo;
+  }
+
+  // count the linefeeds before pos
+
+  int lines = 0;
+  int t = Root;
+  while(t>=0)
+  {
+    const Piece &p = Pieces[t];
+    int leftlen = p.Left>=0 ? Pieces[p.Left].SubLen : 0;
+    if(pos<=leftlen)
+    {
+      t = p.Left;
+    }
+    else
+    {
+      if(p.Left>=0)
+        lines += Pieces[p.Left].SubLines;
+      pos -= leftlen;
+      if(pos<=p.Len)
+        return lines+sCountLinefeeds(Store+p.Start,pos);
+      lines += p.Lines;
+      pos -= p.Len;
+      t = p.Right;
+    }
+  }
+  return lines;
 }
 
 /****************************************************************************/
 
 void sTextBuffer::Indent(int count)
 {
+  Flatten();
   int pos = Used;
   while(pos>=0 && Buffer[pos]!='\n')
     pos--;
@@ -526,8 +1055,15 @@ void sTextBuffer::Indent(int count)
 
 void sTextBuffer::PrintChar(int c)
 {
+  if(EditMode)
+  {
+    sChar ch = c;
+    PieceInsert(Used,&ch,1);
+    return;
+  }
   Grow(1);
   Buffer[Used++] = c;
+  LinesValid = 0;
 }
 
 void sTextBuffer::Print(const sChar *text)
@@ -537,9 +1073,15 @@ void sTextBuffer::Print(const sChar *text)
 
 void sTextBuffer::Print(const sChar *text,int c)
 {
+  if(EditMode)
+  {
+    PieceInsert(Used,text,c);
+    return;
+  }
   Grow(c);
   sCopyMem(Buffer+Used,text,c*sizeof(sChar));
   Used+=c;
+  LinesValid = 0;
 }
 
 void sTextBuffer::PrintListing(const sChar *text,int line)
@@ -559,6 +1101,41 @@ void sTextBuffer::PrintListing(const sChar *text,int line)
   }
 }
 
+/****************************************************************************/
+/***                                                                      ***/
+/***   Arena String                                                       ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+void sArenaString::Grow(int add)
+{
+  if(Used+add+1>Alloc)
+  {
+    int alloc = sMax(Used+add+1,sMax(Alloc*2,32));
+    sChar *n = (sChar *) Arena->Alloc(alloc*sizeof(sChar),sizeof(sChar));
+    if(Used)
+      sCopyMem(n,Buffer,Used*sizeof(sChar));
+    n[Used] = 0;
+    Buffer = n;
+    Alloc = alloc;
+  }
+}
+
+void sArenaString::Add(const sChar *s,int len)
+{
+  Grow(len);
+  sCopyMem(Buffer+Used,s,len*sizeof(sChar));
+  Used += len;
+  Buffer[Used] = 0;
+}
+
+void sArenaString::AddChar(int c)
+{
+  Grow(1);
+  Buffer[Used++] = c;
+  Buffer[Used] = 0;
+}
+
 /****************************************************************************/
 /***                                                                      ***/
 /***   TextFileWriter                                                     ***/
@@ -612,27 +1189,214 @@ void sTextFileWriter::Flush()
     int pos = 0;
     while(*data && pos < BUFFER_SIZE - 2)
     {
-      if(sCONFIG_SYSTEM_WINDOWS)
-      {
-        if(*data == '\n' && !lastWasCR) // convert LF to CRLF on windows
-          buffer[pos++] = '\r';
-
-        lastWasCR = *data == '\r';
-      }
-      buffer[pos++] = *data++ & 0xff;
+      if(sCONFIG_SYSTEM_WINDOWS)
+      {
+        if(*data == '\n' && !lastWasCR) // convert LF to CRLF on windows
+          buffer[pos++] = '\r';
+
+        lastWasCR = *data == '\r';
+      }
+      buffer[pos++] = *data++ & 0xff;
+    }
+
+    if(Target && !Target->Write(buffer,pos))
+      sDelete(Target);
+  }
+
+  Buffer.Clear();
+}
+
+void sTextFileWriter::End()
+{
+  Flush();
+  sDelete(Target);
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Threadsafe Small Object Pool                                       ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+sSmallObjectPoolMTBase::sSmallObjectPoolMTBase(int size,int alignment,int allocflags)
+{
+  sVERIFYSTATIC(sizeof(Slot)==64);
+  sVERIFY(size>=int(sizeof(void *)));
+  ObjectSize = sAlign(size,alignment);
+  Alignment = sMax(alignment,16);
+  AllocFlags = allocflags;
+  Full = 0;
+  Empty = 0;
+  Chunks = 0;
+  BytesAlloc = 0;
+
+  int slots = 8;                  // few enough threads per slot that they rarely meet
+  while(slots<sGetCPUCount()*2)
+    slots *= 2;
+  SlotMask = slots-1;
+  Slots = (Slot *) sAllocMem(sizeof(Slot)*slots,64,allocflags);
+  sSetMem(Slots,0,sizeof(Slot)*slots);
+}
+
+sSmallObjectPoolMTBase::~sSmallObjectPoolMTBase()
+{
+  uint8_t *chunk = (uint8_t *) sPtr(Chunks);
+  while(chunk)
+  {
+    uint8_t *next = (uint8_t *) sPtr(*(uint64_t *) chunk);
+    sFreeMem(chunk);
+    chunk = next;
+  }
+  sFreeMem(Slots);
+}
+
+void sSmallObjectPoolMTBase::Push(volatile uint64_t *depot,Magazine *m)
+{
+  for(;;)
+  {
+    uint64_t old = *depot;
+    m->Next = Unpack(old);
+    if(sAtomicCmpSwap(depot,old,Pack(m,(old>>TagShift)+1))==old)
+      return;
+  }
+}
+
+sSmallObjectPoolMTBase::Magazine *sSmallObjectPoolMTBase::Pop(volatile uint64_t *depot)
+{
+  for(;;)
+  {
+    uint64_t old = *depot;
+    Magazine *m = Unpack(old);
+    if(!m)
+      return 0;
+    // m may be popped and pushed again meanwhile. it stays valid memory
+    // and the tag makes the swap fail.
+    if(sAtomicCmpSwap(depot,old,Pack(m->Next,(old>>TagShift)+1))==old)
+      return m;
+  }
+}
+
+uint8_t *sSmallObjectPoolMTBase::AllocChunk(sPtr size)
+{
+  int header = sMax(Alignment,16);  // link to the next chunk
+  uint8_t *mem = (uint8_t *) sAllocMem(size+header,Alignment,AllocFlags);
+  sAtomicAdd(&BytesAlloc,uint64_t(size+header));
+  for(;;)
+  {
+    uint64_t old = Chunks;
+    *(uint64_t *) mem = old;
+    if(sAtomicCmpSwap(&Chunks,old,uint64_t(sPtr(mem)))==old)
+      return mem+header;
+  }
+}
+
+sSmallObjectPoolMTBase::Magazine *sSmallObjectPoolMTBase::NewFull()
+{
+  sPtr magbytes = sAlign<sPtr>(sizeof(Magazine)*MagazinesPerChunk,Alignment);
+  uint8_t *mem = AllocChunk(magbytes+sPtr(ObjectSize)*MagazineSize*MagazinesPerChunk);
+  Magazine *mags = (Magazine *) mem;
+  uint8_t *obj = mem+magbytes;
+
+  for(int i=0;i<MagazinesPerChunk;i++)
+  {
+    mags[i].Count = MagazineSize;
+    for(int j=MagazineSize-1;j>=0;j--)  // hand out in address order
+    {
+      mags[i].Items[j] = obj;
+      obj += ObjectSize;
+    }
+  }
+  for(int i=1;i<MagazinesPerChunk;i++)
+    Push(&Full,&mags[i]);
+  return &mags[0];
+}
+
+sSmallObjectPoolMTBase::Magazine *sSmallObjectPoolMTBase::NewEmpty()
+{
+  Magazine *m = Pop(&Empty);
+  if(!m)
+  {
+    m = (Magazine *) AllocChunk(sizeof(Magazine));
+    m->Count = 0;
+  }
+  return m;
+}
+
+sSmallObjectPoolMTBase::Slot *sSmallObjectPoolMTBase::Enter()
+{
+  uint32_t i = uint32_t((uint64_t(sPtr(sGetThreadContext()))*0x9e3779b97f4a7c15ULL)>>32);
+  for(;;)
+  {
+    Slot *s = &Slots[i&SlotMask];
+    if(!s->Busy && sAtomicSwap(&s->Busy,1)==0)
+    {
+      if(!s->Loaded)
+      {
+        s->Loaded = NewEmpty();
+        s->Previous = NewEmpty();
+      }
+      return s;
+    }
+    i++;                          // another thread has it, try the next one
+  }
+}
+
+void sSmallObjectPoolMTBase::Leave(Slot *s)
+{
+  sWriteBarrier();
+  s->Busy = 0;
+}
+
+/****************************************************************************/
+
+void *sSmallObjectPoolMTBase::Alloc()
+{
+  Slot *s = Enter();
+  Magazine *m = s->Loaded;
+  if(m->Count==0)
+  {
+    if(s->Previous->Count>0)
+    {
+      s->Loaded = s->Previous;
+    }
+    else
+    {
+      Push(&Empty,s->Previous);
+      s->Loaded = Pop(&Full);
+      if(!s->Loaded)
+        s->Loaded = NewFull();
     }
-
-    if(Target && !Target->Write(buffer,pos))
-      sDelete(Target);
+    s->Previous = m;
+    m = s->Loaded;
   }
-
-  Buffer.Clear();
+  void *item = m->Items[--m->Count];
+  Leave(s);
+  return item;
 }
 
-void sTextFileWriter::End()
+void sSmallObjectPoolMTBase::Free(void *what)
 {
-  Flush();
-  sDelete(Target);
+  if(!what)
+    return;
+
+  Slot *s = Enter();
+  Magazine *m = s->Loaded;
+  if(m->Count==MagazineSize)
+  {
+    if(s->Previous->Count<MagazineSize)
+    {
+      s->Loaded = s->Previous;
+    }
+    else
+    {
+      Push(&Full,s->Previous);
+      s->Loaded = NewEmpty();
+    }
+    s->Previous = m;
+    m = s->Loaded;
+  }
+  m->Items[m->Count++] = what;
+  Leave(s);
 }
 
 /****************************************************************************/
@@ -641,76 +1405,173 @@ void sTextFileWriter::End()
 /***                                                                      ***/
 /****************************************************************************/
 
+struct sStringPoolEntry
+{
+  sStringPoolEntry *Next;
+  sPoolStringHeader Header;
+  sChar Data[1];                  // the string follows the header directly
+};
+
 class sStringPool_
 {  
   enum enums
   {
-    HashSize = 4096,        // must be power of 2!
+    ShardBits = 6,
+    ShardCount = 1<<ShardBits,
+    StartSize = 256,              // buckets per shard, must be power of 2!
   };
 
-  struct sStringPoolEntry
+  struct Shard
   {
-    const sChar *Data;
-    sStringPoolEntry *Next;
+    sThreadLock Lock;
+    sMemoryPool *Mem;
+    sStringPoolEntry **HashTable;
+    int HashMask;
+    int Count;
+    uint64_t Lookups;
+    uint64_t Hits;
+    uint8_t Pad[64];              // keep the locks on different cache lines
   };
 
-  sMemoryPool *Strings;
-  sMemoryPool *Entries;
+  Shard Shards[ShardCount];
 
-  sStringPoolEntry *HashTable[HashSize];
+  void Grow(Shard &sh)
+  {
+    int size = (sh.HashMask+1)*2;
+    sStringPoolEntry **table = new sStringPoolEntry*[size];
+    sSetMem(table,0,size*sizeof(sStringPoolEntry *));
+    for(int i=0;i<=sh.HashMask;i++)
+    {
+      sStringPoolEntry *e = sh.HashTable[i];
+      while(e)
+      {
+        sStringPoolEntry *next = e->Next;
+        sStringPoolEntry **hp = &table[e->Header.Hash & (size-1)];
+        e->Next = *hp;
+        *hp = e;
+        e = next;
+      }
+    }
+    delete[] sh.HashTable;
+    sh.HashTable = table;
+    sh.HashMask = size-1;
+  }
 
 public:
-  sStringPool_()
+  uint32_t Generation;            // changes every time the pool is recreated
+  volatile uint64_t CacheHits;
+
+  sStringPool_(uint32_t generation)
   {
-    Strings = new sMemoryPool();
-    Entries = new sMemoryPool();
-    sClear(HashTable);
+    for(int i=0;i<ShardCount;i++)
+    {
+      Shard &sh = Shards[i];
+      sh.Mem = new sMemoryPool(0x4000);
+      sh.HashTable = new sStringPoolEntry*[StartSize];
+      sSetMem(sh.HashTable,0,StartSize*sizeof(sStringPoolEntry *));
+      sh.HashMask = StartSize-1;
+      sh.Count = 0;
+      sh.Lookups = 0;
+      sh.Hits = 0;
+    }
+    Generation = generation;
+    CacheHits = 0;
   }
 
   ~sStringPool_()
   {
-    delete Strings;
-    delete Entries;
+    for(int i=0;i<ShardCount;i++)
+    {
+      delete Shards[i].Mem;
+      delete[] Shards[i].HashTable;
+    }
   }
 
-  const sChar *Add(const sChar *s,int len, sBool *isnew)
+  const sStringPoolEntry *Add(const sChar *s,int len,uint32_t hash,sBool *isnew)
   {
-    sStringPoolEntry *e;
-    sStringPoolEntry **hp;
+    Shard &sh = Shards[hash>>(32-ShardBits)];
+    sScopeLock lock(&sh.Lock);
+    sh.Lookups++;
 
-    uint32_t hash = sHashString(s,len);
-
-    hp = &HashTable[hash & (HashSize-1)]; 
-    e = *hp;
+    sStringPoolEntry **hp = &sh.HashTable[hash & sh.HashMask]; 
+    sStringPoolEntry *e = *hp;
     while(e)
     {
-      if(sCmpMem(e->Data,s,len*sizeof(sChar))==0 && e->Data[len]==0)
+      if(e->Header.Hash==hash && e->Header.Len==len && sCmpMem(e->Data,s,len*sizeof(sChar))==0)
       {
+        sh.Hits++;
         if (isnew) *isnew=sFALSE;
-        return e->Data;
+        return e;
       }
       e = e->Next;
     }
 
-    e = Entries->Alloc<sStringPoolEntry>();
-    sChar *data = Strings->Alloc<sChar>(len+1);
-    e->Data = data;
-    sCopyMem(data,s,sizeof(sChar)*len);
-    data[len] = 0;
+    e = (sStringPoolEntry *) sh.Mem->Alloc(sOFFSET(sStringPoolEntry,Data)+sizeof(sChar)*(len+1),sALIGNOF(sStringPoolEntry));
+    e->Header.Hash = hash;
+    e->Header.Len = len;
+    sCopyMem(e->Data,s,sizeof(sChar)*len);
+    e->Data[len] = 0;
     e->Next = *hp;
     *hp = e;
+    if(++sh.Count>2*(sh.HashMask+1))
+      Grow(sh);
 
     if (isnew) *isnew=sTRUE;
-    return e->Data;
+    return e;
+  }
+
+  void GetStats(sStringPoolStats &stats)
+  {
+    sClear(stats);
+    stats.Shards = ShardCount;
+    for(int i=0;i<ShardCount;i++)
+    {
+      Shard &sh = Shards[i];
+      sScopeLock lock(&sh.Lock);
+      stats.Strings += sh.Count;
+      stats.Bytes += sh.Mem->BytesAllocated() + (sh.HashMask+1)*sizeof(sStringPoolEntry *);
+      stats.Lookups += sh.Lookups;
+      stats.PoolHits += sh.Hits;
+      stats.MaxShardStrings = sMax(stats.MaxShardStrings,sh.Count);
+    }
+    stats.CacheHits = CacheHits;
+    stats.Lookups += CacheHits;
   }
 };
 
 static sStringPool_ *sStringPool;
+static uint32_t sStringPoolGeneration;
 const sChar *sPoolStringEmpty;
 
 const sChar *sAddToStringPool(const sChar *s,int len, sBool *isnew)
 {
-  return sStringPool->Add(s,len,isnew);
+  uint32_t hash = sHashString(s,len);
+
+  // look into the cache of this thread first
+
+  sThreadContext *ctx = sGetThreadContext();
+  if(ctx->StringCacheGeneration!=sStringPool->Generation)
+  {
+    sClear(ctx->StringCache);
+    ctx->StringCacheGeneration = sStringPool->Generation;
+    ctx->StringCacheHits = 0;
+  }
+  const sStringPoolEntry **slot = &ctx->StringCache[hash & (sSTRINGPOOL_CACHE-1)];
+  const sStringPoolEntry *e = *slot;
+  if(e && e->Header.Hash==hash && e->Header.Len==len && sCmpMem(e->Data,s,len*sizeof(sChar))==0)
+  {
+    if(++ctx->StringCacheHits==256)
+    {
+      sAtomicAdd(&sStringPool->CacheHits,uint64_t(ctx->StringCacheHits));
+      ctx->StringCacheHits = 0;
+    }
+    if (isnew) *isnew=sFALSE;
+    return e->Data;
+  }
+
+  e = sStringPool->Add(s,len,hash,isnew);
+  *slot = e;
+  return e->Data;
 }
 
 const sChar *sAddToStringPool2(const sChar *a,int al,const sChar *b,int bl)
@@ -724,11 +1585,30 @@ const sChar *sAddToStringPool2(const sChar *a,int al,const sChar *b,int bl)
   return p;
 }
 
+void sGetStringPoolStats(sStringPoolStats &stats)
+{
+  if(sStringPool)
+    sStringPool->GetStats(stats);
+  else
+    sClear(stats);
+}
+
+void sLogStringPoolStats()
+{
+  sStringPoolStats stats;
+  sGetStringPoolStats(stats);
+  uint64_t hits = stats.CacheHits+stats.PoolHits;
+  sLogF(L"mem",L"string pool: %d strings, %d KB, %d shards (fullest %d)\n",
+    stats.Strings,int(stats.Bytes/1024),stats.Shards,stats.MaxShardStrings);
+  sLogF(L"mem",L"string pool: %d lookups, %d%% hits, %d%% cache hits\n",
+    int(stats.Lookups),int(stats.Lookups ? hits*100/stats.Lookups : 0),int(stats.Lookups ? stats.CacheHits*100/stats.Lookups : 0));
+}
+
 void sInitStringPool()
 {
   if(!sStringPool)
   {
-    sStringPool = new sStringPool_;
+    sStringPool = new sStringPool_(++sStringPoolGeneration);
     sPoolStringEmpty = sAddToStringPool(L"",0);
   }
 }
@@ -1005,40 +1885,46 @@ void sRectRegion::AddParts(sRect old,const sRect &sub)
 
 sStringMap_::sStringMap_ (int numSlots)
 {
-  Size = numSlots;
-  Slots = new Slot*[Size];
-  sSetMem(Slots, 0, Size * sizeof(Slot*));
+  Size = 0;
+  Used = 0;
+  LiveChars = 0;
+  DeadChars = 0;
+  Slots = sNULL;
+  Keys = new sMemoryPool(0x4000);
+
+  int size = 8;
+  while (size - size/8 < numSlots)
+    size *= 2;
+  Resize(size);
 }
 
 /****************************************************************************/
 
 sStringMap_::~sStringMap_ ()
 {
-  Clear();
   sDeleteArray(Slots);
+  sDelete(Keys);
 }
 
 /****************************************************************************/
 
 void sStringMap_::Clear ()
 {
-  for (int i = 0; i < Size; i++)
-  {
-    Slot * slot;
-    while ((slot = Slots[i])!=0)
-    {
-      Del(slot->key);
-    }
-  }
+  sSetMem(Slots, 0, Size * sizeof(Slot));
+  Used = 0;
+  LiveChars = 0;
+  DeadChars = 0;
+  Keys->Reset();
 }
 
 /****************************************************************************/
 
-uint32_t sStringMap_::Hash (const sChar * key) const
+uint32_t sStringMap_::Hash (const sChar * key,int &len) const
 {
   uint32_t hash = 0;
+  int i;
 
-  for (int i = 0; key[i]; i++)
+  for (i = 0; key[i]; i++)
   {
     hash += key[i];
     hash += (hash << 10);
@@ -1049,134 +1935,185 @@ uint32_t sStringMap_::Hash (const sChar * key) const
   hash ^= (hash >> 11);
   hash += (hash << 15);
 
-  return hash % Size;
+  len = i;
+  return hash ? hash : 1;         // 0 marks empty slots
 }
 
 /****************************************************************************/
 
-void sStringMap_::Del (const sChar * key)
+int sStringMap_::Find (const sChar * key,uint32_t &hash,int &len) const
 {
-  int slotNum = Hash(key);
-  Slot * slot = Slots[slotNum];
-  Slot * last = sNULL;
+  hash = Hash(key,len);
 
-  if (slot)
+  int mask = Size-1;
+  int i = hash & mask;
+  for (int dist = 0; Slots[i].Hash; dist++)
   {
-    while (1)
-    {
-      if (sCmpString(slot->key, key) == 0)
-      {
-        if (slot->next)
-        {
-          if (last) last->next = slot->next;
-          else Slots[slotNum] = slot->next;
-        }
-        else
-        {
-          if (last) last->next = sNULL;
-          else Slots[slotNum] = slot->next;
-        }
-
-        delete[] slot->key;
-        sDelete(slot);
-        return;
-      }
-      if (!slot->next) return; // key not found
-      last = slot;
-      slot = slot->next;
-    }
+    const Slot &slot = Slots[i];
+    if (slot.Hash == hash && slot.Len == len && sCmpMem(slot.Key, key, len*sizeof(sChar)) == 0)
+      return i;
+    if (int((i - slot.Hash) & mask) < dist)
+      break;                      // robin hood: the key would have been placed here
+    i = (i+1) & mask;
   }
+  return -1;
 }
 
 /****************************************************************************/
 
-void * sStringMap_::Get (const sChar * key) const
+void sStringMap_::Place (const Slot &slot)
 {
-  int slotNum = Hash(key);
-  Slot * slot = Slots[slotNum];
-  if (slot)
+  int mask = Size-1;
+  int i = slot.Hash & mask;
+  int dist = 0;
+
+  // skip all slots that are not further away from their home
+
+  while (Slots[i].Hash && int((i - Slots[i].Hash) & mask) >= dist)
+  {
+    i = (i+1) & mask;
+    dist++;
+  }
+
+  // shift the rest of the cluster by one
+
+  if (Slots[i].Hash)
   {
-    while (1)
+    int e = i;
+    while (Slots[e].Hash)
+      e = (e+1) & mask;
+    while (e != i)
     {
-      if (sCmpString(slot->key, key) == 0)
-        return slot->value;
-      if (!slot->next) break; // key not found
-      slot = slot->next;
+      int p = (e-1) & mask;
+      Slots[e] = Slots[p];
+      e = p;
     }
   }
 
-  return sNULL;
+  Slots[i] = slot;
+  Used++;
 }
 
 /****************************************************************************/
 
-void sStringMap_::Set (const sChar * key, void * value)
+void sStringMap_::Resize (int size)
 {
-  int slotNum = Hash(key);
+  Slot * old = Slots;
+  int oldSize = Size;
 
-  Slot * slot = Slots[slotNum];
-  if (slot)
+  // repack the keys if most of the pool is garbage
+
+  sMemoryPool * oldKeys = sNULL;
+  if (DeadChars > LiveChars)
   {
-    while (1)
-    {
-      if (sCmpString(slot->key, key) == 0)
-      { 
-        sDelete (slot->key);
-        break; // key already inserted
-      }
-      else if (!slot->next)
-      {
-        slot->next = new Slot; 
-        slot = slot->next; 
-        slot->next = sNULL;
-        break;
-      }
+    oldKeys = Keys;
+    Keys = new sMemoryPool(0x4000);
+    DeadChars = 0;
+  }
+
+  Slots = new Slot[size];
+  sSetMem(Slots, 0, size * sizeof(Slot));
+  Size = size;
+  Used = 0;
 
-      slot = slot->next;
+  for (int i = 0; i < oldSize; i++)
+  {
+    if (old[i].Hash)
+    {
+      Slot slot = old[i];
+      if (oldKeys)
+        slot.Key = Keys->AllocString(slot.Key, slot.Len);
+      Place(slot);
     }
   }
-  else
+
+  sDeleteArray(old);
+  sDelete(oldKeys);
+}
+
+/****************************************************************************/
+
+void sStringMap_::Del (const sChar * key)
+{
+  uint32_t hash;
+  int len;
+  int i = Find(key, hash, len);
+  if (i < 0) return; // key not found
+
+  LiveChars -= len+1;
+  DeadChars += len+1;
+
+  // backward shift, so no tombstones are needed
+
+  int mask = Size-1;
+  int j = (i+1) & mask;
+  while (Slots[j].Hash && ((j - Slots[j].Hash) & mask) != 0)
   {
-    Slots[slotNum] = slot = new Slot;
-    slot->next = sNULL;
+    Slots[i] = Slots[j];
+    i = j;
+    j = (j+1) & mask;
   }
+  sClear(Slots[i]);
+  Used--;
+
+  // the map may never grow again, so repack here as well. the slack of
+  // Size keeps small maps from repacking on every call
 
-  slot->value = value;  
-  int keyLen = sGetStringLen(key)+1;
-  slot->key = new sChar[keyLen];
-  sCopyString(slot->key, key, keyLen);
+  if (DeadChars > LiveChars + Size)
+    Resize(Size);
 }
 
 /****************************************************************************/
 
-int sStringMap_::GetCount () const
+void * sStringMap_::Get (const sChar * key) const
+{
+  uint32_t hash;
+  int len;
+  int i = Find(key, hash, len);
+  return i >= 0 ? Slots[i].Value : sNULL;
+}
+
+/****************************************************************************/
+
+void sStringMap_::Set (const sChar * key, void * value)
 {
-  int count = 0;
-  for (int slotNum = 0; slotNum < Size; slotNum++)
+  uint32_t hash;
+  int len;
+  int i = Find(key, hash, len);
+  if (i >= 0)
   {
-    if (Slots[slotNum])
-    {
-      count++;
-      Slot * slot = Slots[slotNum];
-      while ((slot = slot->next)!=0) count++;
-    }
+    Slots[i].Value = value;   // key already inserted
+    return;
   }
-  return count;
+
+  if ((Used+1)*8 > Size*7)
+    Resize(Size*2);
+
+  Slot slot;
+  slot.Hash = hash;
+  slot.Len = len;
+  slot.Key = Keys->AllocString(key, len);
+  slot.Value = value;
+  LiveChars += len+1;
+  Place(slot);
+}
+
+/****************************************************************************/
+
+int sStringMap_::GetCount () const
+{
+  return Used;
 }
 
 /****************************************************************************/
 
 sStaticArray<sChar *> * sStringMap_::GetKeys () const
 {
-  sStaticArray<sChar *> * keys = new sStaticArray<sChar *>(GetCount());
-  for (int slotNum = 0; slotNum < Size; slotNum++)
+  sStaticArray<sChar *> * keys = new sStaticArray<sChar *>(Used);
+  for (int i = 0; i < Size; i++)
   {
-    if (Slots[slotNum])
-    {
-      Slot * slot = Slots[slotNum];
-      keys->AddTail(slot->key);
-      while ((slot = slot->next)!=0) keys->AddTail(slot->key);
-    }
+    if (Slots[i].Hash)
+      keys->AddTail(Slots[i].Key);
   }
   return keys;
 }
@@ -1185,29 +2122,14 @@ sStaticArray<sChar *> * sStringMap_::GetKeys () const
 
 void sStringMap_::Dump () const
 {
+  int mask = Size-1;
   for (int i = 0; i < Size; i++)
   {
-    Slot * slot = Slots[i];
-    sPrintF(L"%02d: ", i);
-    if (slot)
-    {
-      while (1)
-      {
-        sPrintF(L"%s->%x ", slot->key, (ptrdiff_t)slot->value);
-
-        if (!slot->next) 
-        {
-          sPrintF(L"\n");
-          break;
-        }
-
-        slot = slot->next;
-      }
-    }
+    const Slot &slot = Slots[i];
+    if (slot.Hash)
+      sPrintF(L"%02d: %s->%x (%d)\n", i, slot.Key, (ptrdiff_t)slot.Value, int((i - slot.Hash) & mask));
     else
-    {
-      sPrintF(L"\n");
-    }
+      sPrintF(L"%02d:\n", i);
   }
 }
 
@@ -1217,123 +2139,386 @@ void sStringMap_::Dump () const
 /***                                                                      ***/
 /****************************************************************************/
 
-#define BITSHIFT 5
-#define BITMASK 31
-#define WORDSPERCHUNK 4
-#define BYTESPERWORD (1<<(BITSHIFT-3))
-#define BITSPERCHUNK ((1<<BITSHIFT)*WORDSPERCHUNK)
+#if sCONFIG_COMPILER_GCC
+static sINLINE int sBitCount64(uint64_t x)   { return __builtin_popcountll(x); }
+#else
+static sINLINE int sBitCount64(uint64_t x)
+{
+  x = x - ((x>>1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x>>2) & 0x3333333333333333ULL);
+  x = (x + (x>>4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return int((x*0x0101010101010101ULL)>>56);
+}
+#endif
+
+enum sBitVectorOp
+{
+  sBVO_AND = 0,
+  sBVO_OR,
+  sBVO_ANDNOT,
+  sBVO_XOR,
+};
+
+static sINLINE uint64_t sBitVectorOp1(uint64_t a,uint64_t b,int op)
+{
+  switch(op)
+  {
+  case sBVO_AND:    return a&b;
+  case sBVO_OR:     return a|b;
+  case sBVO_ANDNOT: return a&~b;
+  default:          return a^b;
+  }
+}
+
+// the kernels. SSE2 only when the compiler may use it, which is always
+// on x86-64 but not for i386 builds without -msse2. AVX2 is checked at
+// runtime.
+
+#if sCONFIG_COMPILER_GCC && (defined(__i386__) || defined(__x86_64__))
+#include <immintrin.h>
+#if defined(__SSE2__)
+#define sBITVECTOR_SSE2 1
+#else
+#define sBITVECTOR_SSE2 0
+#endif
+#define sBITVECTOR_AVX2 1
+#elif sCONFIG_COMPILER_MSC && (defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2))
+#include <emmintrin.h>
+#define sBITVECTOR_SSE2 1
+#define sBITVECTOR_AVX2 0
+#else
+#define sBITVECTOR_SSE2 0
+#define sBITVECTOR_AVX2 0
+#endif
+
+#define BITVECTOR_KERNEL(type,load,store,and_,or_,andnot_,xor_,step)                          \
+  sPtr i = 0;                                                                                 \
+  switch(op)                                                                                  \
+  {                                                                                           \
+  case sBVO_AND:    for(;i+step<=words;i+=step) store((type *)(d+i),and_(load((const type *)(d+i)),load((const type *)(s+i)))); break;     \
+  case sBVO_OR:     for(;i+step<=words;i+=step) store((type *)(d+i),or_(load((const type *)(d+i)),load((const type *)(s+i)))); break;      \
+  case sBVO_ANDNOT: for(;i+step<=words;i+=step) store((type *)(d+i),andnot_(load((const type *)(s+i)),load((const type *)(d+i)))); break; \
+  case sBVO_XOR:    for(;i+step<=words;i+=step) store((type *)(d+i),xor_(load((const type *)(d+i)),load((const type *)(s+i)))); break;     \
+  }                                                                                           \
+  for(;i<words;i++)                                                                           \
+    d[i] = sBitVectorOp1(d[i],s[i],op);
+
+#if sBITVECTOR_AVX2
+__attribute__((target("avx2")))
+static void sBitVectorKernelAVX2(uint64_t *d,const uint64_t *s,sPtr words,int op)
+{
+  BITVECTOR_KERNEL(__m256i,_mm256_loadu_si256,_mm256_storeu_si256,_mm256_and_si256,_mm256_or_si256,_mm256_andnot_si256,_mm256_xor_si256,4)
+}
+#endif
+
+static void sBitVectorKernel(uint64_t *d,const uint64_t *s,sPtr words,int op)
+{
+#if sBITVECTOR_AVX2
+  static int avx2 = -1;
+  if(avx2<0)
+    avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+  if(avx2)
+  {
+    sBitVectorKernelAVX2(d,s,words,op);
+    return;
+  }
+#endif
+#if sBITVECTOR_SSE2
+  BITVECTOR_KERNEL(__m128i,_mm_loadu_si128,_mm_storeu_si128,_mm_and_si128,_mm_or_si128,_mm_andnot_si128,_mm_xor_si128,2)
+#else
+  for(sPtr i=0;i<words;i++)
+    d[i] = sBitVectorOp1(d[i],s[i],op);
+#endif
+}
+
+#undef BITVECTOR_KERNEL
+
+/****************************************************************************/
+
+sBitVector::sBitVector()
+{
+  Words = 2;
+  NewVal = 0;
+  Data = new uint64_t[Words];
+  Summary = new uint64_t[1];
+  Ranks = 0;
+  RanksValid = 0;
+  ClearAll();
+}
+
+sBitVector::~sBitVector()
+{
+  delete[] Data;
+  delete[] Summary;
+  delete[] Ranks;
+}
 
 void sBitVector::Resize(int bits)
 {
-  sPtr words = ((bits+BITSPERCHUNK-1)/BITSPERCHUNK)*4;
+  sPtr words = ((sPtr(bits)+127)/128)*2;
   if(Words<words)
   {
-    uint32_t *nd = new uint32_t[words];
-    sCopyMem(nd,Data,Words*BYTESPERWORD);
-    sSetMem(nd+Words,NewVal,(words-Words)*BYTESPERWORD);
+    uint64_t *nd = new uint64_t[words];
+    sCopyMem(nd,Data,Words*sizeof(uint64_t));
+    for(sPtr i=Words;i<words;i++)
+      nd[i] = NewVal;
     delete[] Data;
     Data = nd;
     Words = words;
+    delete[] Summary;
+    Summary = new uint64_t[(Words+63)/64];
+    BuildSummary();
+    RanksValid = 0;
   }
 }
 
-void sBitVector::ClearAll()
+void sBitVector::Grow(int bit)
 {
-  NewVal = 0;
-  sSetMem(Data,NewVal,Words*BYTESPERWORD);
+  if(sPtr(bit)>=Words*64)
+    Resize(sMax<int>(bit+1,int(sMin<sPtr>(Words*128,0x7fffffff))));
 }
 
-void sBitVector::SetAll()
+void sBitVector::BuildSummary()
 {
-  NewVal = 0; NewVal--;
-  sSetMem(Data,NewVal,Words*BYTESPERWORD);
+  sSetMem(Summary,0,((Words+63)/64)*sizeof(uint64_t));
+  for(sPtr i=0;i<Words;i++)
+    if(Data[i])
+      Summary[i>>6] |= 1ULL<<(i&63);
 }
 
-sBitVector::sBitVector()
+void sBitVector::BuildRanks()
+{
+  sPtr blocks = (Words+7)/8;
+  delete[] Ranks;
+  Ranks = new uint32_t[blocks+1];
+  uint32_t count = 0;
+  for(sPtr b=0;b<blocks;b++)
+  {
+    Ranks[b] = count;
+    sPtr end = sMin<sPtr>(b*8+8,Words);
+    for(sPtr i=b*8;i<end;i++)
+      count += sBitCount64(Data[i]);
+  }
+  Ranks[blocks] = count;
+  RanksValid = 1;
+}
+
+void sBitVector::ClearAll()
 {
-  Words = WORDSPERCHUNK;
   NewVal = 0;
-  Data = new uint32_t[Words];
-  ClearAll();
+  sSetMem(Data,0,Words*sizeof(uint64_t));
+  BuildSummary();
+  RanksValid = 0;
 }
 
-sBitVector::~sBitVector()
+void sBitVector::SetAll()
 {
-  delete[] Data;
+  NewVal = ~0ULL;
+  sSetMem(Data,0xff,Words*sizeof(uint64_t));
+  BuildSummary();
+  RanksValid = 0;
 }
 
-sBool sBitVector::Get(int n)
+sBool sBitVector::Get(int n) const
 {
-  sPtr b = n>>BITSHIFT;
+  sPtr b = n>>6;
   if(b<Words)
-    return (Data[n>>BITSHIFT]>>(n&BITMASK))&1;
+    return (Data[b]>>(n&63))&1;
   else
     return NewVal & 1;
 }
 
 void sBitVector::Set(int n)
 {
-  Resize(n+1);
-  Data[n>>BITSHIFT] |= (1<<(n&BITMASK));
+  Grow(n);
+  Data[n>>6] |= 1ULL<<(n&63);
+  Summary[n>>12] |= 1ULL<<((n>>6)&63);
+  RanksValid = 0;
 }
 
 void sBitVector::Clear(int n)
 {
-  Resize(n+1);
-  Data[n>>BITSHIFT] &= ~(1<<(n&BITMASK));
+  Grow(n);
+  Data[n>>6] &= ~(1ULL<<(n&63));
+  UpdateSummary(n>>6);
+  RanksValid = 0;
 }
 
 void sBitVector::Assign(int n,int v)
 {
-  Resize(n+1);
-  int mask = 1<<(n&BITMASK);
-  int byte = n>>BITSHIFT;
-
-  Data[byte] &= ~mask;
-  Data[byte] |= ((v&1)<<(n&BITMASK));
+  if(v&1)
+    Set(n);
+  else
+    Clear(n);
 }
 
-sBool sBitVector::NextBit(int &n)
+sBool sBitVector::NextBit(int &n) const
 {
-  sVERIFY(NewVal==0);
-
   n++;
-  sPtr word = n>>BITSHIFT;
-  uint32_t bit = n&BITMASK;
+  sPtr word = sPtr(n)>>6;
+  if(word>=Words)
+    return 0;
 
-  // check remaining bits of this byte
+  // remaining bits of this word
 
-  if(bit>0 && Data[word])
+  uint64_t bits = Data[word] & (~0ULL<<(n&63));
+  if(!bits)
   {
-    while(bit<(1<<BITSHIFT))
+    // find the next word that is not empty in the summary
+
+    word++;
+    if(word>=Words)
+      return 0;
+    sPtr sum = word>>6;
+    sPtr sums = (Words+63)/64;
+    uint64_t s = Summary[sum] & (~0ULL<<(word&63));
+    while(!s)
     {
-      if(Data[word] & (1<<bit))
-      {
-        n = (word<<BITSHIFT)+bit;
-        return 1;
-      }
-      bit++;
+      if(++sum>=sums)
+        return 0;
+      s = Summary[sum];
     }
-    bit = 0;
-    word++;
+    word = sum*64+sFindLowestBit(s);
+    bits = Data[word];
   }
 
-  // skip words..
+  n = int(word*64+sFindLowestBit(bits));
+  return 1;
+}
 
-  while(Data[word]==0 && word<Words)
-    word++;
-  if(word>=Words)
+int sBitVector::Count()
+{
+  if(!RanksValid)
+    BuildRanks();
+  return Ranks[(Words+7)/8];
+}
+
+int sBitVector::Rank(int n)
+{
+  if(n<=0)
     return 0;
+  if(!RanksValid)
+    BuildRanks();
+  sPtr word = sPtr(n)>>6;
+  if(word>=Words)
+    return Ranks[(Words+7)/8] + (NewVal ? int(n-Words*64) : 0);
+
+  int count = Ranks[word>>3];
+  for(sPtr i=word&~7;i<word;i++)
+    count += sBitCount64(Data[i]);
+  if(n&63)
+    count += sBitCount64(Data[word] & (~0ULL>>(64-(n&63))));
+  return count;
+}
 
-  // find bit
+int sBitVector::Select(int k)
+{
+  if(!RanksValid)
+    BuildRanks();
+  sPtr blocks = (Words+7)/8;
+  if(k<0 || uint32_t(k)>=Ranks[blocks])
+    return -1;
 
-  sVERIFY(bit==0);
-  sVERIFY(Data[word]!=0);
+  // last block that starts with no more than k bits before it
 
-  while(!(Data[word] & (1<<bit)))
-    bit++;
-  n = (word<<BITSHIFT)+bit;
-  return 1;
+  sPtr lo = 0;
+  sPtr hi = blocks;
+  while(hi-lo>1)
+  {
+    sPtr mid = (lo+hi)/2;
+    if(Ranks[mid]<=uint32_t(k))
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  k -= Ranks[lo];
+  sPtr word = lo*8;
+  for(;;)
+  {
+    int c = sBitCount64(Data[word]);
+    if(k<c)
+      break;
+    k -= c;
+    word++;
+  }
+
+  uint64_t bits = Data[word];
+  while(k-->0)
+    bits &= bits-1;
+  return int(word*64+sFindLowestBit(bits));
+}
+
+/****************************************************************************/
+
+void sBitVector::Combine(const sBitVector &b,int op)
+{
+  Resize(int(sMin<sPtr>(b.Words*64,0x7fffffff)));
+  sBitVectorKernel(Data,b.Data,b.Words,op);
+  for(sPtr i=b.Words;i<Words;i++)
+    Data[i] = sBitVectorOp1(Data[i],b.NewVal,op);
+  NewVal = sBitVectorOp1(NewVal,b.NewVal,op);
+  BuildSummary();
+  RanksValid = 0;
+}
+
+void sBitVector::Copy(const sBitVector &b)
+{
+  if(Words!=b.Words)
+  {
+    delete[] Data;
+    delete[] Summary;
+    Words = b.Words;
+    Data = new uint64_t[Words];
+    Summary = new uint64_t[(Words+63)/64];
+  }
+  sCopyMem(Data,b.Data,Words*sizeof(uint64_t));
+  sCopyMem(Summary,b.Summary,((Words+63)/64)*sizeof(uint64_t));
+  NewVal = b.NewVal;
+  RanksValid = 0;
+}
+
+void sBitVector::And(const sBitVector &b)     { Combine(b,sBVO_AND); }
+void sBitVector::Or(const sBitVector &b)      { Combine(b,sBVO_OR); }
+void sBitVector::AndNot(const sBitVector &b)  { Combine(b,sBVO_ANDNOT); }
+void sBitVector::Xor(const sBitVector &b)     { Combine(b,sBVO_XOR); }
+
+/****************************************************************************/
+
+template <class streamer> void sBitVector::Serialize_(streamer &s)
+{
+  if(s.Header(sSerId::sBitVector,1))
+  {
+    int words = int(Words);
+    int all = NewVal ? 1 : 0;
+    s | words | all;
+    if(s.IsReading())
+    {
+      delete[] Data;
+      delete[] Summary;
+      Words = words;
+      Data = new uint64_t[Words];
+      Summary = new uint64_t[(Words+63)/64];
+      NewVal = all ? ~0ULL : 0;
+    }
+    s.ArrayU64(Data,words);
+    s.Footer();
+    if(s.IsReading())
+    {
+      BuildSummary();
+      RanksValid = 0;
+    }
+  }
+}
+
+void sBitVector::Serialize(sReader &stream)
+{
+  Serialize_(stream);
+}
+
+void sBitVector::Serialize(sWriter &stream)
+{
+  Serialize_(stream);
 }
 
 /****************************************************************************/
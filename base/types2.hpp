@@ -48,7 +48,7 @@ sArray is an automatically resizing version of sStaticArray.
 template <class Type> class sArray : public sStaticArray<Type>
 {
   void ReAlloc(int max)          { if(max>=this->Used && max!=this->Alloc) { sTAG_CALLER(); Type *n=new Type[max];
-                                    if (n) { for(int i=0;i<this->Used;i++) n[i]=this->Data[i]; 
+                                    if (n) { sMoveElements(n,this->Data,this->Used); 
                                     delete[] this->Data; this->Data=n; this->Alloc=max; } } }
 
 public:
@@ -64,6 +64,63 @@ public:
   ~sAutoArray<Type>() { sDeleteAll(*this); }
 };
 
+// sSmallArray grows like sArray, but the first Max_ elements are stored
+// inside the array itself, so small arrays never allocate.
+template <class Type,int Max_> class sSmallArray : public sStaticArray<Type>
+{
+  Type Storage[Max_];
+  void ReAlloc(int max)          { if(max>this->Alloc) { sTAG_CALLER(); Type *n=new Type[max];
+                                    sMoveElements(n,this->Data,this->Used);
+                                    if(this->Data!=Storage) delete[] this->Data;
+                                    this->Data=n; this->Alloc=max; } }
+public:
+  enum { SIZE = Max_ };
+  sSmallArray()                   { this->Data = Storage; this->Alloc = Max_; }
+  sSmallArray(const sSmallArray &a) : sStaticArray<Type>() { this->Data = Storage; this->Alloc = Max_; this->Copy(a); }
+  ~sSmallArray()                  { if(this->Data==Storage) this->Data = 0; }
+  sSmallArray &operator=(const sSmallArray &a) { if(this!=&a) this->Copy(a); return *this; }
+  void Grow(int add)             { if(this->Used+add>this->Alloc) ReAlloc(sMax(this->Used+add,this->Alloc*2)); }
+  void Reset()                    { if(this->Data!=Storage) delete[] this->Data; this->Data = Storage; this->Used = 0; this->Alloc = Max_; }
+  sBool IsInline() const          { return this->Data==Storage; }
+
+  // swap two elements. declaring Swap() here hides all base overloads,
+  // so this one is forwarded; the base Swap(sStaticArray &) stays hidden.
+  void Swap(int i,int j)        { sStaticArray<Type>::Swap(i,j); }
+  // swap the contents with another small array. exchanging the pointers
+  // would hand out the inline Storage, so inline elements are swapped or
+  // moved one by one.
+  void Swap(sSmallArray &a)
+  {
+    if(!IsInline() && !a.IsInline())
+    {
+      sStaticArray<Type>::Swap(a);
+    }
+    else if(IsInline() && a.IsInline())
+    {
+      for(int i=0;i<sMax(this->Used,a.Used);i++)
+        sSwap(Storage[i],a.Storage[i]);
+      sSwap(this->Used,a.Used);
+    }
+    else if(IsInline())
+    {
+      a.Swap(*this);
+    }
+    else
+    {
+      Type *data = this->Data;
+      int used = this->Used;
+      int alloc = this->Alloc;
+      sMoveElements(Storage,a.Storage,a.Used);
+      this->Data = Storage;
+      this->Used = a.Used;
+      this->Alloc = Max_;
+      a.Data = data;
+      a.Used = used;
+      a.Alloc = alloc;
+    }
+  }
+};
+
 // sFixedArray is a static array that preallocates items for its maximum size
 template <class Type> class sFixedArray : public sStaticArray<Type>
 {
@@ -71,6 +128,25 @@ public:
   sFixedArray(int count)         { sStaticArray<Type>::HintSize(count); sStaticArray<Type>::AddMany(count); }
 };
 
+// sArenaArray grows like sArray, but allocates from an sArena. outgrown
+// storage and the elements are destroyed by the arena, not by the array.
+// a copy allocates from the arena of the array it is copied from.
+template <class Type> class sArenaArray : public sStaticArray<Type>
+{
+  sArena *Arena;
+  void ReAlloc(int max)          { if(max>this->Alloc) { Type *n=Arena->template NewArray<Type>(max);
+                                    sMoveElements(n,this->Data,this->Used);
+                                    this->Data=n; this->Alloc=max; } }
+public:
+  explicit sArenaArray(sArena *arena) { Arena = arena; }
+  sArenaArray(const sArenaArray &a) : sStaticArray<Type>() { Arena = a.Arena; this->Copy(a); }
+  ~sArenaArray()                  { this->Data = 0; }
+  sArenaArray &operator=(const sArenaArray &a) { if(this!=&a) this->Copy(a); return *this; }
+  void Grow(int add)             { if(this->Used+add>this->Alloc) ReAlloc(sMax(this->Used+add,sMax(this->Alloc*2,8))); }
+  void Reset()                    { this->Data = 0; this->Used = 0; this->Alloc = 0; }
+  sArena *GetArena() const        { return Arena; }
+};
+
 
 /************************************************************************/ /*! 
 \ingroup altona_base_types_arrays
@@ -100,8 +176,7 @@ template <class Type> class sEndlessArray
       int newalloc = sMax(max,Alloc*2);
       Type *newdata = new Type[newalloc];
 
-      for(int i=0;i<Used;i++)
-        newdata[i] = Data[i];
+      sMoveElements(newdata,Data,Used);
       delete[] Data;
       Data = newdata;
       Alloc = newalloc;
@@ -306,6 +381,7 @@ class sMessageTimer
 {
   friend void sMessageTimerThread(class sThread *t,void *v);
   class sThread *Thread;
+  class sThreadEvent *Event;      // signaled to cut the delay short when the timer is destroyed
   sMessage Msg;
   int Delay;
   int Loop;
@@ -335,6 +411,51 @@ class sTextBuffer
   sChar *Buffer;                  // buffer. not alway 0-terminated
   void Grow(int add);            // grow to make space for some additional chars
   void Init();
+
+  // edit mode: a piece table. the text lives in Store, which is only
+  // appended to. the pieces (Start,Len) into Store form a treap ordered by
+  // text position, each node knows length and linefeeds of its subtree.
+
+  struct Piece
+  {
+    int Left,Right;               // children, -1 for none
+    uint32_t Prio;                // heap order for the treap
+    int Start;                    // in Store
+    int Len;
+    int Lines;                    // linefeeds in this piece
+    int SubLen;                   // in this subtree
+    int SubLines;
+  };
+  enum { PieceMax = 1024 };       // longer pieces are split, so counting linefeeds stays cheap
+
+  sBool EditMode;
+  sBool Dirty;                    // Buffer is out of date
+  sChar *Store;
+  int StoreUsed;
+  int StoreAlloc;
+  sArray<Piece> Pieces;
+  int Root;
+  int FreePiece;
+  uint32_t Seed;
+
+  sArray<int> LineStarts;         // flat mode: start of each line, built on demand
+  sBool LinesValid;
+
+  int NewPiece(int start,int len);
+  void FreeTree(int t);
+  void UpdatePiece(int t);
+  void Split(int t,int pos,int &l,int &r);
+  int Merge(int l,int r);
+  int StoreText(const sChar *text,int len);
+  int FindPiece(int &pos) const;
+  void Rebase();                  // rebuild the pieces from Buffer
+  void Flatten();                 // bring Buffer up to date
+  void FlattenTree(int t,sChar *&dest) const;
+  void PieceInsert(int pos,const sChar *c,int len);
+  void PieceDelete(int pos,int count);
+  void PieceSet(int pos,sChar c);
+  int PieceChar(int pos) const;
+  void BuildLines();
 public:
   sTextBuffer();
   sTextBuffer(const sTextBuffer& tb);
@@ -359,13 +480,28 @@ public:
   const sChar *Get() const;       // terminate buffer and return pointer !!! THIS IS NOT CONST !!!
   sChar *Get();                   // terminate buffer and return pointer
   int GetCount() { return Used; };
-  int GetChar(int pos) { if(pos>=0 && pos<Used) return Buffer[pos]; else return 0; }
+  int GetChar(int pos) { if(pos>=0 && pos<Used) return Dirty ? PieceChar(pos) : Buffer[pos]; else return 0; }
   void Insert(int pos,sChar c);
   void Insert(int pos,const sChar *c,int len=-1);
   void Set(int pos,sChar c);
   void Delete(int pos);
   void Delete(int pos,int count);
 
+  // edit mode is for text editors on large texts. Insert(), Delete() and
+  // Set() take O(log n), Get() assembles the text only after changes.
+  // in this mode the pointer from Get() is a copy: it is only valid until
+  // the next change, and writing through it changes nothing.
+
+  void SetEditMode(sBool enable);
+  sBool GetEditMode() const       { return EditMode; }
+  void Copy(int pos,int count,sChar *dest) const; // copy without assembling the text
+
+  // lines, separated by '\n'. cached until the next change, O(log n) in edit mode
+
+  int GetLineCount();
+  int GetLineStart(int line);    // position of the first char of a line
+  int GetLine(int pos);          // line that contains pos
+
   // printing. this appends!
 
   void Indent(int count);        // finds last linefeed and indents with spaces
@@ -377,6 +513,41 @@ public:
   sPRINTING0(PrintF, sString<0x4000> tmp; sFormatStringBuffer buf=sFormatStringBase(tmp,format);buf,Print((const sChar*)tmp););
 };
 
+/****************************************************************************/
+/***                                                                      ***/
+/***   Arena String, a growing string in an sArena                        ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+class sArenaString
+{
+  sArena *Arena;
+  sChar *Buffer;                  // always 0-terminated, outgrown buffers stay in the arena
+  int Used;
+  int Alloc;
+  void Grow(int add);
+public:
+  explicit sArenaString(sArena *arena)  { Arena = arena; Buffer = 0; Used = 0; Alloc = 0; }
+  sArenaString(sArena *arena,const sChar *s) { Arena = arena; Buffer = 0; Used = 0; Alloc = 0; Add(s); }
+
+  sArenaString &operator=(const sChar *s) { Clear(); Add(s); return *this; }
+  sArenaString &operator+=(const sChar *s) { Add(s); return *this; }
+  operator const sChar*() const       { return Get(); }
+
+  void Clear()                          { Used = 0; if(Buffer) Buffer[0] = 0; }
+  const sChar *Get() const              { return Buffer ? Buffer : L""; }
+  int GetCount() const                  { return Used; }
+  sBool IsEmpty() const                 { return Used==0; }
+  sArena *GetArena() const              { return Arena; }
+
+  // printing. this appends!
+
+  void Add(const sChar *s)              { Add(s,sGetStringLen(s)); }
+  void Add(const sChar *s,int len);
+  void AddChar(int c);
+  sPRINTING0(PrintF, sString<1024> tmp; sFormatStringBuffer buf=sFormatStringBase(tmp,format);buf,Add((const sChar*)tmp););
+};
+
 /****************************************************************************/
 /***                                                                      ***/
 /***   Text Writer Class (formatted output to a large text file)          ***/
@@ -422,39 +593,85 @@ public:
 /***   * managing only items of one data type                             ***/
 /***   + items can be enumerated                                          ***/
 /***                                                                      ***/
+/***   between BeginConcurrent() and EndConcurrent(), any number of       ***/
+/***   threads may append with the Concurrent...() functions. indices     ***/
+/***   are reserved with one atomic add, missing chunks are allocated by  ***/
+/***   whoever needs them first and published with compare and swap.     ***/
+/***   the chunk directory can not grow meanwhile, so BeginConcurrent()   ***/
+/***   needs to know the maximum size. order of elements from different   ***/
+/***   threads is undefined. no other functions may be called meanwhile, ***/
+/***   except for reading elements this thread appended.                  ***/
+/***                                                                      ***/
 /****************************************************************************/
 
 template <typename T> class sPoolArray
 {
-  struct PoolItem
-  {
-    PoolItem(int size)                 { Data = new T[size]; }
-    ~PoolItem()                         { sDeleteArray(Data); }
-    T *Data;
-  };
-
-  sArray<PoolItem*> Items;
+  uint64_t *Chunks;                     // directory, sPtr(T*). 0 for chunks not allocated yet
+  int ChunkCount;                       // chunks allocated in serial mode
+  int ChunkAlloc;                       // size of directory
   int Used;
   int Alloc;
   int Log2Size;
+  sBool Concurrent;
 
   int ItemSize;
   int Mask;
 
-  void Grow()                           { Items.AddTail(new PoolItem(ItemSize)); Alloc += ItemSize; }
+  void Grow()
+  {
+    if(ChunkCount==ChunkAlloc)
+      GrowDirectory(sMax(ChunkAlloc*2,8));
+    if(!Chunks[ChunkCount])
+      Chunks[ChunkCount] = uint64_t(sPtr(new T[ItemSize]));
+    ChunkCount++;
+    Alloc += ItemSize;
+  }
+  void GrowDirectory(int count)
+  {
+    if(count<=ChunkAlloc) return;
+    uint64_t *d = new uint64_t[count];
+    sCopyMem(d,Chunks,ChunkAlloc*sizeof(uint64_t));
+    sSetMem(d+ChunkAlloc,0,(count-ChunkAlloc)*sizeof(uint64_t));
+    delete[] Chunks;
+    Chunks = d;
+    ChunkAlloc = count;
+  }
+  T *GetChunk(int c)                    // concurrent mode: allocate and publish chunk if not there yet
+  {
+    uint64_t chunk = ((volatile uint64_t *)Chunks)[c];
+    if(!chunk)
+    {
+      T *data = new T[ItemSize];
+      chunk = sAtomicCmpSwap(&((volatile uint64_t *)Chunks)[c],0,uint64_t(sPtr(data)));
+      if(chunk)
+        delete[] data;                  // someone else was faster
+      else
+        chunk = uint64_t(sPtr(data));
+    }
+    return (T *) sPtr(chunk);
+  }
 
-  const T& GetUnsafe(int i) const      { return Items[i>>Log2Size]->Data[i&Mask]; }
-  T& GetUnsafe(int i)                  { return Items[i>>Log2Size]->Data[i&Mask]; }
+  const T& GetUnsafe(int i) const      { return ((T *) sPtr(Chunks[i>>Log2Size]))[i&Mask]; }
+  T& GetUnsafe(int i)                  { return ((T *) sPtr(Chunks[i>>Log2Size]))[i&Mask]; }
 public:
 
-  sPoolArray(int l2s=12):Used(0),Alloc(0),Log2Size(l2s) { ItemSize = 1<<Log2Size; Mask = ItemSize-1; }
+  sPoolArray(int l2s=12):Chunks(0),ChunkCount(0),ChunkAlloc(0),Used(0),Alloc(0),Log2Size(l2s),Concurrent(0) { ItemSize = 1<<Log2Size; Mask = ItemSize-1; }
   ~sPoolArray()                         { Reset(); }
 
   void Clear()                          { Used = 0; }
-  void Reset(int l2s=-1)               { sDeleteAll(Items); Alloc = 0; Used = 0; if(l2s!=-1) {Log2Size=l2s; ItemSize = 1<<l2s; Mask = ItemSize-1; } }
+  void Reset(int l2s=-1)
+  {
+    sVERIFY(!Concurrent);
+    for(int i=0;i<ChunkAlloc;i++)
+      delete[] (T *) sPtr(Chunks[i]);
+    delete[] Chunks;
+    Chunks = 0; ChunkCount = 0; ChunkAlloc = 0;
+    Alloc = 0; Used = 0;
+    if(l2s!=-1) {Log2Size=l2s; ItemSize = 1<<l2s; Mask = ItemSize-1; }
+  }
 
   int GetCount() const                 { return Used; }
-  int GetItemCount() const             { return Items.GetCount(); }
+  int GetItemCount() const             { return ChunkCount; }
   int GetItemSize() const              { return ItemSize; }
   sBool IsEmpty() const                 { return Used==0; }
   sBool IsFull() const                  { return Used==Alloc; }
@@ -463,16 +680,25 @@ public:
   T* AddTail()                          { if(Used>=Alloc) Grow(); T *ptr = &(GetUnsafe(Used)); Used++; return ptr; }
   T* AddMany(int &count)               { count = (ItemSize-(Used&Mask)); if(Used==Alloc) Grow(); T *ptr = &(GetUnsafe(Used)); Used+=count; return ptr;}
 
-  const T& operator[](int i) const     { sVERIFY(i>=0 && i<=Used); return Items[i>>Log2Size]->Data[i&Mask]; }
-  T& operator[](int i)                 { sVERIFY(i>=0 && i<=Used); return Items[i>>Log2Size]->Data[i&Mask]; }
+  const T& operator[](int i) const     { sVERIFY(i>=0 && i<=Used); return GetUnsafe(i); }
+  T& operator[](int i)                 { sVERIFY(i>=0 && i<=Used); return GetUnsafe(i); }
 
 
   void RemAt(int p)                    { (*this)[p] = (*this)[Used-1]; Used--; }
   void RemTail()                        { sVERIFY(Used); Used--; }
 
-  void Swap(sPoolArray &a)              { sSwap(Used,a.Used); sSwap(Alloc,a.Alloc); sSwap(Log2Size,a.Log2Size);
-                                          sSwap(ItemSize,a.ItemSize); sSwap(Mask,a.Mask); Items.Swap(a.Items); }
+  void Swap(sPoolArray &a)              { sSwap(Chunks,a.Chunks); sSwap(ChunkCount,a.ChunkCount); sSwap(ChunkAlloc,a.ChunkAlloc);
+                                          sSwap(Used,a.Used); sSwap(Alloc,a.Alloc); sSwap(Log2Size,a.Log2Size);
+                                          sSwap(ItemSize,a.ItemSize); sSwap(Mask,a.Mask); sSwap(Concurrent,a.Concurrent); }
   void ConvertTo(sStaticArray<T> &dest) const;
+
+  // concurrent appending
+
+  void BeginConcurrent(int maxcount)   { sVERIFY(!Concurrent); GrowDirectory((maxcount+Mask)>>Log2Size); Concurrent = 1; }
+  void EndConcurrent();
+  int ConcurrentAddMany(int count);     // reserve count elements, returns index of first. may span chunks
+  T* ConcurrentAddTail()                { int i = ConcurrentAddMany(1); return &GetUnsafe(i); }
+  void ConcurrentAddTail(const T &e)    { int i = ConcurrentAddMany(1); GetUnsafe(i) = e; }
 };
 
 /****************************************************************************/
@@ -482,16 +708,43 @@ void sPoolArray<T>::ConvertTo(sStaticArray<T> &dest) const
 {
   dest.HintSize(Used);
   int left = Used;
-  for(int i=0;i<Items.GetCount();i++)
+  for(int i=0;left>0;i++)
   {
     T *dst = dest.AddMany(sMin(ItemSize,left));
-    const T *src = Items[i]->Data;
+    const T *src = (const T *) sPtr(Chunks[i]);
     for(int k=0;k<ItemSize && k<left;k++)
       *dst++ = *src++;
     left -= ItemSize;
   }
 }
 
+template <typename T> 
+int sPoolArray<T>::ConcurrentAddMany(int count)
+{
+  sVERIFY(Concurrent && count>0);
+  int last = int(sAtomicAdd((volatile uint32_t *)&Used,uint32_t(count)));
+  int first = last-count;
+  if(last>(ChunkAlloc<<Log2Size))
+    sFatal(L"sPoolArray: concurrent append beyond the size given to BeginConcurrent()");
+
+  // chunks that existed before only need to be read
+
+  for(int c=first>>Log2Size;c<=((last-1)>>Log2Size);c++)
+    if(c>=ChunkCount)
+      GetChunk(c);
+  return first;
+}
+
+template <typename T> 
+void sPoolArray<T>::EndConcurrent()
+{
+  sVERIFY(Concurrent);
+  sMemoryBarrier();
+  Concurrent = 0;
+  ChunkCount = sMax(ChunkCount,(Used+Mask)>>Log2Size);
+  Alloc = ChunkCount<<Log2Size;
+}
+
 /****************************************************************************/
 /***                                                                      ***/
 /***   sSmallObjectPool                                                   ***/
@@ -601,6 +854,86 @@ public:
   }
 };
 
+/****************************************************************************/
+/***                                                                      ***/
+/***   sSmallObjectPoolMT                                                 ***/
+/***                                                                      ***/
+/****************************************************************************/
+/***                                                                      ***/
+/***   threadsafe sSmallObjectPool. every thread works on magazines of    ***/
+/***   free objects in its own slot, only full and empty magazines are    ***/
+/***   exchanged with the depot, which is a pair of lock free stacks.     ***/
+/***   objects may be freed by another thread than the one that           ***/
+/***   allocated them. memory is only returned when the pool is deleted.  ***/
+/***                                                                      ***/
+/***   sSmallObjectPoolMTBase contains the implementation                 ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+class sSmallObjectPoolMTBase
+{
+  enum
+  {
+    MagazineSize = 64,            // objects per magazine
+    MagazinesPerChunk = 16,       // full magazines per chunk allocated from the heap
+    TagShift = 44,                // depot heads are pointer>>3 with an aba tag above
+  };
+
+  struct Magazine
+  {
+    Magazine *Next;
+    int Count;
+    void *Items[MagazineSize];
+  };
+
+  struct Slot                     // one cache line each
+  {
+    volatile uint32_t Busy;       // a thread is using this slot
+    Magazine *Loaded;             // allocate from and free to this one
+    Magazine *Previous;           // full or empty, swapped in before the depot is used
+    uint8_t Pad[64-3*sizeof(void *)];
+  };
+
+  Slot *Slots;
+  int SlotMask;
+  int ObjectSize;
+  int Alignment;
+  int AllocFlags;
+
+  volatile uint64_t Full;         // depot of full magazines
+  volatile uint64_t Empty;        // depot of empty magazines
+  volatile uint64_t Chunks;       // all memory, pushed only
+  volatile uint64_t BytesAlloc;
+
+  static uint64_t Pack(Magazine *m,uint64_t tag) { return (uint64_t(sPtr(m))>>3) | (tag<<TagShift); }
+  static Magazine *Unpack(uint64_t v) { return (Magazine *) sPtr((v&((1ULL<<TagShift)-1))<<3); }
+  static void Push(volatile uint64_t *depot,Magazine *m);
+  static Magazine *Pop(volatile uint64_t *depot);
+
+  uint8_t *AllocChunk(sPtr size);
+  Magazine *NewFull();
+  Magazine *NewEmpty();
+  Slot *Enter();
+  void Leave(Slot *s);
+
+public:
+  sSmallObjectPoolMTBase(int size,int alignment=16,int allocflags=sAMF_HEAP);
+  ~sSmallObjectPoolMTBase();
+
+  void *Alloc();
+  void Free(void *what);
+  uint64_t BytesAllocated() const { return BytesAlloc; }
+};
+
+template <typename T> class sSmallObjectPoolMT : public sSmallObjectPoolMTBase
+{
+public:
+  sSmallObjectPoolMT(int allocflags=sAMF_HEAP,int alignment=16) : sSmallObjectPoolMTBase(sizeof(T),alignment,allocflags) {}
+
+  T *Alloc()                      { return (T *) sSmallObjectPoolMTBase::Alloc(); }
+  void Free(T *what)              { sSmallObjectPoolMTBase::Free(what); }
+};
+
 /****************************************************************************/
 /***                                                                      ***/
 /***   StringPool of PoolStrings                                          ***/
@@ -623,6 +956,13 @@ public:
 /***   the stringpool itself is a global variable. it makes little        ***/
 /***   sense to have multiple stringpools.                                ***/
 /***                                                                      ***/
+/***   strings can be added from multiple threads. the pool is split in   ***/
+/***   shards with a lock each, and every thread remembers the strings it ***/
+/***   added last, so repeated strings are found without locking.         ***/
+/***                                                                      ***/
+/***   the hash and length of every string are stored in front of it,     ***/
+/***   sPoolString::GetHash() and Count() do not touch the characters.    ***/
+/***                                                                      ***/
 /****************************************************************************/
 
 const sChar *sAddToStringPool(const sChar *s,int len, sBool *isnew=0);
@@ -630,6 +970,28 @@ const sChar *sAddToStringPool2(const sChar *a,int al,const sChar *b,int bl);
 void sClearStringPool();       
 extern const sChar *sPoolStringEmpty;
 
+struct sPoolStringHeader          // in front of the characters of every pooled string
+{
+  uint32_t Hash;                  // sHashString()
+  int Len;
+};
+
+inline const sPoolStringHeader *sGetPoolStringHeader(const sChar *s) { return ((const sPoolStringHeader *)s)-1; }
+
+struct sStringPoolStats
+{
+  int Strings;                    // different strings in the pool
+  sPtr Bytes;                     // memory used by the pool
+  uint64_t Lookups;               // calls to sAddToStringPool
+  uint64_t CacheHits;             // found in the cache of the thread, lags behind a bit
+  uint64_t PoolHits;              // found in the pool
+  int Shards;
+  int MaxShardStrings;            // strings in the fullest shard
+};
+
+void sGetStringPoolStats(sStringPoolStats &stats);
+void sLogStringPoolStats();
+
 struct sPoolString              // a string from the pool
 {
 private:
@@ -655,9 +1017,9 @@ public:
   bool operator<=(const sPoolString &s) const { return sCmpString(Buffer,s.Buffer)<=0; }
   bool operator>=(const sPoolString &s) const { return sCmpString(Buffer,s.Buffer)>=0; }
   sChar operator[](int i) const              { return Buffer[i]; }
-  int Count() const                          { return sGetStringLen(Buffer); }
+  int Count() const                          { return sGetPoolStringHeader(Buffer)->Len; }
   sBool IsEmpty() const                       { return Buffer[0]==0; }
-  uint32_t GetHash() const                        { return sHashString(Buffer); }
+  uint32_t GetHash() const                        { return sGetPoolStringHeader(Buffer)->Hash; }
 
   void Add(const sChar *a,const sChar *b)     { Buffer = sAddToStringPool2(a,sGetStringLen(a),b,sGetStringLen(b)); }
 };
@@ -765,6 +1127,234 @@ public:
   void GetAll(sArray<ValueType *> *a)                 { sHashTableBase::GetAll((sArray<void *> *)a); }
 };
 
+/****************************************************************************/
+/***                                                                      ***/
+/***   Hash Map                                                           ***/
+/***                                                                      ***/
+/****************************************************************************/
+/***                                                                      ***/
+/***   Open addressing with robin hood probing. Keys and values are       ***/
+/***   stored inline, the map grows when it gets 7/8 full.                ***/
+/***                                                                      ***/
+/***   - keys are hashed with sHashKey() and compared with                ***/
+/***     sHashKeyEqual(). there are overloads for integers, pointers,     ***/
+/***     strings and sPoolString, other keys need a Hash() member and     ***/
+/***     an operator== like for sHashTable.                               ***/
+/***   - Find() and Rem() accept any key that hashes and compares like    ***/
+/***     the stored key type. a map of sPoolString can be searched with   ***/
+/***     a const sChar * and the other way round.                         ***/
+/***   - const sChar * keys are not copied, use sPoolString for that.     ***/
+/***   - keys and values must have a default constructor and operator=,  ***/
+/***     like the elements of sStaticArray.                               ***/
+/***   - adding and removing moves the entries around, pointers to        ***/
+/***     values are only valid until the next change.                     ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+inline uint32_t sHashKey(uint32_t key)                  { key ^= key>>16; key *= 0x85ebca6bU; key ^= key>>13; key *= 0xc2b2ae35U; key ^= key>>16; return key; }
+inline uint32_t sHashKey(int key)                       { return sHashKey(uint32_t(key)); }
+inline uint32_t sHashKey(uint64_t key)                  { return sHashKey(uint32_t(key)^(uint32_t(key>>32)*0x9e3779b1U)); }
+inline uint32_t sHashKey(int64_t key)                   { return sHashKey(uint64_t(key)); }
+inline uint32_t sHashKey(const sChar *key)              { return sHashString(key); }
+inline uint32_t sHashKey(sChar *key)                    { return sHashString(key); }
+inline uint32_t sHashKey(const sPoolString &key)        { return key.GetHash(); }
+template <class Type> inline uint32_t sHashKey(Type *key)       { return sHashKey(uint64_t(sPtr(key))); }
+template <class Type> inline uint32_t sHashKey(const Type &key) { return key.Hash(); }
+
+template <class A,class B> inline sBool sHashKeyEqual(const A &a,const B &b) { return a==b; }
+inline sBool sHashKeyEqual(const sChar *a,const sChar *b)         { return sCmpString(a,b)==0; }
+inline sBool sHashKeyEqual(sChar *a,sChar *b)                     { return sCmpString(a,b)==0; }   // the template would win these
+inline sBool sHashKeyEqual(sChar *a,const sChar *b)               { return sCmpString(a,b)==0; }
+inline sBool sHashKeyEqual(const sChar *a,sChar *b)               { return sCmpString(a,b)==0; }
+inline sBool sHashKeyEqual(const sChar *a,const sPoolString &b)   { return b==a; }
+inline sBool sHashKeyEqual(sChar *a,const sPoolString &b)         { return b==a; }
+
+/****************************************************************************/
+
+template <class KeyType,class ValueType>
+class sHashMap
+{
+  struct Slot
+  {
+    KeyType Key;
+    ValueType Value;
+  };
+
+  uint32_t *Hashes;               // 0 for empty slots
+  Slot *Slots;                    // all slots are constructed
+  int Shift;                      // 32-log2(size)
+  int Mask;                       // size-1, or -1 before the first add
+  int Used;
+
+  sHashMap(const sHashMap &);
+  sHashMap &operator=(const sHashMap &);
+
+  template <class K> static uint32_t HashOf(const K &key)
+  { uint32_t h = sHashKey(key); return h ? h : 1; }
+  int Home(uint32_t h) const      { return int((h*0x9e3779b1U)>>Shift); }
+  int Dist(int i) const           { return (i-Home(Hashes[i]))&Mask; }
+
+  void Alloc(int size)
+  {
+    Hashes = new uint32_t[size];
+    Slots = new Slot[size];
+    sSetMem(Hashes,0,size*sizeof(uint32_t));
+    Mask = size-1;
+    Shift = 32;
+    while(size>1) { size>>=1; Shift--; }
+  }
+
+  void Resize(int size)
+  {
+    uint32_t *oh = Hashes;
+    Slot *os = Slots;
+    int on = Mask+1;
+    Alloc(size);
+    Used = 0;
+    for(int i=0;i<on;i++)
+      if(oh[i])
+        Slots[Place(oh[i])] = os[i];
+    delete[] oh;
+    delete[] os;
+  }
+
+  // find the slot for a new entry and shift the entries after it
+
+  int Place(uint32_t h)
+  {
+    int i = Home(h);
+    int d = 0;
+    while(Hashes[i] && Dist(i)>=d)
+    {
+      i = (i+1)&Mask;
+      d++;
+    }
+    if(Hashes[i])
+    {
+      int e = i;
+      while(Hashes[e])
+        e = (e+1)&Mask;
+      while(e!=i)
+      {
+        int p = (e-1)&Mask;
+        Hashes[e] = Hashes[p];
+        Slots[e] = Slots[p];
+        e = p;
+      }
+    }
+    Hashes[i] = h;
+    Used++;
+    return i;
+  }
+
+  template <class K> int Search(const K &key,uint32_t h) const
+  {
+    if(Used==0) return -1;
+    int i = Home(h);
+    for(int d=0;Hashes[i];d++)
+    {
+      if(Hashes[i]==h && sHashKeyEqual(Slots[i].Key,key))
+        return i;
+      if(Dist(i)<d)
+        break;
+      i = (i+1)&Mask;
+    }
+    return -1;
+  }
+
+  void RemSlot(int i)
+  {
+    int j = (i+1)&Mask;
+    while(Hashes[j] && Dist(j)>0)
+    {
+      Hashes[i] = Hashes[j];
+      Slots[i] = Slots[j];
+      i = j;
+      j = (j+1)&Mask;
+    }
+    Hashes[i] = 0;
+    Slots[i].Key = KeyType();
+    Slots[i].Value = ValueType();
+    Used--;
+  }
+
+public:
+  sHashMap(int count=0)           { Hashes = 0; Slots = 0; Mask = -1; Shift = 32; Used = 0; HintSize(count); }
+  ~sHashMap()                     { delete[] Hashes; delete[] Slots; }
+
+  // reserve memory for count entries
+  void HintSize(int count)
+  {
+    int size = 8;
+    while(size-size/8<count)
+      size *= 2;
+    if(size>Mask+1)
+    {
+      if(Hashes) Resize(size); else Alloc(size);
+    }
+  }
+  // remove all entries, keep the memory
+  void Clear()
+  {
+    for(int i=0;i<=Mask;i++)
+    {
+      if(Hashes[i])
+      {
+        Hashes[i] = 0;
+        Slots[i].Key = KeyType();
+        Slots[i].Value = ValueType();
+      }
+    }
+    Used = 0;
+  }
+  // remove all entries and free the memory
+  void Reset()                    { delete[] Hashes; delete[] Slots; Hashes = 0; Slots = 0; Mask = -1; Shift = 32; Used = 0; }
+
+  int GetCount() const            { return Used; }
+  sBool IsEmpty() const           { return Used==0; }
+
+  // returns 0 if the key is not in the map
+  template <class K> ValueType *Find(const K &key)             { int i = Search(key,HashOf(key)); return i>=0 ? &Slots[i].Value : 0; }
+  template <class K> const ValueType *Find(const K &key) const { int i = Search(key,HashOf(key)); return i>=0 ? &Slots[i].Value : 0; }
+  ValueType *Find(const sChar *key)                             { return Find<const sChar *>(key); }
+  const ValueType *Find(const sChar *key) const                 { return Find<const sChar *>(key); }
+
+  // returns the value for the key, inserting a default value if it was not found
+  ValueType *Add(const KeyType &key)
+  {
+    uint32_t h = HashOf(key);
+    int i = Search(key,h);
+    if(i<0)
+    {
+      if((Used+1)*8>(Mask+1)*7)
+        HintSize(Used+1);
+      i = Place(h);
+      Slots[i].Key = key;
+      Slots[i].Value = ValueType();
+    }
+    return &Slots[i].Value;
+  }
+  void Set(const KeyType &key,const ValueType &value)           { *Add(key) = value; }
+
+  // returns sFALSE if the key was not in the map
+  template <class K> sBool Rem(const K &key)                    { int i = Search(key,HashOf(key)); if(i<0) return 0; RemSlot(i); return 1; }
+  sBool Rem(const sChar *key)                                   { return Rem<const sChar *>(key); }
+
+  // iterate over all slots, skipping the unused ones
+  int GetSlots() const                                          { return Mask+1; }
+  sBool IsUsed(int i) const                                     { return Hashes[i]!=0; }
+  const KeyType &GetKey(int i) const                            { return Slots[i].Key; }
+  ValueType &GetValue(int i)                                    { return Slots[i].Value; }
+  const ValueType &GetValue(int i) const                        { return Slots[i].Value; }
+
+  void GetAll(sArray<ValueType> *a) const
+  {
+    for(int i=0;i<=Mask;i++)
+      if(Hashes[i])
+        a->AddTail(Slots[i].Value);
+  }
+};
+
 /****************************************************************************/
 /***                                                                      ***/
 /***   Rectangular Regions                                                ***/
@@ -793,13 +1383,15 @@ public:
 /***   sStringMap_ maps to untyped pointers (void*), while the            ***/
 /***   sStringMap  template allows storing of typed pointers              ***/
 /***                                                                      ***/
-/***   The number of buckets is fixed on intialization and                ***/
-/***   should approximately equal the number of expected items.           ***/
-/***   Initial memory consumption: numSlots * sizeof(void*)               ***/
-/***   Speed and memory efficiency degrades gracefully (linear) with the  ***/
-/***   number of inserted values.                                         ***/
+/***   The number of slots given on initialization is only a hint, the    ***/
+/***   map grows when it gets 7/8 full. Open addressing with robin hood   ***/
+/***   probing, every slot caches the hash of its key so most mismatches  ***/
+/***   are found without comparing strings.                               ***/
 /***                                                                      ***/
-/***   Key strings will be copied on insertion (Set).                     ***/
+/***   Key strings will be copied on insertion (Set) into one memory      ***/
+/***   pool. Removed keys are reclaimed when the map grows or is cleared, ***/
+/***   so key pointers from GetKeys() are only valid until the next Set   ***/
+/***   or Del.                                                            ***/
 /***   Setting a value for an already inserted key will overwrite the     ***/
 /***   old value.                                                         ***/
 /***                                                                      ***/
@@ -809,15 +1401,29 @@ class sStringMap_
 {
 protected:
 
-  int Size;
-  typedef struct Slot_ {Slot_ * next; sChar * key; void * value;} Slot;
-  Slot ** Slots;
+  struct Slot
+  {
+    uint32_t Hash;                // 0 for empty slots
+    int Len;                      // key length without the terminating zero
+    sChar *Key;
+    void *Value;
+  };
+
+  int Size;                       // number of slots, power of two
+  int Used;
+  int LiveChars;                  // chars of the keys in the map
+  int DeadChars;                  // chars of removed keys still in the pool
+  Slot *Slots;
+  sMemoryPool *Keys;
 
-  uint32_t Hash (const sChar * key) const;
+  uint32_t Hash (const sChar * key,int &len) const;
+  int Find (const sChar * key,uint32_t &hash,int &len) const;
+  void Resize (int size);
+  void Place (const Slot &slot);
 
 public: 
 
-  sStringMap_ (int numSlots);    // creates a map with numSlots buckets
+  sStringMap_ (int numSlots);    // creates a map for about numSlots keys
   virtual ~sStringMap_ ();
   void Clear ();                  // deletes all key value pairs
 
@@ -853,17 +1459,36 @@ public:
 /***   Set and clear bits, automatically growing.                         ***/
 /***                                                                      ***/
 /***   * defaults to clear                                                ***/
-/***   * Will automatically grow in chunks of 128 bits (16 bytes)         ***/
+/***   * Will automatically grow in chunks of 128 bits (16 bytes), or     ***/
+/***     by doubling when bits are set one by one                         ***/
 /***   * Newly grown bits will be set to one if SetAll() was called       ***/
-/***   * word referes to uint32_t unit                                        ***/
+/***   * word referes to uint64_t unit                                    ***/
+/***   * a summary keeps one bit per word that is not zero. NextBit()     ***/
+/***     skips empty regions 4096 bits at a time                          ***/
+/***   * Rank() and Select() use a table of counts per 512 bits, which is ***/
+/***     rebuilt on first use after a change                              ***/
+/***   * And(), Or(), AndNot() and Xor() work on whole vectors, with      ***/
+/***     SSE2 or AVX2 where available. bits beyond the end of the other   ***/
+/***     vector are taken as its grow value                               ***/
 /***                                                                      ***/
 /****************************************************************************/
 
 class sBitVector
 {
-  uint32_t *Data;                     // the data
-  uint32_t NewVal;                    // value for new bits (0 or ~0)
-  sPtr Words;                     // number of words allocated. grows in chunks of 16.
+  uint64_t *Data;                 // the data
+  uint64_t *Summary;              // bit n is set if Data[n]!=0
+  uint32_t *Ranks;                // set bits before every block of 8 words, and the total
+  uint64_t NewVal;                // value for new bits (0 or ~0)
+  sPtr Words;                     // number of words allocated. grows in chunks of 2.
+  sBool RanksValid;
+
+  void Grow(int bit);
+  void UpdateSummary(sPtr word)   { if(Data[word]) Summary[word>>6] |= 1ULL<<(word&63); else Summary[word>>6] &= ~(1ULL<<(word&63)); }
+  void BuildSummary();
+  void BuildRanks();
+  void Combine(const sBitVector &b,int op);
+  sBitVector(const sBitVector &);
+  sBitVector &operator=(const sBitVector &);
 public:
   sBitVector();
   ~sBitVector();
@@ -872,16 +1497,29 @@ public:
   void Set(int n);               // set to 1. with autogrow.
   void Clear(int n);             // set to 0. with autogrow.
   void Assign(int n,int v);     // set to (v&1). with autogrow.
-  sBool Get(int n);              // get bit. may read beyond end of data, but will not grow data.
+  sBool Get(int n) const;        // get bit. may read beyond end of data, but will not grow data.
   void ClearAll();                // clear all. bits grown after this are cleared too.
   void SetAll();                  // set all. bits grown after this are set too.
+  int GetSize() const            { return int(Words*64); }  // bits allocated
 
-  sBool NextBit(int &n);         // iterate. return false if last bit. start with n==-1.
+  sBool NextBit(int &n) const;   // iterate. return false if last bit. start with n==-1.
 
-  // it would not hurt to add serialization
+  int Count();                    // set bits in the allocated range
+  int Rank(int n);               // set bits before bit n
+  int Select(int k);             // index of the k-th set bit (from 0), or -1
+
+  void Copy(const sBitVector &b);
+  void And(const sBitVector &b);
+  void Or(const sBitVector &b);
+  void AndNot(const sBitVector &b);  // clear all bits that are set in b
+  void Xor(const sBitVector &b);
+
+  template <class streamer> void Serialize_(streamer &);
+  void Serialize(sReader &stream);
+  void Serialize(sWriter &stream);
 };
 
-#define sFORALL_BITVECTOR(bv,n) for((n)=-1;NextBit(n);)
+#define sFORALL_BITVECTOR(bv,n) for((n)=-1;(bv).NextBit(n);)
 
 /****************************************************************************/
 /***                                                                      ***/
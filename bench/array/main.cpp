@@ -0,0 +1,102 @@
+/*+**************************************************************************/
+/***                                                                      ***/
+/***   This file is distributed under a BSD license.                      ***/
+/***   See LICENSE.txt for details.                                       ***/
+/***                                                                      ***/
+/**************************************************************************+*/
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Array growth.                                                      ***/
+/***                                                                      ***/
+/***   "small":  building a 6 element array many times, ms in total.      ***/
+/***   "nested": growing an array of arrays without HintSize(), ms in     ***/
+/***             total. the inner arrays are moved, not copied, this      ***/
+/***             aborts if their storage changes.                         ***/
+/***   "swap":   sSmallArray::Swap() between inline and heap arrays,      ***/
+/***             aborts on a wrong element.                               ***/
+/***                                                                      ***/
+/***   usage: altona_array_bench [-n count]                               ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+#include "base/system.hpp"
+#include "base/types2.hpp"
+
+sISGUI(sFALSE)
+
+/****************************************************************************/
+
+static uint32_t Sink;
+
+template <class ArrayType> static void RunSmall(const sChar *name,int count)
+{
+  uint64_t t0 = sGetTimeUS();
+  for(int i=0;i<count;i++)
+  {
+    ArrayType a;
+    for(int j=0;j<6;j++)
+      a.AddTail(i+j);
+    Sink += a[5];
+  }
+  uint64_t t1 = sGetTimeUS();
+  sPrintF(L"%-8s %-22s %8d ms\n",L"small",name,int((t1-t0)/1000));
+}
+
+static void RunNested(int count)
+{
+  sArray<sArray<int> > outer;
+  const int **data = new const int *[count];
+
+  uint64_t t0 = sGetTimeUS();
+  for(int i=0;i<count;i++)
+  {
+    sArray<int> *inner = outer.AddMany(1);
+    for(int j=0;j<16;j++)
+      inner->AddTail(i+j);
+    data[i] = &(*inner)[0];
+  }
+  uint64_t t1 = sGetTimeUS();
+
+  for(int i=0;i<count;i++)
+    if(&outer[i][0]!=data[i] || outer[i][15]!=i+15)
+      sFatal(L"nested array %d was copied",i);
+  delete[] data;
+  sPrintF(L"%-8s %-22s %8d ms\n",L"nested",L"sArray<sArray<int>>",int((t1-t0)/1000));
+}
+
+static void CheckSwap(int na,int nb)
+{
+  sSmallArray<int,4> a,b;
+  for(int i=0;i<na;i++) a.AddTail(i);
+  for(int i=0;i<nb;i++) b.AddTail(100+i);
+  a.Swap(b);
+  if(a.GetCount()!=nb || b.GetCount()!=na)
+    sFatal(L"swap %d,%d: counts",na,nb);
+  for(int i=0;i<nb;i++) if(a[i]!=100+i) sFatal(L"swap %d,%d: a[%d]",na,nb,i);
+  for(int i=0;i<na;i++) if(b[i]!=i) sFatal(L"swap %d,%d: b[%d]",na,nb,i);
+  a.AddTail(1);                   // both must still own what they point to
+  b.AddTail(1);
+}
+
+/****************************************************************************/
+
+void sMain()
+{
+  int count = sGetShellInt(L"n",L"-count",1000000);
+
+  RunSmall<sArray<int> >(L"sArray<int>",count);
+  RunSmall<sSmallArray<int,8> >(L"sSmallArray<int,8>",count);
+  RunNested(count/4);
+
+  static const int sizes[] = { 0,3,4,9 };   // inline, full, heap
+  for(int i=0;i<sCOUNTOF(sizes);i++)
+    for(int j=0;j<sCOUNTOF(sizes);j++)
+      CheckSwap(sizes[i],sizes[j]);
+  sPrintF(L"%-8s %-22s %8d ok\n",L"swap",L"sSmallArray<int,4>",sCOUNTOF(sizes)*sCOUNTOF(sizes));
+
+  if(Sink==0x12345678)
+    sPrintF(L"\n");
+}
+
+/****************************************************************************/
@@ -0,0 +1,221 @@
+/*+**************************************************************************/
+/***                                                                      ***/
+/***   This file is distributed under a BSD license.                      ***/
+/***   See LICENSE.txt for details.                                       ***/
+/***                                                                      ***/
+/**************************************************************************+*/
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   sSPrintF throughput and float conversion.                          ***/
+/***                                                                      ***/
+/***   "format":  typical sSPrintF calls, ns per call. every number is    ***/
+/***              the best of a few runs, this is noisy otherwise.        ***/
+/***   "convert": sFloatInfo::DoubleToShortest against the old            ***/
+/***              sFloatInfo::DoubleToAscii, per magnitude.               ***/
+/***   "output":  how many %f outputs differ from the C library, for      ***/
+/***              random doubles. this should be none. beyond 17 digits   ***/
+/***              the C library prints the exact binary value, and        ***/
+/***              sSPrintF zeros after the shortest digits, so larger     ***/
+/***              values are not compared.                                ***/
+/***   "round":   half-way cases like 1.005 and 0.125 with %1.2f, checked ***/
+/***              against fixed results. aborts on a mismatch.            ***/
+/***                                                                      ***/
+/***   usage: altona_format_bench [-n calls]                              ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+#include "base/system.hpp"
+#include "base/types.hpp"
+#include <stdio.h>
+
+sISGUI(sFALSE)
+
+/****************************************************************************/
+
+static uint32_t Sink;
+static const int Runs = 8;
+
+static uint64_t Random(uint64_t &x)
+{
+  x ^= x<<13;
+  x ^= x>>7;
+  x ^= x<<17;
+  return x;
+}
+
+static void Print(const sChar *bench,const sChar *what,uint64_t us,int count)
+{
+  sPrintF(L"%-8s %-28s %10.1f\n",bench,what,us*1000.0/count);
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   sSPrintF                                                           ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+#define FORMAT(what,call)                                     \
+  {                                                           \
+    uint64_t best = ~0ULL;                                    \
+    for(int r=0;r<Runs;r++)                                   \
+    {                                                         \
+      uint64_t t0 = sGetTimeUS();                             \
+      for(int i=0;i<calls;i++)                                \
+      {                                                       \
+        call;                                                 \
+        Sink += buf[0];                                       \
+      }                                                       \
+      best = sMin(best,sGetTimeUS()-t0);                      \
+    }                                                         \
+    Print(L"format",what,best,calls);                         \
+  }
+
+static void RunFormat(int calls)
+{
+  sString<256> buf;
+
+  FORMAT(L"literal",sSPrintF(buf,L"a plain line of text\n"));
+  FORMAT(L"%d",sSPrintF(buf,L"%d",i));
+  FORMAT(L"x=%d y=%d z=%d",sSPrintF(buf,L"x=%d y=%d z=%d",i,i*7,-i));
+  FORMAT(L"%08x",sSPrintF(buf,L"%08x",i*2654435761U));
+  FORMAT(L"%s: %d items",sSPrintF(buf,L"%s: %d items",L"inventory",i));
+  FORMAT(L"%f",sSPrintF(buf,L"%f",i*0.001f));
+  FORMAT(L"%.3f %.3f %.3f",sSPrintF(buf,L"%.3f %.3f %.3f",i*0.25,i*-0.5,1.0/(i+1)));
+  FORMAT(L"%12.6f",sSPrintF(buf,L"%12.6f",i*1234.5678));
+  FORMAT(L"%f of 1e200",sSPrintF(buf,L"%f",1e200*(i+1)));
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   sFloatInfo                                                         ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+static void RunConvert(int calls)
+{
+  static const double scales[] = { 1e-300,1e-20,0.001,1.0,1234.5678,1e20,1e300 };
+  static const sChar *names[] = { L"1e-300",L"1e-20",L"0.001",L"1",L"1234.5678",L"1e20",L"1e300" };
+  sFloatInfo fi;
+
+  for(int s=0;s<sCOUNTOF(scales);s++)
+  {
+    uint64_t bestnew = ~0ULL;
+    uint64_t bestold = ~0ULL;
+    for(int r=0;r<Runs;r++)
+    {
+      uint64_t t0 = sGetTimeUS();
+      for(int i=0;i<calls;i++)
+      {
+        fi.DoubleToShortest(sRawCast<uint64_t,double>(scales[s]*(i+1)));
+        Sink += fi.Digits[1];
+      }
+      uint64_t t1 = sGetTimeUS();
+      for(int i=0;i<calls;i++)
+      {
+        fi.DoubleToAscii(sRawCast<uint64_t,double>(scales[s]*(i+1)));
+        Sink += fi.Digits[1];
+      }
+      uint64_t t2 = sGetTimeUS();
+      bestnew = sMin(bestnew,t1-t0);
+      bestold = sMin(bestold,t2-t1);
+    }
+    sString<64> what;
+    sSPrintF(what,L"%s shortest",names[s]);
+    Print(L"convert",what,bestnew,calls);
+    sSPrintF(what,L"%s old",names[s]);
+    Print(L"convert",what,bestold,calls);
+  }
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Output against the C library                                       ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+static void CPrintF(const sStringDesc &desc,const char *format,double v)
+{
+  char buf[256];
+  snprintf(buf,sizeof(buf),format,v);
+  int i;
+  for(i=0;buf[i] && i<desc.Size-1;i++)
+    desc.Buffer[i] = buf[i];
+  desc.Buffer[i] = 0;
+}
+
+static void RunOutput(int count)
+{
+  static const sChar *formats[] = { L"%1.0f",L"%1.3f",L"%1.6f",L"%1.9f" };   // doubles need a field for the precision
+  static const char *cformats[] = { "%1.0f","%1.3f","%1.6f","%1.9f" };
+  sString<256> a,b;
+  uint64_t x = 88172645463325252ULL;
+
+  for(int f=0;f<sCOUNTOF(formats);f++)
+  {
+    int diffsmall = 0;
+    int diffwide = 0;
+    for(int i=0;i<count;i++)
+    {
+      double small = double(int(Random(x)%2000000)-1000000)/1024.0 + double(Random(x)%1000)*1e-7;
+      uint64_t bits = Random(x);                        // any mantissa, 1e-12 .. 1e6
+      double wide = sRawCast<double,uint64_t>((bits&0x800fffffffffffffULL)|(uint64_t(1023-40+int((bits>>52)%60))<<52));
+
+      sSPrintF(a,formats[f],small);
+      CPrintF(b,cformats[f],small);
+      diffsmall += sCmpString(a,b)!=0;
+
+      sSPrintF(a,formats[f],wide);
+      CPrintF(b,cformats[f],wide);
+      diffwide += sCmpString(a,b)!=0;
+    }
+    sString<64> what;
+    sSPrintF(what,L"%s within 1e6",formats[f]);
+    sPrintF(L"%-8s %-28s %10d of %d\n",L"output",what,diffsmall,count);
+    sSPrintF(what,L"%s 1e-12 .. 1e6",formats[f]);
+    sPrintF(L"%-8s %-28s %10d of %d\n",L"output",what,diffwide,count);
+  }
+}
+
+static void RunRound()
+{
+  static const struct { const sChar *Format; double Value; const sChar *Result; } cases[] =
+  {
+    { L"%1.2f",1.005,L"1.00" },       // 1.00499999999999989...
+    { L"%1.2f",0.125,L"0.12" },       // exact, ties to even
+    { L"%1.2f",0.375,L"0.38" },
+    { L"%1.2f",-0.125,L"-0.12" },
+    { L"%1.0f",2.5,L"2" },
+    { L"%1.0f",3.5,L"4" },
+    { L"%1.3f",1.0005,L"1.000" },     // 1.00049999999999994...
+    { L"%f",1.0005,L"1.000" },
+    { L"%1.3f",9.9996,L"10.000" },
+    { L"%1.1f",0.05,L"0.1" },         // 0.05000000000000000277...
+  };
+  sString<64> buf;
+
+  for(int i=0;i<sCOUNTOF(cases);i++)
+  {
+    sSPrintF(buf,cases[i].Format,cases[i].Value);
+    if(sCmpString(buf,cases[i].Result)!=0)
+      sFatal(L"round case %d: %s gives %s, should be %s",i,cases[i].Format,buf,cases[i].Result);
+  }
+  sPrintF(L"%-8s %-28s %10d ok\n",L"round",L"half-way cases",sCOUNTOF(cases));
+}
+
+/****************************************************************************/
+
+void sMain()
+{
+  int calls = sGetShellInt(L"n",L"-calls",200000);
+
+  sPrintF(L"bench    case                                 ns\n");
+  RunFormat(calls);
+  RunConvert(calls);
+  RunOutput(calls);
+  RunRound();
+  if(Sink==0x12345678)
+    sPrintF(L"\n");
+}
+
+/****************************************************************************/
@@ -0,0 +1,267 @@
+/*+**************************************************************************/
+/***                                                                      ***/
+/***   This file is distributed under a BSD license.                      ***/
+/***   See LICENSE.txt for details.                                       ***/
+/***                                                                      ***/
+/**************************************************************************+*/
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Lookup heavy workloads for sHashMap, sHashTable and sStringMap.    ***/
+/***                                                                      ***/
+/***   "int":    integer keys, every key is looked up many times, half    ***/
+/***             of the lookups miss.                                     ***/
+/***   "string": string keys, looked up with a const sChar * that is not  ***/
+/***             pooled, so every lookup has to hash the string.          ***/
+/***   "pool":   sPoolString keys looked up with sPoolStrings. sHashMap   ***/
+/***             compares pooled strings by pointer.                      ***/
+/***   "check":  string keys are found by an equal string at another      ***/
+/***             address, sChar * and const sChar * mixed. aborts if not. ***/
+/***                                                                      ***/
+/***   sHashTable gets the default bucket count it is usually             ***/
+/***   constructed with, the number of keys is varied to show what        ***/
+/***   happens when a table outgrows it. sStringMap starts with the same  ***/
+/***   size but grows.                                                    ***/
+/***                                                                      ***/
+/***   usage: altona_hashmap_bench [-n lookups]                           ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+#include "base/system.hpp"
+#include "base/types2.hpp"
+
+sISGUI(sFALSE)
+
+/****************************************************************************/
+
+static uint32_t Sink;
+
+struct IntKey                     // sHashTable wants keys by pointer
+{
+  int Value;
+  uint32_t Hash() const           { return sHashKey(Value); }
+  sBool operator==(const IntKey &k) const { return Value==k.Value; }
+};
+
+static int KeyOf(int i)           // keys are spread out, odd numbers miss
+{
+  return int(uint32_t(i)*2654435761U)|1;
+}
+
+static int MissOf(int i)
+{
+  return int(uint32_t(i)*2654435761U)&~1;
+}
+
+static void Print(const sChar *bench,const sChar *impl,int keys,int lookups,uint64_t insert,uint64_t find)
+{
+  sPrintF(L"%-8s %-14s %8d %12.1f %12.1f\n",bench,impl,keys,
+    insert*1000.0/keys,find*1000.0/lookups);
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Integer keys                                                       ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+static void RunInt(int keys,int lookups)
+{
+  uint64_t t0,t1,t2;
+
+  // sHashTable
+
+  {
+    IntKey *k = new IntKey[keys];
+    int *v = new int[keys];
+    IntKey miss;
+    sHashTable<IntKey,int> table;
+
+    t0 = sGetTimeUS();
+    for(int i=0;i<keys;i++)
+    {
+      k[i].Value = KeyOf(i);
+      v[i] = i;
+      table.Add(&k[i],&v[i]);
+    }
+    t1 = sGetTimeUS();
+    for(int i=0;i<lookups;i++)
+    {
+      int n = i%keys;
+      if(i&1)
+      {
+        miss.Value = MissOf(n);
+        Sink += table.Find(&miss)!=0;
+      }
+      else
+      {
+        Sink += *table.Find(&k[n]);
+      }
+    }
+    t2 = sGetTimeUS();
+    Print(L"int",L"sHashTable",keys,lookups,t1-t0,t2-t1);
+    delete[] k;
+    delete[] v;
+  }
+
+  // sHashMap
+
+  {
+    sHashMap<int,int> map;
+
+    t0 = sGetTimeUS();
+    for(int i=0;i<keys;i++)
+      map.Set(KeyOf(i),i);
+    t1 = sGetTimeUS();
+    for(int i=0;i<lookups;i++)
+    {
+      int n = i%keys;
+      if(i&1)
+        Sink += map.Find(MissOf(n))!=0;
+      else
+        Sink += *map.Find(KeyOf(n));
+    }
+    t2 = sGetTimeUS();
+    Print(L"int",L"sHashMap",keys,lookups,t1-t0,t2-t1);
+  }
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   String keys                                                        ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+static sChar *MakeNames(int keys,const sChar *prefix)
+{
+  sChar *names = new sChar[keys*32];
+  for(int i=0;i<keys;i++)
+    sSPrintF(sStringDesc(names+i*32,32),L"%s_%08x",prefix,KeyOf(i));
+  return names;
+}
+
+static void RunString(int keys,int lookups)
+{
+  uint64_t t0,t1,t2;
+  sChar *names = MakeNames(keys,L"symbol");
+  sChar *misses = MakeNames(keys,L"missing");
+
+  // sStringMap
+
+  {
+    sStringMap<sChar *,0x4000> map;
+
+    t0 = sGetTimeUS();
+    for(int i=0;i<keys;i++)
+      map.Set(names+i*32,names+i*32);  // any non-zero pointer
+    t1 = sGetTimeUS();
+    for(int i=0;i<lookups;i++)
+    {
+      int n = i%keys;
+      Sink += map.Get(((i&1) ? misses : names)+n*32)!=0;
+    }
+    t2 = sGetTimeUS();
+    Print(L"string",L"sStringMap",keys,lookups,t1-t0,t2-t1);
+  }
+
+  // sHashMap with unmanaged string keys
+
+  {
+    sHashMap<const sChar *,int> map;
+
+    t0 = sGetTimeUS();
+    for(int i=0;i<keys;i++)
+      map.Set(names+i*32,i);
+    t1 = sGetTimeUS();
+    for(int i=0;i<lookups;i++)
+    {
+      int n = i%keys;
+      Sink += map.Find(((i&1) ? misses : names)+n*32)!=0;
+    }
+    t2 = sGetTimeUS();
+    Print(L"string",L"sHashMap",keys,lookups,t1-t0,t2-t1);
+  }
+
+  // sHashMap with pooled keys, looked up by const sChar *
+
+  {
+    sHashMap<sPoolString,int> map;
+
+    t0 = sGetTimeUS();
+    for(int i=0;i<keys;i++)
+      map.Set(sPoolString(names+i*32),i);
+    t1 = sGetTimeUS();
+    for(int i=0;i<lookups;i++)
+    {
+      int n = i%keys;
+      Sink += map.Find(((i&1) ? misses : names)+n*32)!=0;
+    }
+    t2 = sGetTimeUS();
+    Print(L"string",L"sHashMap/pool",keys,lookups,t1-t0,t2-t1);
+
+    // the same map looked up by sPoolString, only hits
+
+    sPoolString *pool = new sPoolString[keys];
+    for(int i=0;i<keys;i++)
+      pool[i] = names+i*32;
+    t1 = sGetTimeUS();
+    for(int i=0;i<lookups;i++)
+      Sink += *map.Find(pool[i%keys]);
+    t2 = sGetTimeUS();
+    Print(L"pool",L"sHashMap",keys,lookups,0,t2-t1);
+    delete[] pool;
+  }
+
+  delete[] names;
+  delete[] misses;
+}
+
+static void RunCheck()
+{
+  sChar stored[] = L"some_key";
+  sChar other[] = L"some_key";    // equal, but at another address
+  const sChar *cother = other;
+  int checks = 0;
+
+  {
+    sHashMap<sChar *,int> map;
+    map.Set(stored,1);
+    if(!map.Find(other) || !map.Find(cother))
+      sFatal(L"sHashMap<sChar *> compares keys by pointer");
+    checks += 2;
+  }
+  {
+    sHashMap<const sChar *,int> map;
+    map.Set(stored,1);
+    if(!map.Find(other) || !map.Find(cother))
+      sFatal(L"sHashMap<const sChar *> compares keys by pointer");
+    checks += 2;
+  }
+  {
+    sHashMap<sPoolString,int> map;
+    map.Set(sPoolString(stored),1);
+    if(!map.Find(other) || !map.Find(cother))
+      sFatal(L"sHashMap<sPoolString> misses a plain string");
+    checks += 2;
+  }
+  sPrintF(L"%-8s %-14s %10d ok\n",L"check",L"equal keys",checks);
+}
+
+/****************************************************************************/
+
+void sMain()
+{
+  int lookups = sGetShellInt(L"n",L"-lookups",4000000);
+
+  sPrintF(L"bench    impl               keys    insert ns    lookup ns\n");
+  for(int keys=1024;keys<=1024*1024;keys*=8)
+  {
+    RunInt(keys,lookups);
+    RunString(keys,lookups);
+  }
+  RunCheck();
+  if(Sink==0x12345678)
+    sPrintF(L"\n");
+}
+
+/****************************************************************************/
@@ -0,0 +1,259 @@
+/*+**************************************************************************/
+/***                                                                      ***/
+/***   This file is distributed under a BSD license.                      ***/
+/***   See LICENSE.txt for details.                                       ***/
+/***                                                                      ***/
+/**************************************************************************+*/
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Synthetic workloads for the task scheduler.                        ***/
+/***                                                                      ***/
+/***   "fine":       one task with many tiny subtasks                     ***/
+/***   "coarse":     a few tasks per thread with a lot of work each       ***/
+/***   "nested":     every task spawns two more until a depth is reached  ***/
+/***   "unbalanced": few subtasks are a thousand times more expensive     ***/
+/***   "chains":     many chains of tasks linked by syncs                 ***/
+/***                                                                      ***/
+/***   For every thread count the workloads are run a number of rounds.   ***/
+/***   Tasks/s and steals/s are over all rounds, the latency is the time  ***/
+/***   from starting a round to its completion.                           ***/
+/***                                                                      ***/
+/***   usage: altona_sts_bench [-t maxthreads] [-r rounds] [-o out.csv]   ***/
+/***                           [-b benchmark]                             ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+#include "base/system.hpp"
+#include "base/types2.hpp"
+#include "util/taskscheduler.hpp"
+
+sISGUI(sFALSE)
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Work                                                               ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+static uint32_t Sink;
+
+static void Work(int seed,int units)
+{
+  uint32_t x = seed;
+  for(int i=0;i<units*16;i++)
+    x = x*1664525+1013904223;
+  if(x==0)
+    sAtomicInc(&Sink);
+}
+
+/****************************************************************************/
+
+static void FineCode(sStsManager *,sStsThread *,int start,int count,void *)
+{
+  for(int i=start;i<start+count;i++)
+    Work(i,1);
+}
+
+static void CoarseCode(sStsManager *,sStsThread *,int start,int count,void *)
+{
+  for(int i=start;i<start+count;i++)
+    Work(i,4096);
+}
+
+static void UnbalancedCode(sStsManager *,sStsThread *,int start,int count,void *)
+{
+  for(int i=start;i<start+count;i++)
+    Work(i,((i*2654435761U)>>22)==0 ? 1000 : 1);   // one in 1024 is expensive
+}
+
+struct NestedData
+{
+  sStsWorkload *Workload;
+  int Depth;
+};
+
+static void NestedCode(sStsManager *,sStsThread *th,int start,int,void *data)
+{
+  NestedData *nd = (NestedData *) data;
+  Work(start,4);
+  if(start+1<nd->Depth)
+  {
+    for(int i=0;i<2;i++)
+    {
+      sStsTask *t = nd->Workload->NewTask(NestedCode,nd,0,0);
+      t->Start = start+1;           // the subtask index is the depth
+      t->End = start+2;
+      th->AddTask(t);
+    }
+  }
+}
+
+static void ChainCode(sStsManager *,sStsThread *,int start,int,void *)
+{
+  Work(start,16);
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Benchmarks                                                         ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+struct Bench
+{
+  const sChar *Name;
+  int Tasks;                      // work items per round
+  void (*Build)(sStsManager *m,sStsWorkload *wl);
+};
+
+static void BuildFine(sStsManager *,sStsWorkload *wl)
+{
+  wl->AddTask(wl->NewTask(FineCode,0,0x10000,0));
+}
+
+static void BuildCoarse(sStsManager *,sStsWorkload *wl)
+{
+  wl->AddTask(wl->NewTask(CoarseCode,0,64,0));
+}
+
+static void BuildUnbalanced(sStsManager *,sStsWorkload *wl)
+{
+  wl->AddTask(wl->NewTask(UnbalancedCode,0,0x10000,0));
+}
+
+static const int NestedDepth = 13;
+
+static void BuildNested(sStsManager *,sStsWorkload *wl)
+{
+  NestedData *nd = wl->Alloc<NestedData>();
+  nd->Workload = wl;
+  nd->Depth = NestedDepth;
+  sStsTask *t = wl->NewTask(NestedCode,nd,0,0);
+  t->Start = 0;
+  t->End = 1;
+  wl->AddTask(t);
+}
+
+static const int ChainCount = 64;
+static const int ChainLength = 64;
+
+static void BuildChains(sStsManager *m,sStsWorkload *wl)
+{
+  for(int i=0;i<ChainCount;i++)
+  {
+    sStsTask *first = wl->NewTask(ChainCode,0,1,1);
+    sStsTask *t = first;
+    for(int j=1;j<ChainLength;j++)
+    {
+      sStsSync *sync = wl->Alloc<sStsSync>();
+      sync->Count = 0;
+      sync->ContinueTask = wl->NewTask(ChainCode,0,1,1);
+      m->AddSync(t,sync);
+      t = sync->ContinueTask;
+    }
+    wl->AddTask(first);
+  }
+}
+
+static Bench Benches[] =
+{
+  { L"fine",0x10000,BuildFine },
+  { L"coarse",64,BuildCoarse },
+  { L"nested",(1<<NestedDepth)-1,BuildNested },
+  { L"unbalanced",0x10000,BuildUnbalanced },
+  { L"chains",ChainCount*ChainLength,BuildChains },
+};
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Measuring                                                          ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+struct Result
+{
+  uint64_t Time;                  // us, all rounds
+  uint64_t Steals;
+  uint64_t FailedSteals;
+  uint64_t Spins;
+  uint64_t Exe;
+  sArray<uint64_t> Latency;       // us, one per round
+};
+
+static void RunRound(sStsManager *m,const Bench &b,Result &r)
+{
+  sStsWorkload *wl = m->BeginWorkload();
+  (*b.Build)(m,wl);
+
+  uint64_t t0 = sGetTimeUS();
+  wl->Start();
+  wl->Sync();
+  uint64_t t = sGetTimeUS()-t0;
+
+  r.Time += t;
+  r.Latency.AddTail(t);
+  r.Steals += wl->StealCount;
+  r.FailedSteals += wl->FailedStealCount;
+  r.Spins += wl->SpinCount;
+  r.Exe += wl->ExeCount;
+  wl->End();
+}
+
+static uint64_t Percentile(const sArray<uint64_t> &a,int percent)
+{
+  return a[sMin(a.GetCount()-1,a.GetCount()*percent/100)];
+}
+
+/****************************************************************************/
+
+void sMain()
+{
+  int maxthreads = sGetShellInt(L"t",L"-threads",sGetCPUCount());
+  int rounds = sMax(1,sGetShellInt(L"r",L"-rounds",50));
+  const sChar *outname = sGetShellString(L"o",L"-out",0);
+  const sChar *only = sGetShellString(L"b",L"-bench",0);
+
+  sTextBuffer csv;
+  csv.Print(L"bench,threads,rounds,tasks_per_s,steals_per_s,failed_steals_per_round,spins_per_round,exe_per_round,p50_us,p99_us,max_us\n");
+  sPrintF(L"bench      threads      tasks/s     steals/s  spins/rnd   p50 us   p99 us   max us\n");
+
+  for(int threads=1;threads<=maxthreads;threads++)
+  {
+    sStsManager *m = new sStsManager(16*1024*1024,1024,threads);
+    for(int i=0;i<sCOUNTOF(Benches);i++)
+    {
+      const Bench &b = Benches[i];
+      if(only && sCmpString(only,b.Name)!=0)
+        continue;
+
+      Result r;
+      r.Time = r.Steals = r.FailedSteals = r.Spins = r.Exe = 0;
+      RunRound(m,b,r);            // warm up, allocates the workload
+      r.Time = r.Steals = r.FailedSteals = r.Spins = r.Exe = 0;
+      r.Latency.Clear();
+      for(int j=0;j<rounds;j++)
+        RunRound(m,b,r);
+      sHeapSortUp(r.Latency);
+
+      double sec = sMax<uint64_t>(r.Time,1)*1e-6;
+      double tps = double(b.Tasks)*rounds/sec;
+      double sps = r.Steals/sec;
+      uint64_t p50 = Percentile(r.Latency,50);
+      uint64_t p99 = Percentile(r.Latency,99);
+      uint64_t max = r.Latency[r.Latency.GetCount()-1];
+
+      sPrintF(L"%-10s %7d %12.0f %12.0f %10d %8d %8d %8d\n",b.Name,threads,tps,sps,
+        int(r.Spins/rounds),int(p50),int(p99),int(max));
+      csv.PrintF(L"%s,%d,%d,%d,%d,",b.Name,threads,rounds,int64_t(tps),int64_t(sps));
+      csv.PrintF(L"%d,%d,%d,%d,%d,%d\n",int(r.FailedSteals/rounds),int(r.Spins/rounds),int(r.Exe/rounds),
+        int(p50),int(p99),int(max));
+    }
+    delete m;
+  }
+
+  if(outname && !sSaveTextAnsi(outname,csv.Get()))
+    sPrintF(L"could not write %s\n",outname);
+}
+
+/****************************************************************************/
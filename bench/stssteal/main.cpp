@@ -0,0 +1,114 @@
+/*+**************************************************************************/
+/***                                                                      ***/
+/***   This file is distributed under a BSD license.                      ***/
+/***   See LICENSE.txt for details.                                       ***/
+/***                                                                      ***/
+/**************************************************************************+*/
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Steal throughput of the task scheduler queues.                     ***/
+/***                                                                      ***/
+/***   "scatter": the master queues many single subtask tasks, all other  ***/
+/***              threads have to steal every piece of work from it.      ***/
+/***   "split":   one task with many subtasks that the threads split      ***/
+/***              between themselves.                                     ***/
+/***                                                                      ***/
+/***   usage: altona_stssteal_bench [-t maxthreads] [-n tasks] [-r rounds] ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+#include "base/system.hpp"
+#include "util/taskscheduler.hpp"
+
+sISGUI(sFALSE)
+
+/****************************************************************************/
+
+static uint32_t Sink;
+
+static void TinyCode(sStsManager *,sStsThread *,int start,int count,void *)
+{
+  uint32_t x = start;
+  for(int i=0;i<count*16;i++)
+    x = x*1664525+1013904223;
+  if(x==0)
+    sAtomicInc(&Sink);
+}
+
+struct Result
+{
+  uint64_t Time;
+  uint32_t Exe;
+  uint32_t Steals;
+  uint32_t FailedSteals;
+};
+
+static void RunScatter(sStsManager *m,int tasks,Result &r)
+{
+  sStsWorkload *wl = m->BeginWorkload();
+  for(int i=0;i<tasks;i++)
+    wl->AddTask(wl->NewTask(TinyCode,0,1,0));
+
+  uint64_t t0 = sGetTimeUS();
+  wl->Start();
+  wl->Sync();
+  r.Time += sGetTimeUS()-t0;
+  r.Exe += wl->ExeCount;
+  r.Steals += wl->StealCount;
+  r.FailedSteals += wl->FailedStealCount;
+  wl->End();
+}
+
+static void RunSplit(sStsManager *m,int tasks,Result &r)
+{
+  sStsWorkload *wl = m->BeginWorkload();
+  wl->AddTask(wl->NewTask(TinyCode,0,tasks,0));
+
+  uint64_t t0 = sGetTimeUS();
+  wl->Start();
+  wl->Sync();
+  r.Time += sGetTimeUS()-t0;
+  r.Exe += wl->ExeCount;
+  r.Steals += wl->StealCount;
+  r.FailedSteals += wl->FailedStealCount;
+  wl->End();
+}
+
+static void Print(const sChar *name,int threads,int tasks,int rounds,const Result &r)
+{
+  double sec = sMax<uint64_t>(r.Time,1)*1e-6;
+  sPrintF(L"%-8s %7d %12d %14.0f %14.0f %10d\n",name,threads,r.Exe/rounds,
+    tasks*rounds/sec,r.Steals/sec,r.FailedSteals/rounds);
+}
+
+/****************************************************************************/
+
+void sMain()
+{
+  int maxthreads = sGetShellInt(L"t",L"-threads",sGetCPUCount());
+  int tasks = sGetShellInt(L"n",L"-tasks",0x4000);
+  int rounds = sGetShellInt(L"r",L"-rounds",20);
+
+  sPrintF(L"mode     threads   exe/round        tasks/s       steals/s  fails/rnd\n");
+  for(int threads=1;threads<=maxthreads;threads++)
+  {
+    sStsManager *m = new sStsManager(tasks*256,tasks,threads);
+    Result scatter,split;
+    sClear(scatter);
+    sClear(split);
+
+    RunScatter(m,tasks,scatter);        // warm up, allocates the workload
+    sClear(scatter);
+    for(int i=0;i<rounds;i++)
+      RunScatter(m,tasks,scatter);
+    for(int i=0;i<rounds;i++)
+      RunSplit(m,tasks,split);
+
+    Print(L"scatter",m->GetThreadCount(),tasks,rounds,scatter);
+    Print(L"split",m->GetThreadCount(),tasks,rounds,split);
+    delete m;
+  }
+}
+
+/****************************************************************************/
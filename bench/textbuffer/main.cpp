@@ -0,0 +1,89 @@
+/*+**************************************************************************/
+/***                                                                      ***/
+/***   This file is distributed under a BSD license.                      ***/
+/***   See LICENSE.txt for details.                                       ***/
+/***                                                                      ***/
+/**************************************************************************+*/
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   sTextBuffer editing a large text, us per keystroke.                ***/
+/***                                                                      ***/
+/***   "insert":  one char inserted in the middle of the text.            ***/
+/***   "screen":  the same, then the 60 lines around it are fetched with  ***/
+/***              GetLineStart() and Copy(), as sTextWindow paints.       ***/
+/***   "get":     the same, then Get(), which assembles the whole text    ***/
+/***              in edit mode.                                           ***/
+/***                                                                      ***/
+/***   usage: altona_textbuffer_bench [-l lines] [-n keystrokes]          ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+#include "base/system.hpp"
+#include "base/types2.hpp"
+
+sISGUI(sFALSE)
+
+/****************************************************************************/
+
+static uint32_t Sink;
+static sChar Line[4096];
+
+enum Mode
+{
+  INSERT,
+  SCREEN,
+  GET,
+};
+
+static void Run(const sChar *name,sBool editmode,int lines,int keys,int mode)
+{
+  sTextBuffer tb;
+  for(int i=0;i<lines;i++)
+    tb.PrintF(L"%6d: the quick brown fox jumps over the lazy dog, %08x\n",i,i*2654435761U);
+  tb.SetEditMode(editmode);
+  int count = tb.GetCount();
+
+  uint64_t t0 = sGetTimeUS();
+  for(int i=0;i<keys;i++)
+  {
+    int pos = count/2+i;
+    tb.Insert(pos,'x');
+    if(mode==SCREEN)
+    {
+      int first = tb.GetLine(pos)-30;
+      for(int l=first;l<first+60;l++)
+      {
+        int start = tb.GetLineStart(l);
+        int len = sMin<int>(tb.GetLineStart(l+1)-start,sCOUNTOF(Line));
+        tb.Copy(start,len,Line);
+        Sink += Line[0];
+      }
+    }
+    if(mode==GET)
+      Sink += tb.Get()[pos];
+  }
+  uint64_t t1 = sGetTimeUS();
+
+  static const sChar *modes[] = { L"insert",L"screen",L"get" };
+  sPrintF(L"%-8s %-10s %10.2f us\n",modes[mode],name,(t1-t0)/double(keys));
+}
+
+/****************************************************************************/
+
+void sMain()
+{
+  int lines = sGetShellInt(L"l",L"-lines",60000);
+  int keys = sGetShellInt(L"n",L"-keys",1000);
+
+  sPrintF(L"%d lines\n",lines);
+  for(int mode=INSERT;mode<=GET;mode++)
+  {
+    Run(L"flat",0,lines,keys,mode);
+    Run(L"edit mode",1,lines,keys,mode);
+  }
+  if(Sink==0x12345678)
+    sPrintF(L"\n");
+}
+
+/****************************************************************************/
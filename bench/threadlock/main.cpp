@@ -0,0 +1,226 @@
+/*+**************************************************************************/
+/***                                                                      ***/
+/***   This file is distributed under a BSD license.                      ***/
+/***   See LICENSE.txt for details.                                       ***/
+/***                                                                      ***/
+/**************************************************************************+*/
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Contention benchmark for sThreadLock and sThreadEvent.             ***/
+/***                                                                      ***/
+/***   Compares the futex based primitives with the implementations they  ***/
+/***   replaced (a process shared pthread mutex and an event that busy    ***/
+/***   waits with pthread_yield), which are kept here for reference.      ***/
+/***                                                                      ***/
+/***   usage: altona_threadlock_bench [-t maxthreads] [-n iterations]     ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+#include "base/system.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+sISGUI(sFALSE)
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   The old primitives                                                 ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+class OldLock
+{
+  pthread_mutex_t Mutex;
+public:
+  OldLock()
+  {
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr,PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&Mutex,&mattr);
+  }
+  ~OldLock()    { pthread_mutex_destroy(&Mutex); }
+  void Lock()   { pthread_mutex_lock(&Mutex); }
+  void Unlock() { pthread_mutex_unlock(&Mutex); }
+};
+
+class OldEvent                    // automatic reset only
+{
+  volatile uint32_t Signaled;
+public:
+  OldEvent()    { Signaled = 0; }
+  void Signal() { Signaled = 1; }
+  sBool Wait(int timeout)
+  {
+    int start = sGetTime();
+    uint32_t gotit;
+    while((gotit = sAtomicSwap(&Signaled,0))==0)
+    {
+      if(timeout>=0 && sGetTime()-start>=timeout)
+        return 0;
+      sched_yield();
+    }
+    return 1;
+  }
+};
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Measuring                                                          ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+static double GetCpuTime()
+{
+  rusage r;
+  getrusage(RUSAGE_SELF,&r);
+  return r.ru_utime.tv_sec + r.ru_stime.tv_sec + (r.ru_utime.tv_usec + r.ru_stime.tv_usec)*1e-6;
+}
+
+struct Timing
+{
+  uint64_t Start;
+  double CpuStart;
+  double Wall;
+  double Cpu;
+
+  void Begin() { Start = sGetTimeUS(); CpuStart = GetCpuTime(); }
+  void End()   { Wall = (sGetTimeUS()-Start)*1e-6; Cpu = GetCpuTime()-CpuStart; }
+};
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Lock contention: all threads hammer a short critical section       ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+template <class L> struct LockTest
+{
+  L Lock;
+  int Iterations;
+  volatile uint32_t Ready;
+  volatile uint32_t Go;
+  uint32_t Counter;
+
+  static void Func(sThread *,void *user)
+  {
+    LockTest *lt = (LockTest *) user;
+    sAtomicInc(&lt->Ready);
+    while(!lt->Go)
+      sched_yield();
+    for(int i=0;i<lt->Iterations;i++)
+    {
+      lt->Lock.Lock();
+      lt->Counter++;
+      lt->Lock.Unlock();
+    }
+  }
+
+  void Run(const sChar *name,int threads,int iterations)
+  {
+    Iterations = iterations;
+    Ready = 0;
+    Go = 0;
+    Counter = 0;
+
+    sThread **th = new sThread *[threads];
+    for(int i=0;i<threads;i++)
+      th[i] = new sThread(Func,0,0x4000,this,0);
+    while(Ready<uint32_t(threads))
+      sched_yield();
+
+    Timing t;
+    t.Begin();
+    Go = 1;
+    for(int i=0;i<threads;i++)
+      delete th[i];
+    t.End();
+    delete[] th;
+
+    sVERIFY(Counter==uint32_t(threads*iterations));
+    double ops = double(threads)*iterations;
+    sPrintF(L"lock   %-8s %3d threads %8.1f ns/op   cpu %6.3fs wall %6.3fs\n",name,threads,t.Wall*1e9/ops,t.Cpu,t.Wall);
+  }
+};
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Event ping pong: two threads wake each other                       ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+template <class E> struct EventTest
+{
+  E Ping;
+  E Pong;
+  int Iterations;
+
+  static void Func(sThread *,void *user)
+  {
+    EventTest *et = (EventTest *) user;
+    for(int i=0;i<et->Iterations;i++)
+    {
+      et->Ping.Wait(-1);
+      et->Pong.Signal();
+    }
+  }
+
+  void Run(const sChar *name,int iterations)
+  {
+    Iterations = iterations;
+    sThread *th = new sThread(Func,0,0x4000,this,0);
+
+    Timing t;
+    t.Begin();
+    for(int i=0;i<iterations;i++)
+    {
+      Ping.Signal();
+      Pong.Wait(-1);
+    }
+    delete th;
+    t.End();
+
+    sPrintF(L"event  %-8s pingpong    %8.2f us/roundtrip cpu %6.3fs wall %6.3fs\n",name,t.Wall*1e6/iterations,t.Cpu,t.Wall);
+  }
+
+  void RunIdle(const sChar *name,int ms)
+  {
+    Timing t;
+    t.Begin();
+    Ping.Wait(ms);                // nobody signals, this times out
+    t.End();
+    sPrintF(L"event  %-8s idle wait   %8d ms           cpu %6.3fs wall %6.3fs\n",name,ms,t.Cpu,t.Wall);
+  }
+};
+
+/****************************************************************************/
+
+void sMain()
+{
+  int maxthreads = sGetShellInt(L"t",L"-threads",sMax(2,sGetCPUCount()));
+  int iterations = sGetShellInt(L"n",L"-iterations",200000);
+
+  for(int threads=1;threads<=maxthreads;threads*=2)
+  {
+    LockTest<OldLock> *o = new LockTest<OldLock>;
+    o->Run(L"pthread",threads,iterations);
+    delete o;
+    LockTest<sThreadLock> *n = new LockTest<sThreadLock>;
+    n->Run(L"futex",threads,iterations);
+    delete n;
+  }
+
+  EventTest<OldEvent> *oe = new EventTest<OldEvent>;
+  oe->Run(L"yield",iterations/10);
+  oe->RunIdle(L"yield",200);
+  delete oe;
+  EventTest<sThreadEvent> *ne = new EventTest<sThreadEvent>;
+  ne->Run(L"futex",iterations/10);
+  ne->RunIdle(L"futex",200);
+  delete ne;
+}
+
+/****************************************************************************/
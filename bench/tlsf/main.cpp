@@ -0,0 +1,100 @@
+/*+**************************************************************************/
+/***                                                                      ***/
+/***   This file is distributed under a BSD license.                      ***/
+/***   See LICENSE.txt for details.                                       ***/
+/***                                                                      ***/
+/**************************************************************************+*/
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Fragmentation stress for sTlsfHeap and sMemoryHeap.                ***/
+/***                                                                      ***/
+/***   A fixed number of slots is randomly allocated and freed. Most      ***/
+/***   blocks are small, one in 16 is up to 64K, one in 8 wants 256 byte  ***/
+/***   alignment and half of them are allocated with sAMF_ALT. Every      ***/
+/***   block is checked when it is freed.                                 ***/
+/***                                                                      ***/
+/***   usage: altona_tlsf_bench [-n operations] [-s slots]                ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+#include "base/system.hpp"
+
+sISGUI(sFALSE)
+
+/****************************************************************************/
+
+static const sPtr HeapSize = 64*1024*1024;
+
+static void Run(const sChar *name,sMemoryHandler *heap,int ops,int slots)
+{
+  void **ptr = new void *[slots];
+  int *size = new int[slots];
+  for(int i=0;i<slots;i++)
+    ptr[i] = 0;
+
+  uint32_t seed = 1;
+  uint64_t t0 = sGetTimeUS();
+  for(int i=0;i<ops;i++)
+  {
+    seed = seed*1664525+1013904223;
+    int s = (seed>>8)%slots;
+    if(ptr[s])
+    {
+      uint8_t *p = (uint8_t *)ptr[s];
+      if(p[0]!=uint8_t(s) || p[size[s]-1]!=uint8_t(s))
+        sFatal(L"%s: block %d overwritten",name,s);
+      heap->Free(p);
+      ptr[s] = 0;
+    }
+    else
+    {
+      int n = (seed>>28)==0 ? 1+((seed>>10)&0xffff) : 1+((seed>>12)&255);
+      int align = ((seed>>4)&7)==0 ? 256 : 16;
+      uint8_t *p = (uint8_t *)heap->Alloc(n,align,(seed&0x10000) ? sAMF_ALT : 0);
+      if(!p || (sPtr(p)&(align-1)))
+        sFatal(L"%s: allocation %d failed",name,i);
+      if(heap->MemSize(p)!=sPtr(n))
+        sFatal(L"%s: MemSize() is %d, should be %d",name,int(heap->MemSize(p)),n);
+      p[0] = p[n-1] = uint8_t(s);
+      size[s] = n;
+      ptr[s] = p;
+    }
+  }
+  uint64_t t1 = sGetTimeUS();
+
+  sPrintF(L"%-12s %8d ms %10K free %10K largest\n",name,int((t1-t0)/1000),
+    heap->GetFree(),heap->GetLargestFree());
+
+  for(int i=0;i<slots;i++)
+    if(ptr[i])
+      heap->Free(ptr[i]);
+  heap->Validate();
+
+  delete[] ptr;
+  delete[] size;
+}
+
+/****************************************************************************/
+
+void sMain()
+{
+  int ops = sGetShellInt(L"n",L"-operations",2000000);
+  int slots = sGetShellInt(L"s",L"-slots",20000);
+
+  uint8_t *mem = new uint8_t[HeapSize];
+
+  sTlsfHeap *tlsf = new sTlsfHeap;
+  tlsf->Init(mem,HeapSize);
+  Run(L"sTlsfHeap",tlsf,ops,slots);
+  delete tlsf;
+
+  sMemoryHeap *heap = new sMemoryHeap;
+  heap->Init(mem,HeapSize);
+  Run(L"sMemoryHeap",heap,ops,slots);
+  delete heap;
+
+  delete[] mem;
+}
+
+/****************************************************************************/
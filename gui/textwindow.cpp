@@ -24,6 +24,8 @@ sTextWindow::sTextWindow()
   Font = sGui->PropFont;
   WindowHeight = Font->GetHeight()*5/2;
   Text = 0;
+  LineBuffer = 0;
+  LineAlloc = 0;
   TextTag = 0;
   BackColor = sGC_BACK;
   DragCursorStart = 0;
@@ -49,6 +51,7 @@ sTextWindow::~sTextWindow()
   UndoClear();
   delete Timer;
   delete[] UndoBuffer;
+  delete[] LineBuffer;
 }
 
 void sTextWindow::InitCursorFlash()
@@ -66,6 +69,8 @@ void sTextWindow::Tag()
 void sTextWindow::SetText(sTextBuffer *text)
 {
   Text = text;
+  if(EditFlags & sTEF_EDITMODE)
+    Text->SetEditMode(1);         // keystrokes and undo steps don't move the whole text
   MarkMode = 0;
   MarkBegin = 0;
   MarkEnd = 0;
@@ -99,7 +104,8 @@ void sTextWindow::OnPaint2D()
     {
       TextRect.x0 = lnr.x1 = lnr.x0+40;
     }
-    int h=Font->Print(TextFlags|sF2P_OPAQUE,TextRect,Text->Get(),-1,0,0,0,&pi);
+    int dummy = 0;
+    int h=PrintLines(pi,dummy);
     if(EditFlags & sTEF_LINENUMBER)
     {
       sString<16> str;
@@ -160,16 +166,94 @@ void sTextWindow::CmdCursorToggle()
 
 /****************************************************************************/
 
+// lays out the text one line at a time, so a buffer in edit mode is never
+// assembled. sPIM_POS2POINT finds the point of pos, sPIM_POINT2POS sets pos
+// for the point, -1 below the text. returns the bottom of the text.
+
+int sTextWindow::PrintLines(sPrintInfo &pi,int &pos)
+{
+  int flags = TextFlags|sF2P_OPAQUE;
+  int count = Text->GetCount();
+  int lines = Text->GetLineCount();
+  int query = pos;
+  int start = 0;
+  int y = TextRect.y0;
+
+  if(pi.Mode==sPIM_POINT2POS)
+    pos = -1;
+
+  for(int l=0;l<lines;l++)
+  {
+    sBool last = (l+1==lines);
+    int end = last ? count : Text->GetLineStart(l+1);
+    int len = last ? end-start : end-start-1;           // without the linefeed, so it wraps like the whole text
+    if(len+1>LineAlloc)
+    {
+      delete[] LineBuffer;
+      LineAlloc = sMax(len+1,LineAlloc*2);
+      LineBuffer = new sChar[LineAlloc];
+    }
+    Text->Copy(start,len,LineBuffer);
+    LineBuffer[len] = 0;
+
+    sPrintInfo lp = pi;
+    lp.CursorPos = pi.CursorPos>=0 ? pi.CursorPos-start : -1;
+    lp.SelectStart = pi.SelectStart-start;
+    lp.SelectEnd = pi.SelectEnd-start;
+    lp.QueryPos = 0;
+    sRect r(TextRect.x0,y,TextRect.x1,last ? TextRect.y1 : y);   // the last line clears the rest
+    int next;
+
+    switch(pi.Mode)
+    {
+    case sPIM_POS2POINT:
+      if(query>=start && (query<end || last))
+        lp.QueryPos = LineBuffer+query-start;
+      next = Font->Print(flags,r,LineBuffer,len,0,0,0,&lp);
+      if(lp.QueryPos)
+      {
+        pi.QueryX = lp.QueryX;
+        pi.QueryY = lp.QueryY;
+      }
+      break;
+
+    case sPIM_POINT2POS:
+      next = Font->Print(flags,r,LineBuffer,len,0,0,0,&lp);
+      if(lp.Mode==sPIM_QUERYDONE)
+      {
+        pos = start+int(lp.QueryPos-LineBuffer);
+        pi.Mode = sPIM_QUERYDONE;
+        return next;
+      }
+      break;
+
+    default:
+      lp.Mode = sPIM_GETHEIGHT;   // lines out of sight are only measured
+      next = Font->Print(flags,r,LineBuffer,len,0,0,0,&lp);
+      if(last || (next>Inner.y0 && y<Inner.y1))
+      {
+        lp.Mode = sPIM_PRINT;
+        Font->Print(flags,r,LineBuffer,len,0,0,0,&lp);
+      }
+      break;
+    }
+
+    y = next;
+    start = end;
+  }
+  return y;
+}
+
 void sTextWindow::GetCursorPos(int &x,int &y)
 {
   sPrintInfo pil;
   pil = PrintInfo;
-  pil.QueryPos = Text->Get() + PrintInfo.CursorPos;
   pil.QueryX = 0;
   pil.QueryY = 0;
   pil.Mode = sPIM_POS2POINT;
 
-  int h = Font->Print(TextFlags|sF2P_OPAQUE,TextRect,Text->Get(),-1,0,0,0,&pil);
+  int pos = PrintInfo.CursorPos;
+  int h = PrintLines(pil,pos);
 
   x = pil.QueryX;
   y = pil.QueryY;
@@ -188,15 +272,15 @@ int sTextWindow::FindCursorPos(int x,int y)
     return 0;
   sPrintInfo pil;
   pil = PrintInfo;
-  pil.QueryPos = 0;
   pil.QueryX = x;
   pil.QueryY = y;
   pil.Mode = sPIM_POINT2POS;
 
-  Font->Print(TextFlags|sF2P_OPAQUE,TextRect,Text->Get(),-1,0,0,0,&pil);
+  int pos;
+  PrintLines(pil,pos);
 
-  if(pil.QueryPos)
-    return int(pil.QueryPos - Text->Get());
+  if(pos>=0)
+    return pos;
   else
     return Text->GetCount();
 }
@@ -243,15 +327,14 @@ void sTextWindow::OnDrag(const sWindowDrag &dd)
       && PrintInfo.CursorPos>=0 && Text)
     {
       int i;
-      const sChar *s = Text->Get();
       MarkMode = 1;
 
       i = PrintInfo.CursorPos;
-      while(i>0 && !sIsSpace(s[i-1])) i--;
+      while(i>0 && !sIsSpace(Text->GetChar(i-1))) i--;
       MarkBegin = i;
 
       i = PrintInfo.CursorPos;
-      while(s[i] && !sIsSpace(s[i])) i++;
+      while(Text->GetChar(i) && !sIsSpace(Text->GetChar(i))) i++;
       MarkEnd = i;
 
       PrintInfo.SelectStart = sMin(MarkBegin,MarkEnd);
@@ -734,9 +817,7 @@ void sTextWindow::UndoDelete(int pos,int size)
   step->Pos = pos;
   step->Text = new sChar[size];
   step->Delete = 1;
-  const sChar *s = Text->Get();
-  for(int i=0;i<size;i++)
-    step->Text[i] = s[pos+i];
+  Text->Copy(pos,size,step->Text);
 }
 
 void sTextWindow::Undo()
@@ -929,11 +1010,7 @@ void sTextWindow::InsertString(const sChar *s)
 void sTextWindow::IndentBlock(int indent)
 {
   if(EditFlags & sTEF_STATIC) return;
-  int n = PrintInfo.SelectStart;
-  {
-    const sChar *s = Text->Get();
-    while(n>0 && s[n-1]!='\n') n--;
-  }
+  int n = Text->GetLineStart(Text->GetLine(PrintInfo.SelectStart));
 
   while(n<PrintInfo.SelectEnd)
   {
@@ -944,18 +1021,13 @@ void sTextWindow::IndentBlock(int indent)
     else
     {
       int m=0;
-      const sChar *s = Text->Get();
-      while(m<-indent && s[n+m]==' ') m++;
+      while(m<-indent && Text->GetChar(n+m)==' ') m++;
       if(m>0)
         Delete(n,m);
     }
-    {
-      const sChar *s = Text->Get();
-      while(n<PrintInfo.SelectEnd && s[n]!='\n')
-        n++;
-      while(n<PrintInfo.SelectEnd && s[n]=='\n')
-        n++;
-    }
+    n = Text->GetLineStart(Text->GetLine(n)+1);
+    while(n<PrintInfo.SelectEnd && Text->GetChar(n)=='\n')
+      n++;
   }
   sGui->Notify(*Text);
   ChangeMsg.Post();
@@ -1040,16 +1112,7 @@ sFont2D *sTextWindow::GetFont()
 
 int sTextWindow::GetCursorColumn() const
 {
-  const sChar *s0 = Text->Get();
-  const sChar *sc = s0 + PrintInfo.CursorPos;
-
-  int n = 0;
-  while(sc>s0 && sc[-1]!='\n')
-  {
-    sc--;
-    n++;
-  }
-  return n;
+  return PrintInfo.CursorPos - Text->GetLineStart(Text->GetLine(PrintInfo.CursorPos));
 }
 
 void sTextWindow::Find(const sChar *find,sBool dir,sBool next)
@@ -30,7 +30,10 @@ class sTextWindow : public sWindow
   sRect TextRect;
 
   sTextBuffer *Text;              // textbuffer to edit
+  sChar *LineBuffer;              // one line of Text, for printing
+  int LineAlloc;
 
+  int PrintLines(sPrintInfo &pi,int &pos);
   void GetCursorPos(int &x,int &y);
   int FindCursorPos(int x,int y);
   sBool BeginMoveCursor(sBool selmode);
@@ -129,6 +132,7 @@ enum sTextEditFlags
   sTEF_MARK       = 0x0002,
   sTEF_STATIC     = 0x0004,
   sTEF_LINENUMBER = 0x0008,
+  sTEF_EDITMODE   = 0x0010,       // SetText() switches the buffer to sTextBuffer::SetEditMode(1)
 };
 
 class sWireTextWindow : public sTextWindow
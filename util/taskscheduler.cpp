@@ -11,6 +11,7 @@
 static uint32_t StatSpin;
 static uint32_t StatLock;
 static int SpinDummy=1;
+static sPtr CurrentThreadTls;     // sStsThread * while a task runs on this thread
 
 /****************************************************************************/
 /***                                                                      ***/
@@ -95,6 +96,56 @@ void sStsLock::Unlock()
   sAtomicDec(&Count);
 }
 
+/****************************************************************************/
+/***                                                                      ***/
+/***   Eventcount for parking idle threads                                ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+sStsEventCount::sStsEventCount()
+{
+  Epoch = 0;
+  Waiters = 0;
+  NotifyTime = 0;
+}
+
+uint32_t sStsEventCount::PrepareWait()
+{
+  sAtomicInc(&Waiters);           // full barrier: Waiters is visible before we read Epoch
+  return Epoch;
+}
+
+void sStsEventCount::CancelWait()
+{
+  sAtomicDec(&Waiters);
+}
+
+uint64_t sStsEventCount::Wait(uint32_t key)
+{
+#if sPLATFORM==sPLAT_LINUX
+  while(Epoch==key)
+    sFutexWait(&Epoch,key);
+#else
+  while(Epoch==key)
+    sSleep(1);
+#endif
+  uint64_t latency = sGetTimeUS()-NotifyTime;
+  sAtomicDec(&Waiters);
+  return latency;
+}
+
+void sStsEventCount::Notify(sBool all)
+{
+  sMemoryBarrier();               // whatever we signal must be visible before we look at Waiters
+  if(Waiters==0)
+    return;
+  NotifyTime = sGetTimeUS();
+  sAtomicInc(&Epoch);
+#if sPLATFORM==sPLAT_LINUX
+  sFutexWake(&Epoch,all ? 0x7fffffff : 1);
+#endif
+}
+
 /****************************************************************************/
 /***                                                                      ***/
 /***   A thread that can work tasks. Thread index 0 is on main thread     ***/
@@ -104,66 +155,134 @@ void sStsLock::Unlock()
 void sStsThreadFunc(class sThread *thread, void *_user)
 {
   sStsThread *user = (sStsThread *) _user;
+  sStsManager *m = user->Manager;
+  uint64_t spinstart = 0;
+  sBool busy = 0;
 
   while(thread->CheckTerminate())
   {
-
-//    if(sSchedMon) sSchedMon->Begin(user->GetIndex(),0xffffff);
-    user->Event->Wait(5);
-    if(sSchedMon) sSchedMon->Begin(user->GetIndex(),0xff0000);
-/*
-    user->Lock->Lock();
-    user->Running = 1;
-    user->Lock->Unlock();
-*/
-    int fails = 0;
-    while(user->Manager->Running==1 && user->Manager->ActiveWorkloadCount>0)
+    if(m->Running==1 && m->ActiveWorkloadCount>0 && !user->Execute())
     {
-      if(user->Execute())
-      {
-        fails++;
-        if(fails>10)
-        {
-          sSleep(0);
-          fails = 0;
-        }
-      }
-      else
+      if(!busy && sSchedMon) sSchedMon->Begin(user->GetIndex(),0xff0000);
+      busy = 1;
+      spinstart = 0;
+    }
+    else
+    {
+      if(busy && m->ActiveWorkloadCount==0)
       {
-        fails = 0;
+        if(sSchedMon) sSchedMon->End(user->GetIndex());
+        busy = 0;
       }
+      user->Idle(spinstart);
     }
-/*
-    user->Lock->Lock();
-    user->Running = 2;
-    user->Lock->Unlock();
-*/
-    if(sSchedMon) sSchedMon->End(user->GetIndex());
- //   if(sSchedMon) sSchedMon->End(user->GetIndex());
   }
+  if(busy && sSchedMon) sSchedMon->End(user->GetIndex());
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Work stealing deque                                                ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+void sStsQueue::Init(int max)
+{
+  TaskMax = 1<<sFindHigherPower(max);
+  Tasks = new sStsTask*[TaskMax];
+  Bottom = 0;
+  Top = 0;
+  ResetStats();
+}
+
+void sStsQueue::Exit()
+{
+  delete[] Tasks;
+}
+
+sBool sStsQueue::Push(sStsTask *task)
+{
+  uint32_t b = Bottom;
+  if(int(b-Top)>=TaskMax)
+    return 0;
+  Tasks[b&(TaskMax-1)] = task;
+  sWriteBarrier();                // task must be visible before thieves see the new bottom
+  Bottom = b+1;
+  return 1;
+}
+
+sStsTask *sStsQueue::Pop()
+{
+  // Top only grows, so a stale read can only make us believe there is
+  // something left. this keeps the fence out of the idle loop.
+
+  if(int(Bottom-Top)<=0)
+    return 0;
+
+  uint32_t b = Bottom-1;
+  Bottom = b;
+  sMemoryBarrier();               // publish bottom before reading top
+  uint32_t t = Top;
+  int n = int(b-t);
+  if(n<0)                         // a thief was faster
+  {
+    Bottom = b+1;
+    return 0;
+  }
+  sStsTask *task = Tasks[b&(TaskMax-1)];
+  if(n>0)                         // more than one task left, no thief can reach this one
+    return task;
+
+  // this is the last task, race against the thieves
+
+  if(sAtomicCmpSwap(&Top,t,t+1)!=t)
+    task = 0;
+  Bottom = b+1;
+  return task;
+}
+
+sStsTask *sStsQueue::Steal(sBool &abort)
+{
+  abort = 0;
+  uint32_t t = Top;
+  sMemoryBarrier();               // pairs with the barrier in Pop()
+  uint32_t b = Bottom;
+  if(int(b-t)<=0)
+    return 0;
+  sStsTask *task = Tasks[t&(TaskMax-1)];
+  if(sAtomicCmpSwap(&Top,t,t+1)!=t)
+  {
+    abort = 1;
+    return 0;
+  }
+  return task;
 }
 
 /****************************************************************************/
 
-sStsThread::sStsThread(sStsManager *m,int index,int taskcount,sBool thread)
+sStsThread::sStsThread(sStsManager *m,int index,int cpu,int node,sBool thread)
 {
   Manager = m;
   Index = index;
   Thread = 0;
-  Lock = new sStsLock;
-  Event = new sThreadEvent;
+  CurrentTask = 0;
+  Cpu = cpu;
+  Node = node;
+  StealOrder = new int[m->ThreadCount];
+  sClear(StealGroups);
+  PriorityLimit = sSP_MAX-1;
 
-//  Running = 0;
+  // the master thread is not pinned, every thread the application creates
+  // later would inherit the affinity.
 
   if(thread)
   {
     Thread = new sThread(sStsThreadFunc,0,0x4000,this,0);
-    Thread->SetHomeCore(index);
+    Thread->SetHomeCore(cpu);
   }
   else
   {
     sVERIFY(index==0);
-    sGetThreadContext()->Thread->SetHomeCore(index);
   }
 }
 
@@ -172,36 +291,31 @@ sStsThread::~sStsThread()
   if(Thread)
   {
     Thread->Terminate();
-    Event->Signal();
+    Manager->IdleEvent.Notify(1);
     delete Thread;
   }
+  delete[] StealOrder;
+}
 
-  delete Lock;
-  delete Event;
+sBool sStsThread::Push(sStsQueue *qu,sStsTask *task)
+{
+  if(!qu->Push(task))
+    return 0;
+
+  // wake a sleeping thread to steal it. the check is not synchronised, in
+  // the rare case we miss someone going to sleep we do the work ourself.
+
+  if(Manager->IdleEvent.HasWaiters())
+    Manager->IdleEvent.Notify(0);
+  return 1;
 }
 
 void sStsThread::AddTask(sStsTask *task)
 {
-  Lock->Lock();
   sStsWorkload *wl = task->Workload;
-  sStsQueue *qu = wl->Queues[Index];
-  if(qu->TaskCount==qu->TaskMax)          // task queue full, immediate execution
-  {
-    sAtomicInc(&wl->TasksRunning);
-    Lock->Unlock();
-//    sDPrintF(L"queue full\n");
-    for(int i=task->Start;i<task->End;i++)
-      (*task->Code)(Manager,this,i,1,task->Data);
-    sAtomicDec(&wl->TasksRunning);
-  }
-  else                            // enqueue task
-  {
-    sAtomicInc(&wl->TasksLeft);
-    sAtomicInc(&Manager->TotalTasksLeft);
-    qu->Tasks[qu->TaskCount++] = task;
-    qu->SubTaskCount += task->End-task->Start;
-    Lock->Unlock();
-  }
+  sAtomicInc(&wl->TasksLeft);
+  if(!Push(wl->Queues[Index],task))   // task queue full, immediate execution
+    RunTask(task);
 }
 
 void sStsThread::DecreaseSync(sStsTask *t)
@@ -212,81 +326,116 @@ void sStsThread::DecreaseSync(sStsTask *t)
     if(s)
     {
       int n = sAtomicDec(&s->Count);
-      if(n==0 && s->ContinueTask)
-        AddTask(s->ContinueTask);
+      if(n==0)
+      {
+        if(s->ContinueTask)
+          AddTask(s->ContinueTask);
+        if(Manager->IdleEvent.HasWaiters())  // someone might sleep in sStsManager::Sync()
+          Manager->IdleEvent.Notify(1);
+      }
     }
   }
 }
 
-sBool sStsThread::Execute()
+void sStsThread::RunTask(sStsTask *t)
 {
-  sStsWorkload *wl;
-
-  // grab next task
-
-  sBool fail = 1;
-  int start=0;
-  int end=0;
-  void *data=0;
-  sStsCode code=0;
-  sStsTask *killtask = 0;
-  int count = 0;
-  sStsQueue *qu = 0;
-  sBool TryDeleteWorkload = 0;
-  WorkloadReadLock.Lock();
-  sFORALL_LIST(Manager->ActiveWorkloads,wl)
+  sStsWorkload *wl = t->Workload;
+  sStsQueue *qu = wl->Queues[Index];
+  sStsThread **current = sGetTls<sStsThread *>(CurrentThreadTls);
+  sStsThread *oldthread = *current;
+  sStsTask *oldtask = CurrentTask;
+  int oldlimit = PriorityLimit;
+  *current = this;
+  CurrentTask = t;
+  PriorityLimit = sMin(PriorityLimit,wl->Priority);
+
+  while(t->Start<t->End)
   {
-    qu = wl->Queues[Index];
-    Lock->Lock();
-
-    // sometimes we have empty tasks in pipe. flush them!
-
-    while(qu->TaskCount>0)
+    if(wl->Canceled)              // drop what is left, the syncs still count down
     {
-      sStsTask *task;
-      task = qu->Tasks[qu->TaskCount-1];
-      if(task->Start<task->End)
-        break;
-      sVERIFY(task->Start==task->End);
-      qu->TaskCount--;
-      sAtomicDec(&wl->TasksLeft);
-      sAtomicDec(&Manager->TotalTasksLeft);
+      t->Start = t->End;
+      break;
     }
-    if(wl->TasksLeft==0 && wl->TasksRunning==0)
-      TryDeleteWorkload = 1;
 
-    // get next subtasks
+    // lazy splitting: only offer the upper half when everything we offered
+    // before has been taken. the thieves take from the top, so they get the
+    // biggest pieces. a range nobody steals from is never split.
 
-    if(qu->TaskCount>0)
+    int n = t->End-t->Start;
+    int g = t->Granularity;
+    if(n>g && n>t->EndGame && Manager->ThreadCount>1 && qu->GetCount()==0)
     {
-      sStsTask *t = qu->Tasks[qu->TaskCount-1];
-      start = t->Start;
-      end = t->End;
-      data = t->Data;
-      code = t->Code;
-      count = sMin(end-start,t->Granularity);
-      sVERIFY(count>0);
-      t->Start+=count;
-      if(t->Start==t->End)
-        killtask = t;
-      qu->SubTaskCount-=count;
-      qu->DontSteal = (qu->TaskCount==1) && (t->End-t->Start <= t->EndGame);
-      sAtomicInc(&wl->TasksRunning);
+      int m = t->Start + (n/2+g-1)/g*g;
+      if(m<t->End)
+      {
+        sStsTask *nt = wl->NewTask(t->Code,t->Data,0,t->SyncCount);
+        nt->Granularity = t->Granularity;
+        nt->EndGame = t->EndGame;
+        nt->Start = m;
+        nt->End = t->End;
+        t->End = m;
+        for(int i=0;i<t->SyncCount;i++)
+        {
+          nt->Syncs[i] = t->Syncs[i];
+          if(nt->Syncs[i])
+            sAtomicInc(&nt->Syncs[i]->Count);
+        }
+        sAtomicInc(&wl->TasksLeft); // count the new task before anyone can finish the old one
+        Push(qu,nt);                // can't fail, the queue is empty
+      }
     }
 
-    Lock->Unlock();
-    if(code)
+    // work one piece
+
+    int start = t->Start;
+    int count = sMin(t->End-start,g);
+    t->Start += count;
+    (*t->Code)(Manager,this,start,count,t->Data);
+    qu->ExeCount++;
+  }
+
+  *current = oldthread;
+  CurrentTask = oldtask;
+  PriorityLimit = oldlimit;
+  DecreaseSync(t);
+  sAtomicDec(&wl->TasksLeft);
+}
+
+sStsThread *sStsGetCurrentThread()
+{
+  return *sGetTls<sStsThread *>(CurrentThreadTls);
+}
+
+sBool sStsThread::Execute()
+{
+  sStsWorkload *wl;
+  sStsTask *task = 0;
+  sBool TryDeleteWorkload = 0;
+
+  // grab next task from our own queues. the list is sorted by priority
+
+  WorkloadReadLock.Lock();
+  sFORALL_LIST(Manager->ActiveWorkloads,wl)
+  {
+    if(wl->Priority>PriorityLimit)
+      break;
+    task = wl->Queues[Index]->Pop();
+    if(task)
       break;
+    if(wl->TasksLeft==0)
+      TryDeleteWorkload = 1;
   }
   WorkloadReadLock.Unlock();
+
   if(TryDeleteWorkload)
   {
     sStsWorkload *wl0;
+    sBool finished = 0;
     Manager->WorkloadWriteLock();
 retry:
     sFORALL_LIST(Manager->ActiveWorkloads,wl0)
     {
-      if(wl0->TasksLeft==0 && wl0->TasksRunning==0)
+      if(wl0->TasksLeft==0)
       {
         Manager->ActiveWorkloads.Rem(wl0);
         sVERIFY(wl0->Mode==sSWM_RUNNING);
@@ -294,29 +443,70 @@ retry:
         wl0->SpinCount = StatSpin; StatSpin = 0;
         wl0->FailedLockCount = StatLock; StatLock = 0;
         for(int i=0;i<wl0->ThreadCount;i++)
+        {
           wl0->ExeCount += wl0->Queues[i]->ExeCount;
+          wl0->StealCount += wl0->Queues[i]->StealCount;
+          wl0->FailedStealCount += wl0->Queues[i]->FailedStealCount;
+        }
+        finished = 1;
         goto retry;
       }
     }
     Manager->WorkloadWriteUnlock();
+    if(finished)                  // wake master waiting in SyncWorkload()
+      Manager->IdleEvent.Notify(1);
   }
-  if(code)                        // execute subtask
+
+  // nothing found. Steal some!
+
+  if(!task)
+    task = Manager->StealTasks(Index);
+
+  if(task)                        // execute task. the workload can't finish while we hold it
   {
-    (*code)(Manager,this,start,count,data);
-    if(killtask)
-      DecreaseSync(killtask);
-    qu->ExeCount++;
-    sAtomicDec(&wl->TasksRunning);
-    fail = 0;
+    RunTask(task);
+    return 0;
+  }
+
+  return 1;
+}
+
+void sStsThread::Idle(uint64_t &spinstart,sBool (*done)(void *),void *user)
+{
+  uint64_t now = sGetTimeUS();
+  if(spinstart==0)
+    spinstart = now;
+  if(now-spinstart<uint64_t(Manager->SpinTime))
+  {
+    sSpin();                      // nothing found for a short while. spin a bit
+    return;
   }
-  else                            // nothing found. Steal some!
+
+  // spun long enough. announce that we are going to sleep and look again,
+  // everything that happens after this will wake us.
+
+  sStsEventCount *ev = &Manager->IdleEvent;
+  uint32_t key = ev->PrepareWait();
+  if((done && (*done)(user)) || (Thread && !Thread->CheckTerminate()) || !Execute())
   {
-    if(Manager->StealTasks(Index)==0)
+    ev->CancelWait();
+  }
+  else
+  {
+    if(sSchedMon)
     {
-      sSpin();                    // still nothing found. spin a bit
+      sSchedMon->Add(Index,sSPE_SPIN,uint32_t(now-spinstart));
+      sSchedMon->Add(Index,sSPE_SLEEP,0);
     }
+    uint64_t latency = ev->Wait(key);
+    if(sSchedMon) sSchedMon->Add(Index,sSPE_WAKE,0);
+    int bucket = 0;
+    while(bucket<15 && latency>=(uint64_t(1)<<bucket))
+      bucket++;
+    sAtomicInc(&Manager->WakeCount);
+    sAtomicInc(&Manager->WakeLatency[bucket]);
   }
-  return fail;
+  spinstart = 0;
 }
 
 /****************************************************************************/
@@ -329,47 +519,59 @@ sStsWorkload::sStsWorkload(sStsManager *mng)
 {
   Manager = mng;
 
-  const int memory = mng->ConfigPoolMem;
-  Mem = new uint8_t[memory];
-  MemUsed = sPtr(Mem);
-  MemEnd = MemUsed+memory;
+  ArenaCount = mng->NodeCount;
+  ArenaSize = mng->ConfigPoolMem;
+  Arenas = new Arena[ArenaCount];
+  for(int i=0;i<ArenaCount;i++)
+  {
+    Arenas[i].Mem = (uint8_t *) sAllocNodeMem(ArenaSize,mng->NodeIds[i]);
+    Arenas[i].Used = sPtr(Arenas[i].Mem);
+    Arenas[i].End = Arenas[i].Used+ArenaSize;
+  }
 
   ThreadCount = mng->GetThreadCount();
   Queues = new sStsQueue *[ThreadCount];
   for(int i=0;i<ThreadCount;i++)
   {
     Queues[i] = new sStsQueue;
-    Queues[i]->Tasks = new sStsTask*[mng->ConfigMaxTasks];
-    Queues[i]->TaskMax = mng->ConfigMaxTasks;
-    Queues[i]->TaskCount = 0;
-    Queues[i]->SubTaskCount = 0;
-    Queues[i]->DontSteal = 0;
-    Queues[i]->ExeCount = 0;
+    Queues[i]->Init(mng->ConfigMaxTasks);
   }
   Tasks.HintSize(4096);
   TasksLeft = 0;
-  TasksRunning = 0;
 }
 
 sStsWorkload::~sStsWorkload()
 {
   for(int i=0;i<ThreadCount;i++)
   {
-    delete[] Queues[i]->Tasks;
+    Queues[i]->Exit();
     delete Queues[i];
   }
   delete[] Queues;
-  delete[] Mem;
+  for(int i=0;i<ArenaCount;i++)
+    sFreeNodeMem(Arenas[i].Mem,ArenaSize);
+  delete[] Arenas;
 }
 
-uint8_t *sStsWorkload::AllocBytes(int bytes)
+uint8_t *sStsWorkload::AllocBytes(int bytes,int align)
 {
-  bytes = sAlign(bytes,4);
-  sPtr r = sAtomicAdd(&MemUsed,bytes);
-  if(r>MemEnd)
-    sFatal(L"out of sts memory");
-  sVERIFY(((r-bytes)&3)==0);
-  return (uint8_t *)sPtr(r-bytes);
+  align = sMax(align,4);
+  bytes = sAlign(bytes,4)+align-4;  // the arenas are only 4 byte aligned
+
+  // outside of tasks we are on the master thread. when the local arena is
+  // exhausted, try the other nodes before giving up.
+
+  sStsThread *th = sStsGetCurrentThread();
+  int node = (th && th->Manager==Manager) ? th->Node : Manager->Threads[0]->Node;
+  for(int i=0;i<ArenaCount;i++)
+  {
+    Arena *a = &Arenas[(node+i)%ArenaCount];
+    sPtr r = sAtomicAdd(&a->Used,bytes);
+    if(r<=a->End)
+      return (uint8_t *)sAlign(r-bytes,align);
+  }
+  sFatal(L"out of sts memory");
+  return 0;
 }
 
 /****************************************************************************/
@@ -417,11 +619,14 @@ const sChar *sStsWorkload::PrintStat()
 sStsManager::sStsManager(int memory,int taskqueuelength,int maxcore)
 {
   Running = 0;
-  TotalTasksLeft = 0;
   ActiveWorkloadCount = 0;
+  SpinTime = 50;
+  ResetWakeStat();
 
   ConfigPoolMem = memory;
   ConfigMaxTasks = taskqueuelength;
+  if(CurrentThreadTls==0)
+    CurrentThreadTls = sAllocTls(sizeof(sStsThread *),sizeof(void *));
 
 //  Mem = new uint8_t[memory];
 //  MemUsed = sPtr(Mem);
@@ -433,10 +638,14 @@ sStsManager::sStsManager(int memory,int taskqueuelength,int maxcore)
   if(maxcore<0)
     ThreadCount = sMax(1,ThreadCount+maxcore);
 
-  ThreadBits = sFindHigherPower(ThreadCount);
+  sCpuTopology *home = new sCpuTopology[ThreadCount];
+  PlaceThreads(home);
   Threads = new sStsThread *[ThreadCount];
   for(int i=0;i<ThreadCount;i++)
-    Threads[i] = new sStsThread(this,i,taskqueuelength,i>0);
+    Threads[i] = new sStsThread(this,i,home[i].Cpu,home[i].Node,i>0);
+  for(int i=0;i<ThreadCount;i++)
+    SortStealOrder(Threads[i],home);
+  delete[] home;
 
   Start();
 }
@@ -451,12 +660,88 @@ sStsManager::~sStsManager()
   for(int i=0;i<ThreadCount;i++)
     delete Threads[i];
   delete[] Threads;
+  delete[] NodeIds;
   delete sSchedMon;
 }
 
 /****************************************************************************/
 
-sStsWorkload *sStsManager::BeginWorkload()
+static sBool PlaceBefore(const sCpuTopology &a,const sCpuTopology &b)
+{
+  if(a.Sibling!=b.Sibling) return a.Sibling<b.Sibling;   // one thread per core first
+  if(a.Node!=b.Node) return a.Node<b.Node;               // fill one node before the next
+  if(a.Package!=b.Package) return a.Package<b.Package;
+  if(a.L3!=b.L3) return a.L3<b.L3;
+  if(a.L2!=b.L2) return a.L2<b.L2;
+  return a.Cpu<b.Cpu;
+}
+
+void sStsManager::PlaceThreads(sCpuTopology *home)
+{
+  int cpucount = sMax(sGetCPUCount(),1);
+  sCpuTopology *cpus = new sCpuTopology[cpucount];
+  cpucount = sMax(sGetCpuTopology(cpus,cpucount),1);
+
+  for(int i=1;i<cpucount;i++)     // insertion sort, just a few cpus
+  {
+    sCpuTopology c = cpus[i];
+    int j = i;
+    while(j>0 && PlaceBefore(c,cpus[j-1]))
+    {
+      cpus[j] = cpus[j-1];
+      j--;
+    }
+    cpus[j] = c;
+  }
+  for(int i=0;i<ThreadCount;i++)
+    home[i] = cpus[i%cpucount];
+  delete[] cpus;
+
+  // number the nodes we actually use
+
+  NodeIds = new int[ThreadCount];
+  NodeCount = 0;
+  for(int i=0;i<ThreadCount;i++)
+  {
+    int n = 0;
+    while(n<NodeCount && NodeIds[n]!=home[i].Node)
+      n++;
+    if(n==NodeCount)
+      NodeIds[NodeCount++] = home[i].Node;
+    home[i].Node = n;
+  }
+}
+
+void sStsManager::SortStealOrder(sStsThread *th,sCpuTopology *home)
+{
+  // group the victims by distance, starting with the thread after us in
+  // each group so the thieves spread over the victims.
+
+  const sCpuTopology &me = home[th->Index];
+  int n = 0;
+  for(int d=0;d<4;d++)
+  {
+    for(int i=1;i<ThreadCount;i++)
+    {
+      int t = (th->Index+i)%ThreadCount;
+      const sCpuTopology &v = home[t];
+      int dist = 3;
+      if(v.Node==me.Node)
+        dist = 2;
+      if(v.Node==me.Node && v.Package==me.Package && v.L3==me.L3)
+        dist = 1;
+      if(dist==1 && v.L2==me.L2)
+        dist = 0;
+      if(dist==d)
+        th->StealOrder[n++] = t;
+    }
+    th->StealGroups[d] = n;
+  }
+}
+
+/****************************************************************************/
+
+sStsWorkload *sStsManager::BeginWorkload(int priority)
 {
   if(FreeWorkloads.IsEmpty())
   {
@@ -464,15 +749,17 @@ sStsWorkload *sStsManager::BeginWorkload()
   }
   sStsWorkload *wl = FreeWorkloads.RemTail();
   wl->TasksLeft = 0;
-  wl->TasksRunning = 0;
   wl->Mode = sSWM_READY;
+  wl->Priority = sClamp<int>(priority,0,sSP_MAX-1);
+  wl->Canceled = 0;
   wl->StealCount = 0;
   wl->SpinCount = 0;
   wl->ExeCount = 0;
   wl->FailedLockCount = 0;
   wl->FailedStealCount = 0;
 
-  wl->MemUsed = sPtr(wl->Mem);
+  for(int i=0;i<wl->ArenaCount;i++)
+    wl->Arenas[i].Used = sPtr(wl->Arenas[i].Mem);
 
   return wl;
 }
@@ -481,40 +768,47 @@ void sStsManager::StartWorkload(sStsWorkload *wl)
 {
   for(int i=0;i<wl->ThreadCount;i++)
   {
-    sStsQueue *qu = wl->Queues[i];
-
-    qu->DontSteal = 0;
-    qu->ExeCount = 0;
+    wl->Queues[i]->ResetStats();
   }
   sVERIFY(wl->Mode==sSWM_READY);
   wl->Mode = sSWM_RUNNING;
 
+  sStsWorkload *ref = 0;
+  sStsWorkload *w;
   WorkloadWriteLock();
-  ActiveWorkloads.AddTail(wl);
+  sFORALL_LIST(ActiveWorkloads,w)   // behind all workloads of the same priority
+  {
+    if(w->Priority>wl->Priority)
+    {
+      ref = w;
+      break;
+    }
+  }
+  if(ref)
+    ActiveWorkloads.AddBefore(wl,ref);
+  else
+    ActiveWorkloads.AddTail(wl);
   WorkloadWriteUnlock();
-  for(int i=1;i<ThreadCount;i++)
-    Threads[i]->Event->Signal();
+  IdleEvent.Notify(1);
 }
 
 void sStsManager::SyncWorkload(sStsWorkload *wl)
 {
+  // don't pick up less urgent work while someone waits for this one
+
+  sStsThread *th = Threads[0];
+  int oldlimit = th->PriorityLimit;
+  th->PriorityLimit = sMin(oldlimit,wl->Priority);
+
+  uint64_t spinstart = 0;
   while(wl->Mode==sSWM_RUNNING)
   {
-    int failcount = 0;
-    if(Threads[0]->Execute())
-    {
-      failcount++;
-      if(failcount>10)
-      {
-        failcount = 0;
-        sSleep(0);
-      }
-    }
+    if(th->Execute())
+      th->Idle(spinstart,IsWorkloadDone,wl);
     else
-    {
-      failcount = 0;
-    }
+      spinstart = 0;
   }
+  th->PriorityLimit = oldlimit;
 }
 
 sBool sStsManager::HelpWorkload(sStsWorkload *wl)
@@ -532,13 +826,23 @@ sBool sStsManager::HelpWorkload(sStsWorkload *wl)
 }
 void sStsManager::EndWorkload(sStsWorkload *wl)
 {
+  if(wl->Canceled)                // the queued tasks finish without doing anything
+  {
+    if(wl->Mode==sSWM_READY)
+      StartWorkload(wl);
+    SyncWorkload(wl);
+  }
   sVERIFY(wl->Mode==sSWM_FINISHED);
   wl->Mode = sSWM_IDLE;
   sVERIFY(wl->TasksLeft==0);
-  sVERIFY(wl->TasksRunning==0);
   FreeWorkloads.AddTail(wl);
 }
 
+void sStsManager::CancelWorkload(sStsWorkload *wl)
+{
+  wl->Canceled = 1;
+}
+
 /****************************************************************************/
 /*
 sStsSync *sStsManager::NewSync()
@@ -588,8 +892,7 @@ void sStsManager::Start()
   // run! but not thread[0]
 
   Running = 1;
-  for(int i=1;i<ThreadCount;i++)
-    Threads[i]->Event->Signal();
+  IdleEvent.Notify(1);
 }
 
 
@@ -624,13 +927,17 @@ void sStsManager::Finish()
 
 //  Threads[0]->Running=1;
   sBool x=0;
+  uint64_t spinstart = 0;
   for(;;)
   {
     Threads[0]->WorkloadReadLock.Lock();
     x = ActiveWorkloads.IsEmpty();
     Threads[0]->WorkloadReadLock.Unlock();
     if(x) break;
-    Threads[0]->Execute();
+    if(Threads[0]->Execute())
+      Threads[0]->Idle(spinstart,IsAllDone,this);
+    else
+      spinstart = 0;
   }
 
   // check if we have finished successfully
@@ -658,19 +965,7 @@ void sStsManager::Finish()
   sVERIFY(TotalTasksLeft==0);
 */
 
-  while(TotalTasksLeft>0)
-    sSpin();
-
-  // check if it's really safe
-/*
-  for(int i=0;i<ThreadCount;i++)
-  {
-    Threads[i]->Lock->Lock();
-    sVERIFY(Threads[i]->Running==2);
-    Threads[i]->Lock->Unlock();
-  }
-*/
-  sVERIFY(TotalTasksLeft == 0);
+  // no active workloads means no tasks are left in any queue
 
   // release threads
 /*
@@ -687,8 +982,49 @@ void sStsManager::Finish()
 
 void sStsManager::Sync(sStsSync *sync)
 {
+  uint64_t spinstart = 0;
   while(sync->Count>0)
-    Threads[0]->Execute();
+  {
+    if(Threads[0]->Execute())
+      Threads[0]->Idle(spinstart,IsSyncDone,sync);
+    else
+      spinstart = 0;
+  }
+}
+
+sBool sStsManager::IsWorkloadDone(void *user)
+{
+  return ((sStsWorkload *)user)->Mode!=sSWM_RUNNING;
+}
+
+sBool sStsManager::IsSyncDone(void *user)
+{
+  return ((sStsSync *)user)->Count==0;
+}
+
+sBool sStsManager::IsAllDone(void *user)
+{
+  return ((sStsManager *)user)->ActiveWorkloadCount==0;
+}
+
+/****************************************************************************/
+
+void sStsManager::ResetWakeStat()
+{
+  WakeCount = 0;
+  sClear(WakeLatency);
+}
+
+const sChar *sStsManager::PrintWakeStat()
+{
+  WakeStatBuffer.PrintF(L"wakeups %d, latency",WakeCount);
+  for(int i=0;i<sCOUNTOF(WakeLatency);i++)
+  {
+    if(WakeLatency[i])
+      WakeStatBuffer.PrintAddF(L" <%dus:%d",1<<i,WakeLatency[i]);
+  }
+  WakeStatBuffer.PrintAddF(L"\n");
+  return WakeStatBuffer;
 }
 
 /****************************************************************************/
@@ -703,192 +1039,372 @@ uint8_t *sStsManager::AllocBytes(int bytes)
   return (uint8_t *)sPtr(r-bytes);
 }
 */
-sBool sStsManager::StealTasks(int to)
+sStsTask *sStsManager::StealTasks(int to)
 {
-  int bestt=-1;
-  int bestn=0;
-  sStsWorkload *bestwl;
-
+  sStsTask *task = 0;
   sStsWorkload *wl;
-  Threads[to]->WorkloadReadLock.Lock();
+  sStsThread *th = Threads[to];
+  th->WorkloadReadLock.Lock();
   sFORALL_LIST(ActiveWorkloads,wl)
   {
-    for(int i=0;i<ThreadBits;i++)  // test a few carefully selected threads, find the best
+    if(wl->Priority>th->PriorityLimit)
+      break;
+    sStsQueue *qt = wl->Queues[to];
+    for(;;)
     {
-      int t = to^(1<<i);
-      if(t<ThreadCount)
+      // take the fullest queue among the nearest threads that have work.
+      // the counts are read without synchronisation, they are only a hint.
+
+      int bestt = -1;
+      int bestn = 0;
+      int first = 0;
+      for(int d=0;d<4 && bestn==0;d++)
       {
-        sStsQueue *qu = wl->Queues[t];
-        int n = qu->SubTaskCount;
-        sVERIFY(n>=0);
-        if(n>bestn && qu->DontSteal==0)
+        for(int i=first;i<th->StealGroups[d];i++)
         {
-          bestn = n;
-          bestt = t;
-          bestwl = wl;
+          int t = th->StealOrder[i];
+          int n = wl->Queues[t]->GetCount();
+          if(n>bestn)
+          {
+            bestn = n;
+            bestt = t;
+          }
         }
+        first = th->StealGroups[d];
       }
-    }
+      if(bestn==0)                  // this workload is drained
+        break;
 
-    if(bestn==0)                    // nothing found. try harder, check everyone!
-    {
-      for(int i=0;i<ThreadCount;i++)
+      sBool abort;
+      task = wl->Queues[bestt]->Steal(abort);
+      if(task)
       {
-        sStsQueue *qu = wl->Queues[i];
-        int n = qu->SubTaskCount;
-        sVERIFY(n>=0);
-        if(n>bestn && qu->DontSteal==0)
-        {
-          bestn = n;
-          bestt = i;
-          bestwl = wl;
-        }
+        qt->StealCount++;
+        if(sSchedMon) sSchedMon->Add(to,sSPE_STEAL,bestt);
+        break;
       }
+      qt->FailedStealCount++;
+      if(!abort)                    // someone else emptied it, look at the next workload
+        break;
     }
-    if(bestn>0)
+    if(task)
       break;
   }
-  Threads[to]->WorkloadReadLock.Unlock();
+  th->WorkloadReadLock.Unlock();
 
-  if(bestn==0)                    // still nothing found. could be someoneelse is stealing just now
-    return 0;
+  return task;
+}
 
-  if(bestt==to)                   // don't steal from ourself
-    return 0;
+void sStsManager::WorkloadWriteLock()
+{
+  for(int i=0;i<ThreadCount;i++)
+    Threads[i]->WorkloadReadLock.Lock();
+}
+void sStsManager::WorkloadWriteUnlock()
+{
+  ActiveWorkloadCount = ActiveWorkloads.GetCount();
+  for(int i=ThreadCount-1;i>=0;i--)
+    Threads[i]->WorkloadReadLock.Unlock();
+}
 
-  wl = bestwl;
+/****************************************************************************/
+/***                                                                      ***/
+/***   Parallel algorithms                                                ***/
+/***                                                                      ***/
+/****************************************************************************/
 
-  // found something. maybe it's already gone, whe have not locked!
+sStsScope::sStsScope(sStsManager *m)
+{
+  Manager = m;
+  Thread = sStsGetCurrentThread();
+  if(Thread && Thread->Manager==m)
+  {
+    Workload = Thread->CurrentTask->Workload;
+  }
+  else
+  {
+    Thread = 0;
+    Workload = m->BeginWorkload();
+  }
+}
 
-  // now we lock and steal
+sStsScope::~sStsScope()
+{
+  if(!Thread)
+    Manager->EndWorkload(Workload);
+}
 
-  sStsThread *th = Threads[bestt];
-  sStsQueue *qu = wl->Queues[bestt];
-  sStsQueue *qt = wl->Queues[to];
-  th->Lock->Lock();
+sStsTask *sStsScope::NewTask(sStsCode code,void *data,int subtasks,int granularity)
+{
+  sStsTask *t = Workload->NewTask(code,data,subtasks,Thread ? 1 : 0);
+  t->Granularity = granularity;
+  t->EndGame = granularity;
+  return t;
+}
 
-  // sometimes we have empty tasks in pipe. flush them!
-/*
-  while(qu->TaskCount>0)
+void sStsScope::Run(sStsTask *t)
+{
+  if(Thread)
   {
-    sStsTask *task;
-    task = qu->Tasks[qu->TaskCount-1];
-    if(task->Start<task->End)
-      break;
-    sVERIFY(task->Start==task->End);
-    qu->TaskCount--;
-    th->DecreaseSync(task);
-    sAtomicDec(&wl->TasksLeft);
-    sAtomicDec(&TotalTasksLeft);
-  }
-*/
-  // get a task for real
+    // nested: the workload is already running. wait on a sync and keep
+    // working in the meantime, probably on our own task.
 
-  int n = qu->TaskCount;
-  sAtomicInc(&wl->StealCount);
+    sStsSync *sync = Workload->Alloc<sStsSync>();
+    sync->Count = 0;
+    sync->ContinueTask = 0;
+    Manager->AddSync(t,sync);
+    Thread->AddTask(t);
 
-  if(n>3 && qu->DontSteal==0)               // lots of tasks, be careless
+    uint64_t spinstart = 0;
+    while(sync->Count>0)
+    {
+      if(Thread->Execute())
+        Thread->Idle(spinstart,sStsManager::IsSyncDone,sync);
+      else
+        spinstart = 0;
+    }
+  }
+  else
   {
-    // remove tasks, copy them to buffer
+    if(Workload->Mode==sSWM_FINISHED)  // run again, keep the memory
+      Workload->Mode = sSWM_READY;
+    Workload->AddTask(t);
+    Manager->StartWorkload(Workload);
+    Manager->SyncWorkload(Workload);
+  }
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Task graph                                                         ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+sStsGraph::sStsGraph()
+{
+  CriticalPath = 0;
+  Dirty = 0;
+}
 
-    n = sMin(n/2,qt->TaskMax - qt->TaskCount);
-    int subtasks = 0;
-    sStsTask **list = sALLOCSTACK(sStsTask *,n);
-    for(int i=0;i<n;i++)
+sStsGraph::~sStsGraph()
+{
+}
+
+void sStsGraph::Clear()
+{
+  Nodes.Clear();
+  EdgeFrom.Clear();
+  EdgeTo.Clear();
+  Succs.Clear();
+  Roots.Clear();
+  CriticalPath = 0;
+  Dirty = 0;
+}
+
+int sStsGraph::AddNode(sStsCode code,void *data,int subtasks,int granularity,int cost)
+{
+  Node *n = Nodes.AddMany(1);
+  n->Code = code;
+  n->Data = data;
+  n->Subtasks = subtasks;
+  n->Granularity = sMax(granularity,1);
+  n->Cost = cost;
+  n->Rank = 0;
+  n->PredCount = 0;
+  n->SuccFirst = 0;
+  n->SuccCount = 0;
+  Dirty = 1;
+  return Nodes.GetCount()-1;
+}
+
+void sStsGraph::AddEdge(int before,int after)
+{
+  sVERIFY(Nodes.IsIndexValid(before) && Nodes.IsIndexValid(after));
+  sVERIFY(before!=after);
+  EdgeFrom.AddTail(before);
+  EdgeTo.AddTail(after);
+  Dirty = 1;
+}
+
+void sStsGraph::SetSubtasks(int node,int subtasks)
+{
+  Nodes[node].Subtasks = subtasks;
+  if(Nodes[node].Cost<0)          // the ranks depend on it
+    Dirty = 1;
+}
+
+int sStsGraph::GetCriticalPath()
+{
+  if(Dirty)
+    Prepare();
+  return CriticalPath;
+}
+
+void sStsGraph::SortByRank(int *list,int count)
+{
+  for(int i=1;i<count;i++)        // insertion sort, the lists are short
+  {
+    int v = list[i];
+    int j = i;
+    while(j>0 && Nodes[list[j-1]].Rank>Nodes[v].Rank)
     {
-      list[i] = qu->Tasks[qu->TaskCount-n+i];
-      subtasks += list[i]->End - list[i]->Start;
+      list[j] = list[j-1];
+      j--;
     }
+    list[j] = v;
+  }
+}
 
-    qu->SubTaskCount -= subtasks;
-    qu->TaskCount -= n;
-    th->Lock->Unlock();
+void sStsGraph::Prepare()
+{
+  const int nc = Nodes.GetCount();
+  const int ec = EdgeFrom.GetCount();
 
-    // add tasks to new thread.
-    // make sure not to lock two threads at the same time (deadlocks)
+  // successor lists, sorted by source node
 
-    Threads[to]->Lock->Lock();
-    sVERIFY(qt->TaskCount + n <= qt->TaskMax);
-    for(int i=0;i<n;i++)
-      qt->Tasks[qt->TaskCount + i] = list[i];
-    qt->TaskCount += n;
-    qt->SubTaskCount += subtasks;
-    Threads[to]->Lock->Unlock();
-    return 1;
+  Node *n;
+  sFORALL(Nodes,n)
+  {
+    n->PredCount = 0;
+    n->SuccCount = 0;
+  }
+  for(int i=0;i<ec;i++)
+  {
+    Nodes[EdgeFrom[i]].SuccCount++;
+    Nodes[EdgeTo[i]].PredCount++;
+  }
+  int first = 0;
+  sFORALL(Nodes,n)
+  {
+    n->SuccFirst = first;
+    first += n->SuccCount;
+    n->SuccCount = 0;
   }
+  Succs.Clear();
+  Succs.AddMany(ec);
+  for(int i=0;i<ec;i++)
+  {
+    Node *from = &Nodes[EdgeFrom[i]];
+    Succs[from->SuccFirst+from->SuccCount++] = EdgeTo[i];
+  }
+
+  // topological order (kahn)
 
-  if(n>=1 && qu->DontSteal==0)                   // few tasks, split subtasks
+  sArray<int> order;
+  sArray<int> pending;
+  order.HintSize(nc);
+  pending.AddMany(nc);
+  for(int i=0;i<nc;i++)
   {
-    sStsTask  *task = qu->Tasks[n-1];
-    if(task->End-task->Start>1)   // we have subtasks! split range
-    {
-      int d = (task->End-task->Start)/2;
-      int m = task->End - d;
-      sStsTask *nt = wl->NewTask(task->Code,task->Data,0,task->SyncCount);
-      nt->Granularity = task->Granularity;
-      nt->EndGame = task->EndGame;
-      nt->Start = m;
-      nt->End = task->End;
-      task->End = m;
-      if(n==1) qu->DontSteal = task->End-task->Start <= task->EndGame;
-
-      for(int i=0;i<task->SyncCount;i++)
-      {
-        nt->Syncs[i] = task->Syncs[i];
-        sAtomicInc(&nt->Syncs[i]->Count);
-      }
-      qu->SubTaskCount -= d;
-      sVERIFY(wl->TasksLeft>0);
-      sAtomicInc(&wl->TasksLeft);  // count the new tasks before someone can finish old task (in case it't the last task)
-      sAtomicInc(&TotalTasksLeft);
-      th->Lock->Unlock();
-
-      // add task
-
-      Threads[to]->Lock->Lock();
-      sVERIFY(qt->TaskCount<qt->TaskMax);
-      qt->Tasks[qt->TaskCount++] = nt;
-      qt->SubTaskCount += d;
-      qt->DontSteal = nt->End-nt->Start <= nt->EndGame;
-      Threads[to]->Lock->Unlock();
-      return 1;
-    }
-    if(task->End-task->Start==1)    // only one subtask, move task
+    pending[i] = Nodes[i].PredCount;
+    if(pending[i]==0)
+      order.AddTail(i);
+  }
+  for(int i=0;i<order.GetCount();i++)
+  {
+    n = &Nodes[order[i]];
+    for(int j=0;j<n->SuccCount;j++)
     {
-      qu->TaskCount--;
-      qu->SubTaskCount--;
-      th->Lock->Unlock();
-
-      // add task
-
-      Threads[to]->Lock->Lock();
-      sVERIFY(qt->TaskCount<qt->TaskMax);
-      qt->Tasks[qt->TaskCount++] = task;
-      qt->SubTaskCount++;
-      qt->DontSteal = 1;          // protect this one subtask from getting stolen
-      Threads[to]->Lock->Unlock();
-      return 1;
+      int s = Succs[n->SuccFirst+j];
+      if(--pending[s]==0)
+        order.AddTail(s);
     }
   }
+  if(order.GetCount()!=nc)
+    sFatal(L"sStsGraph: the graph has a cycle");
 
-  // all paths above do "return 1";
+  // ranks, from the end of the graph backwards
 
-  th->Lock->Unlock();
-  sAtomicInc(&wl->FailedStealCount);
-  sAtomicDec(&wl->StealCount);
-  return 0;
+  CriticalPath = 0;
+  for(int i=nc-1;i>=0;i--)
+  {
+    n = &Nodes[order[i]];
+    int rank = 0;
+    for(int j=0;j<n->SuccCount;j++)
+      rank = sMax(rank,Nodes[Succs[n->SuccFirst+j]].Rank);
+    n->Rank = rank + (n->Cost>=0 ? n->Cost : n->Subtasks);
+    CriticalPath = sMax(CriticalPath,n->Rank);
+  }
+
+  // pushing in ascending order lets the owner pop the most critical node first
+
+  Roots.Clear();
+  for(int i=0;i<nc;i++)
+  {
+    n = &Nodes[i];
+    SortByRank(Succs.GetData()+n->SuccFirst,n->SuccCount);
+    if(n->PredCount==0)
+      Roots.AddTail(i);
+  }
+  SortByRank(Roots.GetData(),Roots.GetCount());
+
+  Dirty = 0;
 }
 
-void sStsManager::WorkloadWriteLock()
+sStsTask *sStsGraph::MakeTask(sStsWorkload *wl,Launched *l,int node)
 {
-  for(int i=0;i<ThreadCount;i++)
-    Threads[i]->WorkloadReadLock.Lock();
+  Node *n = &Nodes[node];
+
+  // the sync reaches zero when all pieces of the node are done, its
+  // continue task then releases the successors.
+
+  sStsTask *release = wl->NewTask(ReleaseCode,l,0,0);
+  release->Start = node;
+  release->End = node+1;
+
+  sStsSync *sync = wl->Alloc<sStsSync>();
+  sync->Count = 1;
+  sync->ContinueTask = release;
+
+  sStsTask *t = wl->NewTask(n->Code,n->Data,n->Subtasks,1);
+  t->Granularity = n->Granularity;
+  t->EndGame = n->Granularity;
+  t->Syncs[0] = sync;
+  return t;
 }
-void sStsManager::WorkloadWriteUnlock()
+
+void sStsGraph::ReleaseCode(sStsManager *,sStsThread *th,int start,int,void *data)
 {
-  ActiveWorkloadCount = ActiveWorkloads.GetCount();
-  for(int i=ThreadCount-1;i>=0;i--)
-    Threads[i]->WorkloadReadLock.Unlock();
+  Launched *l = (Launched *) data;
+  sStsGraph *g = l->Graph;
+  Node *n = &g->Nodes[start];
+  for(int i=0;i<n->SuccCount;i++)
+  {
+    int s = g->Succs[n->SuccFirst+i];
+    if(sAtomicDec(&l->Pending[s])==0)
+      th->AddTask(g->MakeTask(l->Workload,l,s));
+  }
+}
+
+void sStsGraph::Launch(sStsWorkload *wl,sStsThread *th)
+{
+  if(Dirty)
+    Prepare();
+
+  Launched *l = wl->Alloc<Launched>();
+  l->Graph = this;
+  l->Workload = wl;
+  l->Pending = wl->Alloc<uint32_t>(Nodes.GetCount());
+  for(int i=0;i<Nodes.GetCount();i++)
+    l->Pending[i] = Nodes[i].PredCount;
+
+  for(int i=0;i<Roots.GetCount();i++)
+  {
+    sStsTask *t = MakeTask(wl,l,Roots[i]);
+    if(th)
+      th->AddTask(t);
+    else
+      wl->AddTask(t);
+  }
+}
+
+void sStsGraph::Run(sStsManager *m)
+{
+  sStsWorkload *wl = m->BeginWorkload();
+  Launch(wl);
+  wl->Start();
+  wl->Sync();
+  wl->End();
 }
 
 /****************************************************************************/
@@ -897,10 +1413,27 @@ void sStsManager::WorkloadWriteUnlock()
 /***                                                                      ***/
 /****************************************************************************/
 
+uint64_t sGetTimeStampFrequency()
+{
+  static uint64_t freq = 0;
+  if(freq==0)
+  {
+    uint64_t t0 = sGetTimeUS();
+    uint64_t s0 = sGetTimeStamp();
+    sSleep(20);
+    uint64_t t1 = sGetTimeUS();
+    uint64_t s1 = sGetTimeStamp();
+    freq = sMax<uint64_t>((s1-s0)*1000000/sMax<uint64_t>(t1-t0,1),1);
+  }
+  return freq;
+}
+
+/****************************************************************************/
+
 sStsPerfMon::sStsPerfMon()
 {
   ThreadCount = sSched->GetThreadCount();
-  DataCount = 0x40000;
+  DataCount = 0x20000;
   CountMask = DataCount-1;
 
   Counters = new int *[ThreadCount];
@@ -915,6 +1448,11 @@ sStsPerfMon::sStsPerfMon()
     Datas[i] = new Entry[DataCount];
     OldDatas[i] = new Entry[DataCount];
   }
+  TimeStart = sGetTimeStamp();
+  CaptureFile = 0;
+  CaptureStart = 0;
+  CaptureEvents = 0;
+  CaptureLost = 0;
   Enable = 1;
 
   /*Geo = new sGeometry(sGF_QUADLIST,sVertexFormatBasic);
@@ -931,6 +1469,7 @@ sStsPerfMon::sStsPerfMon()
 
 sStsPerfMon::~sStsPerfMon()
 {
+  StopCapture();
   for(int i=0;i<ThreadCount;i++)
   {
     delete Counters[i];
@@ -958,7 +1497,7 @@ void sStsPerfMon::FlipFrame()
   Enable = 0;
   sWriteBarrier();
 
-  if(sGetKeyQualifier() & sKEYQ_CTRL)
+  if(!CaptureFile && (sGetKeyQualifier() & sKEYQ_CTRL))
   {
     TimeStart = sGetTimeStamp();
     for(int i=0;i<ThreadCount;i++)
@@ -981,6 +1520,107 @@ void sStsPerfMon::FlipFrame()
 
   sWriteBarrier();
   Enable = 1;
+
+  if(CaptureFile)
+    WriteCapture(OldCounters,OldDatas);
+}
+
+/****************************************************************************/
+
+sBool sStsPerfMon::StartCapture(const sChar *filename)
+{
+  StopCapture();
+  sGetTimeStampFrequency();       // calibrate now, it takes a moment
+
+  CaptureFile = sCreateFile(filename,sFA_WRITE);
+  if(!CaptureFile)
+    return 0;
+  CaptureStart = sGetTimeStamp();
+  CaptureEvents = 0;
+  CaptureLost = 0;
+
+  CaptureText.Clear();
+  CaptureText.Print(L"{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for(int i=0;i<ThreadCount;i++)
+  {
+    if(CaptureEvents++>0)
+      CaptureText.Print(L",\n");
+    CaptureText.PrintF(L"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"sts thread %d\"}}",i,i);
+  }
+  FlushCapture();
+  return 1;
+}
+
+void sStsPerfMon::StopCapture()
+{
+  if(!CaptureFile)
+    return;
+  FlipFrame();                    // write the frame in progress
+  CaptureText.PrintF(L"\n],\"otherData\":{\"lost_events\":\"%d\"}}\n",CaptureLost);
+  FlushCapture();
+  CaptureFile->Close();
+  delete CaptureFile;
+  CaptureFile = 0;
+}
+
+void sStsPerfMon::WriteCapture(int **counters,Entry **datas)
+{
+  const double scale = 1000000.0/sGetTimeStampFrequency();
+  for(int i=0;i<ThreadCount;i++)
+  {
+    int count = *counters[i];
+    int first = 0;
+    if(count>DataCount)           // the ring buffer wrapped
+    {
+      first = count-DataCount;
+      CaptureLost += first;
+    }
+    for(int j=first;j<count;j++)
+    {
+      const Entry *e = &datas[i][j&CountMask];
+      if(e->Timestamp<CaptureStart)
+        continue;
+      double ts = (e->Timestamp-CaptureStart)*scale;
+      if(CaptureEvents++>0)
+        CaptureText.Print(L",\n");
+      switch(e->Event)
+      {
+      case sSPE_BEGIN:
+        CaptureText.PrintF(L"{\"name\":\"work\",\"ph\":\"B\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"color\":\"%06x\"}}",i,ts,e->Arg&0xffffff);
+        break;
+      case sSPE_END:
+        CaptureText.PrintF(L"{\"ph\":\"E\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}",i,ts);
+        break;
+      case sSPE_STEAL:
+        CaptureText.PrintF(L"{\"name\":\"steal\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"victim\":%d}}",i,ts,e->Arg);
+        break;
+      case sSPE_SPIN:
+        CaptureText.PrintF(L"{\"name\":\"spin\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%d}",i,ts-e->Arg,e->Arg);
+        break;
+      case sSPE_SLEEP:
+        CaptureText.PrintF(L"{\"name\":\"sleep\",\"ph\":\"B\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}",i,ts);
+        break;
+      case sSPE_WAKE:
+        CaptureText.PrintF(L"{\"ph\":\"E\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}",i,ts);
+        break;
+      }
+      if(CaptureText.GetCount()>0x10000)
+        FlushCapture();
+    }
+  }
+  FlushCapture();
+}
+
+void sStsPerfMon::FlushCapture()
+{
+  int n = CaptureText.GetCount();
+  if(n==0)
+    return;
+  sChar8 *buffer = new sChar8[n+1];
+  sCopyString(buffer,CaptureText.Get(),n+1);
+  CaptureFile->Write(buffer,n);
+  delete[] buffer;
+  CaptureText.Clear();
 }
 
 /****************************************************************************/
@@ -1063,8 +1703,10 @@ void sStsPerfMon::Paint(const sTargetSpec &ts)
 
       for(int j=0;j<max;j++)
       {
-        int pos1 = (d[j].Timestamp>>(Scale))+Rects[i].x0;
-        uint32_t col1 = d[j].Color;
+        if(d[j].Event!=sSPE_BEGIN && d[j].Event!=sSPE_END)
+          continue;
+        int pos1 = ((d[j].Timestamp-OldStart)>>(Scale))+Rects[i].x0;
+        uint32_t col1 = d[j].Event==sSPE_BEGIN ? d[j].Arg : 0;
         if(col1)
           colorstack[(++colorindex)&15] = col1;
         else
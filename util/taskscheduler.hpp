@@ -9,6 +9,7 @@
 #define FILE_UTIL_TASKSCHEDULER_HPP
 
 #include "base/types.hpp"
+#include "base/types2.hpp"
 #include "base/system.hpp"
 
 /****************************************************************************/
@@ -24,6 +25,7 @@ struct sStsSync;
 class sStsThread;
 class sStsWorkload;
 class sStsManager;
+class sStsScope;
 
 /****************************************************************************/
 /***                                                                      ***/
@@ -42,6 +44,30 @@ struct sStsLock
 
 void sSpin();                     // waste some time without doing much on the bus
 
+/****************************************************************************/
+/***                                                                      ***/
+/***   Eventcount for parking idle threads. Waiters announce themselves,  ***/
+/***   check their condition again and only then go to sleep. Notify is   ***/
+/***   almost free while nobody sleeps. Uses a futex on linux.            ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+class sStsEventCount
+{
+  volatile uint32_t Epoch;        // changed by every notify that finds waiters
+  volatile uint32_t Waiters;      // threads between PrepareWait() and leaving Wait()
+  volatile uint64_t NotifyTime;   // for measuring the wakeup latency
+public:
+  sStsEventCount();
+
+  uint32_t PrepareWait();         // returns key for Wait()
+  void CancelWait();              // condition became true after PrepareWait()
+  uint64_t Wait(uint32_t key);    // sleep until notified, returns latency in us
+
+  sBool HasWaiters() { return Waiters!=0; }   // unsynchronised hint
+  void Notify(sBool all);
+};
+
 /****************************************************************************/
 /***                                                                      ***/
 /***   A task with a range of subtasks                                    ***/
@@ -77,14 +103,38 @@ struct sStsSync                   // syncro-point
 /***                                                                      ***/
 /****************************************************************************/
 
+/****************************************************************************/
+/***                                                                      ***/
+/***   Work stealing deque (Chase-Lev with a fixed ring buffer)           ***/
+/***                                                                      ***/
+/***   The owning thread pushes and pops at the bottom without atomic     ***/
+/***   operations, only taking the last task needs a CAS. Thieves take    ***/
+/***   the oldest (and usually biggest) task from the top with a CAS.     ***/
+/***                                                                      ***/
+/****************************************************************************/
+
 struct sStsQueue
 {
-  sStsTask **Tasks;
-  int TaskMax;
-  int TaskCount;
-  int SubTaskCount;
-  int ExeCount;
-  volatile sBool DontSteal;       // please don' steal my last task :-)
+  sStsTask **Tasks;               // ring buffer
+  int TaskMax;                    // power of 2
+  volatile uint32_t Bottom;       // only written by owner
+  uint32_t Pad0[15];              // keep owner and thieves on different cachelines
+  volatile uint32_t Top;          // advanced with CAS by thieves (and the owner for the last task)
+  uint32_t Pad1[15];
+
+  int ExeCount;                   // stats, only written by owner
+  int StealCount;
+  int FailedStealCount;
+
+  void Init(int max);
+  void Exit();
+  void ResetStats() { ExeCount = StealCount = FailedStealCount = 0; }
+
+  sBool IsFull() const   { return int(Bottom-Top)>=TaskMax; }   // exact for owner
+  int GetCount() const   { int n = int(Bottom-Top); return n>0 ? n : 0; } // approximation for other threads
+  sBool Push(sStsTask *);         // owner only, fails when full
+  sStsTask *Pop();                // owner only
+  sStsTask *Steal(sBool &abort);  // any thread, abort is set when we lost a race
 };
 
 class sStsThread
@@ -92,26 +142,34 @@ class sStsThread
   friend void sStsThreadFunc(class sThread *thread, void *_user);
   friend class sStsManager;
   friend class sStsWorkload;
+  friend class sStsScope;
   sStsManager *Manager;           // backlink to manager
-  sStsLock *Lock;              // lock for manipulating task queue
-  sThreadEvent *Event;
   sThread *Thread;                // thread for execution
   int Index;                     // index of this thread in manager
   sThreadLock WorkloadReadLock;
+  sStsTask *CurrentTask;          // task in RunTask(), innermost when nested
+  int Cpu;                        // home cpu
+  int Node;                       // arena used by this thread
+  int *StealOrder;                // all other threads, nearest first
+  int StealGroups[4];             // ends in StealOrder: shared L2, shared L3, same node, remote
+  int PriorityLimit;              // while holding urgent work, ignore less urgent workloads
 
-//  volatile sBool Running; 
   void DecreaseSync(sStsTask *t);
+  void RunTask(sStsTask *t);      // execute, splitting off halves when our queue runs dry
+  sBool Push(sStsQueue *qu,sStsTask *t);  // push and wake up a sleeping thread
 public:
-  sStsThread(sStsManager *,int index,int taskcount,sBool thread);
+  sStsThread(sStsManager *,int index,int cpu,int node,sBool thread);
   ~sStsThread();
 
-  void AddTask(sStsTask *);
-  void StealTasksFrom(sStsThread *);
+  void AddTask(sStsTask *);       // only from the thread itself (or master before starting the workload)
   sBool Execute();
+  void Idle(uint64_t &spinstart,sBool (*done)(void *)=0,void *user=0);  // call when Execute() failed. spins a while, then sleeps
 
   int GetIndex() { return Index; }
 };
 
+sStsThread *sStsGetCurrentThread(); // thread running the current task, 0 outside of tasks
+
 
 /****************************************************************************/
 /***                                                                      ***/
@@ -119,17 +177,27 @@ public:
 /***                                                                      ***/
 /****************************************************************************/
 
+enum sStsPriority                 // workloads with a lower number are drained first
+{
+  sSP_REALTIME = 0,               // per frame work, waited for soon
+  sSP_NORMAL = 1,
+  sSP_BACKGROUND = 2,             // bakes and streaming, never delays the others
+  sSP_MAX = 3,
+};
+
 class sStsManager
 {
   friend class sStsThread;
   friend class sStsWorkload;
+  friend class sStsScope;
   friend void sStsThreadFunc(class sThread *thread, void *_user);
   int ConfigPoolMem;
   int ConfigMaxTasks;
 
   sStsThread **Threads;           // threads[0] is the master thread
   int ThreadCount;               // number of threads, including master thread
-  int ThreadBits;                // 1<<ThreadBits >= ThreadCount
+  int NodeCount;                  // numa nodes used by our threads
+  int *NodeIds;                   // os index of each node
 
 //  uint8_t *Mem;
 //  volatile sPtr MemUsed;
@@ -138,10 +206,15 @@ class sStsManager
 //  template <class T> T *Alloc(int count=1) { return (T *) AllocBytes(sizeof(T)*count); }
 
   volatile sBool Running;         // Indicate running state to threads
-  uint32_t TotalTasksLeft;
 
+  sStsTask *StealTasks(int to);   // implementation of thread stealing
+  void PlaceThreads(sCpuTopology *home);  // choose a cpu for each thread
+  void SortStealOrder(sStsThread *th,sCpuTopology *home);
 
-  sBool StealTasks(int to);      // implementation of thread stealing
+  sStsEventCount IdleEvent;       // idle threads sleep here
+  uint32_t WakeCount;
+  uint32_t WakeLatency[16];       // histogram: WakeLatency[i] counts wakeups faster than 1<<i us
+  sString<512> WakeStatBuffer;
 
   sDList2<sStsWorkload> FreeWorkloads;
   sDList2<sStsWorkload> ActiveWorkloads;
@@ -153,17 +226,26 @@ class sStsManager
 
   void WorkloadWriteLock();
   void WorkloadWriteUnlock();
+
+  static sBool IsWorkloadDone(void *);  // conditions for sStsThread::Idle()
+  static sBool IsSyncDone(void *);
+  static sBool IsAllDone(void *);
 public:
   sStsManager(int memory,int taskqueuelength,int maxcore=0);
   ~sStsManager();
   int GetThreadCount() { return ThreadCount; }
 
+  int SpinTime;                   // us an idle thread spins before it goes to sleep
+  const sChar *PrintWakeStat();   // wakeup latency histogram of sleeping threads
+  void ResetWakeStat();
+
 // call this only from master thread
 
-  sStsWorkload *BeginWorkload();
+  sStsWorkload *BeginWorkload(int priority=sSP_NORMAL);
   void StartWorkload(sStsWorkload *);
   void SyncWorkload(sStsWorkload *);
-  void EndWorkload(sStsWorkload *);
+  void EndWorkload(sStsWorkload *);   // waits for the remains of a canceled workload
+  void CancelWorkload(sStsWorkload *wl);  // any thread. subtasks not yet started are dropped
 
 
   sBool HelpWorkload(sStsWorkload *wl); // build your own while-loop instead of using SyncWorkload
@@ -196,17 +278,24 @@ class sStsWorkload
 {
   friend class sStsThread;
   friend class sStsManager;
+  friend class sStsScope;
 
   sStsManager *Manager;
   int ThreadCount;
 
-  uint8_t *Mem;
-  volatile sPtr MemUsed;
-  sPtr MemEnd;
+  struct Arena                    // one per numa node
+  {
+    uint8_t *Mem;
+    volatile sPtr Used;
+    sPtr End;
+    uint32_t Pad[10];             // different cachelines for different nodes
+  };
+  Arena *Arenas;
+  int ArenaCount;
+  sPtr ArenaSize;
 
   sStsQueue **Queues;
-  uint32_t TasksLeft;
-  uint32_t TasksRunning;
+  uint32_t TasksLeft;             // tasks added and not yet completed
 
   sStaticArray<sStsTask *> Tasks;
   sString<128> StatBuffer;
@@ -215,20 +304,24 @@ public:
   ~sStsWorkload();
 
   sStsTask *NewTask(sStsCode code,void* data,int subtasks,int syncs);
-  void AddTask(sStsTask *);                
+  void AddTask(sStsTask *);       // master thread only, use sStsThread::AddTask() from inside tasks
 
   void Start() { Manager->StartWorkload(this); }
   void Sync()  { Manager->SyncWorkload(this); }
   void End()   { Manager->EndWorkload(this); }
-  uint8_t *AllocBytes(int bytes);
-  template <class T> T *Alloc(int count=1) { return (T *) AllocBytes(sizeof(T)*count); }
-
+  void Cancel() { Manager->CancelWorkload(this); }
+  sBool IsCanceled() { return Canceled; }   // poll this in long subtasks
+  uint8_t *AllocBytes(int bytes,int align=4);  // from the arena of the calling thread's node
+  template <class T> T *Alloc(int count=1) { return (T *) AllocBytes(sizeof(T)*count,sALIGNOF(T)); }
 
   sDNode Node;
 
+  int Mode;
+  int Priority;                   // sStsPriority, set by BeginWorkload()
+  volatile sBool Canceled;
+
   // stats
 
-  int Mode;
 
   uint32_t StealCount;
   uint32_t SpinCount;
@@ -239,6 +332,421 @@ public:
   const sChar *PrintStat();
 };
 
+/****************************************************************************/
+/***                                                                      ***/
+/***   Parallel algorithms                                                ***/
+/***                                                                      ***/
+/***   sParallelFor(0,n,0,[&](int i) { ... });                            ***/
+/***                                                                      ***/
+/***   The functors are only referenced, the calls block until all work   ***/
+/***   is done. The small bookkeeping structures live in the workload     ***/
+/***   memory, nothing touches the heap. Called from inside a task, the   ***/
+/***   work is added to the workload of that task and the calling thread  ***/
+/***   helps out until it is done, so these nest freely. Otherwise they   ***/
+/***   must be called from the master thread and run their own workload.  ***/
+/***                                                                      ***/
+/***   grain<=0 chooses a granularity that gives every thread about 16    ***/
+/***   pieces. Ranges are split lazily, only when other threads are       ***/
+/***   hungry, so a small grain costs little.                             ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+class sStsScope                   // helper for running one task, nested or not
+{
+  sStsManager *Manager;
+  sStsThread *Thread;             // nested: the thread we are called from
+  sStsWorkload *Workload;         // nested: the workload of the current task
+public:
+  sStsScope(sStsManager *);
+  ~sStsScope();
+  sStsWorkload *GetWorkload() { return Workload; }
+  sStsTask *NewTask(sStsCode code,void *data,int subtasks,int granularity);
+  void Run(sStsTask *);           // add the task and help until it is done
+};
+
+inline int sStsAutoGrain(sStsManager *m,int n,int grain)
+{
+  if(grain<=0)
+    grain = n/(m->GetThreadCount()*16);
+  return sMax(grain,1);
+}
+
+inline int sStsLimitGrain(sStsManager *m,int n,int grain)   // not too many slots for results
+{
+  int max = m->GetThreadCount()*64;
+  return sMax(grain,(n+max-1)/max);
+}
+
+/****************************************************************************/
+
+template <class Body> struct sStsForData
+{
+  const Body *Func;
+  int Start;
+};
+
+template <class Body> void sStsForCode(sStsManager *,sStsThread *,int start,int count,void *data)
+{
+  sStsForData<Body> *d = (sStsForData<Body> *) data;
+  const int s = d->Start+start;
+  const int e = s+count;
+  for(int i=s;i<e;i++)
+    (*d->Func)(i);
+}
+
+template <class Body> void sStsForRangeCode(sStsManager *,sStsThread *,int start,int count,void *data)
+{
+  sStsForData<Body> *d = (sStsForData<Body> *) data;
+  (*d->Func)(d->Start+start,d->Start+start+count);
+}
+
+template <class Body> void sParallelFor(int start,int end,int grain,const Body &body,sStsManager *m=sSched)
+{
+  const int n = end-start;
+  if(n<=0) return;
+  grain = sStsAutoGrain(m,n,grain);
+  if(m->GetThreadCount()==1 || n<=grain)
+  {
+    for(int i=start;i<end;i++)
+      body(i);
+    return;
+  }
+
+  sStsScope scope(m);
+  sStsForData<Body> *d = scope.GetWorkload()->template Alloc<sStsForData<Body> >();
+  d->Func = &body;
+  d->Start = start;
+  scope.Run(scope.NewTask(sStsForCode<Body>,d,n,grain));
+}
+
+template <class Body> void sParallelForRange(int start,int end,int grain,const Body &body,sStsManager *m=sSched)
+{                                 // body(start,end) is called for each piece
+  const int n = end-start;
+  if(n<=0) return;
+  grain = sStsAutoGrain(m,n,grain);
+  if(m->GetThreadCount()==1 || n<=grain)
+  {
+    body(start,end);
+    return;
+  }
+
+  sStsScope scope(m);
+  sStsForData<Body> *d = scope.GetWorkload()->template Alloc<sStsForData<Body> >();
+  d->Func = &body;
+  d->Start = start;
+  scope.Run(scope.NewTask(sStsForRangeCode<Body>,d,n,grain));
+}
+
+/****************************************************************************/
+
+template <class T,class Body,class Join> struct sStsReduceData
+{
+  const Body *Func;
+  const Join *JoinFunc;
+  const T *Identity;
+  T *Results;                     // one per piece
+  int Start;
+  int End;
+  int Grain;
+};
+
+template <class T,class Body,class Join> void sStsReduceCode(sStsManager *,sStsThread *,int start,int count,void *data)
+{
+  sStsReduceData<T,Body,Join> *d = (sStsReduceData<T,Body,Join> *) data;
+  for(int c=start;c<start+count;c++)
+  {
+    const int s = d->Start+c*d->Grain;
+    const int e = sMin(s+d->Grain,d->End);
+    T acc(*d->Identity);
+    for(int i=s;i<e;i++)
+      acc = (*d->JoinFunc)(acc,(*d->Func)(i));
+    sPlacementNew<T>(&d->Results[c],acc);
+  }
+}
+
+// join(a,b) must be associative, the pieces are joined in order so the
+// result does not depend on the scheduling. the partial results live in
+// the workload memory, they are constructed by the tasks and destroyed here.
+
+template <class T,class Body,class Join> T sParallelReduce(int start,int end,int grain,const T &identity,const Body &body,const Join &join,sStsManager *m=sSched)
+{
+  const int n = end-start;
+  T acc(identity);
+  if(n<=0) return acc;
+  grain = sStsAutoGrain(m,n,grain);
+  if(m->GetThreadCount()==1 || n<=grain)
+  {
+    for(int i=start;i<end;i++)
+      acc = join(acc,body(i));
+    return acc;
+  }
+  grain = sStsLimitGrain(m,n,grain);
+  const int pieces = (n+grain-1)/grain;
+
+  sStsScope scope(m);
+  sStsReduceData<T,Body,Join> *d = scope.GetWorkload()->template Alloc<sStsReduceData<T,Body,Join> >();
+  d->Func = &body;
+  d->JoinFunc = &join;
+  d->Identity = &identity;
+  d->Results = scope.GetWorkload()->template Alloc<T>(pieces);
+  d->Start = start;
+  d->End = end;
+  d->Grain = grain;
+  scope.Run(scope.NewTask(sStsReduceCode<T,Body,Join>,d,pieces,1));
+
+  for(int i=0;i<pieces;i++)
+  {
+    acc = join(acc,d->Results[i]);
+    d->Results[i].~T();
+  }
+  return acc;
+}
+
+/****************************************************************************/
+
+template <class T,class Join> struct sStsScanData
+{
+  const T *In;
+  T *Out;
+  const Join *JoinFunc;
+  const T *Identity;
+  T *Sums;                        // pass 1: sum of each piece, then prefix before each piece
+  int Count;
+  int Grain;
+};
+
+template <class T,class Join> void sStsScanSumCode(sStsManager *,sStsThread *,int start,int count,void *data)
+{
+  sStsScanData<T,Join> *d = (sStsScanData<T,Join> *) data;
+  for(int c=start;c<start+count;c++)
+  {
+    const int s = c*d->Grain;
+    const int e = sMin(s+d->Grain,d->Count);
+    T acc(*d->Identity);
+    for(int i=s;i<e;i++)
+      acc = (*d->JoinFunc)(acc,d->In[i]);
+    sPlacementNew<T>(&d->Sums[c],acc);
+  }
+}
+
+template <class T,class Join> void sStsScanCode(sStsManager *,sStsThread *,int start,int count,void *data)
+{
+  sStsScanData<T,Join> *d = (sStsScanData<T,Join> *) data;
+  for(int c=start;c<start+count;c++)
+  {
+    const int s = c*d->Grain;
+    const int e = sMin(s+d->Grain,d->Count);
+    T acc(d->Sums[c]);
+    for(int i=s;i<e;i++)
+    {
+      acc = (*d->JoinFunc)(acc,d->In[i]);
+      d->Out[i] = acc;
+    }
+  }
+}
+
+// inclusive scan: out[i] = in[0] join ... join in[i]. in and out may be the same.
+// the per piece sums are constructed and destroyed like in sParallelReduce().
+
+template <class T,class Join> void sParallelScan(const T *in,T *out,int count,int grain,const T &identity,const Join &join,sStsManager *m=sSched)
+{
+  if(count<=0) return;
+  grain = sStsAutoGrain(m,count,grain);
+  if(m->GetThreadCount()==1 || count<=grain)
+  {
+    T acc(identity);
+    for(int i=0;i<count;i++)
+    {
+      acc = join(acc,in[i]);
+      out[i] = acc;
+    }
+    return;
+  }
+  grain = sStsLimitGrain(m,count,grain);
+  const int pieces = (count+grain-1)/grain;
+
+  sStsScope scope(m);
+  sStsScanData<T,Join> *d = scope.GetWorkload()->template Alloc<sStsScanData<T,Join> >();
+  d->In = in;
+  d->Out = out;
+  d->JoinFunc = &join;
+  d->Identity = &identity;
+  d->Sums = scope.GetWorkload()->template Alloc<T>(pieces);
+  d->Count = count;
+  d->Grain = grain;
+  scope.Run(scope.NewTask(sStsScanSumCode<T,Join>,d,pieces,1));
+
+  T acc(identity);                // turn the sums into prefixes
+  for(int i=0;i<pieces;i++)
+  {
+    T sum(d->Sums[i]);
+    d->Sums[i] = acc;
+    acc = join(acc,sum);
+  }
+  scope.Run(scope.NewTask(sStsScanCode<T,Join>,d,pieces,1));
+
+  for(int i=0;i<pieces;i++)
+    d->Sums[i].~T();
+}
+
+/****************************************************************************/
+
+template <class Order> struct sStsSortData
+{
+  const Order *Ord;
+  int *Bounds;                    // first element of each piece, and the end
+  int *Src;                       // sorted runs of indices
+  int *Dest;
+  int Width;                      // pieces per run
+  int Pieces;
+};
+
+template <class Order> void sStsSortPieceCode(sStsManager *,sStsThread *,int start,int count,void *data)
+{
+  sStsSortData<Order> *d = (sStsSortData<Order> *) data;
+  for(int i=start;i<start+count;i++)
+    sSortRange(*d->Ord,d->Bounds[i],d->Bounds[i+1]);
+}
+
+template <class Order> void sStsSortMergeCode(sStsManager *,sStsThread *,int start,int count,void *data)
+{
+  sStsSortData<Order> *d = (sStsSortData<Order> *) data;
+  for(int i=start;i<start+count;i++)
+  {
+    const int lo = i*2*d->Width;
+    const int mid = sMin(lo+d->Width,d->Pieces);
+    const int hi = sMin(lo+2*d->Width,d->Pieces);
+    sSortMergeIndices(*d->Ord,d->Src,d->Dest,d->Bounds[lo],d->Bounds[mid],d->Bounds[hi]);
+  }
+}
+
+// every thread sorts a piece of the array in place with sSortRange(), then
+// the pieces are merged as runs of indices and the elements are permuted
+// once at the end. the sort is not stable. see sSortOrderUp and friends
+// in types.hpp for the order object.
+
+template <class Order> void sParallelSort(const Order &o,int count,sStsManager *m=sSched)
+{
+  const int pieces = m->GetThreadCount();
+  if(pieces==1 || count<0x4000)
+  {
+    sSortRange(o,0,count);
+    return;
+  }
+
+  sStsScope scope(m);
+  sStsSortData<Order> *d = scope.GetWorkload()->template Alloc<sStsSortData<Order> >();
+  d->Ord = &o;
+  d->Pieces = pieces;
+  d->Bounds = scope.GetWorkload()->template Alloc<int>(pieces+1);
+  for(int i=0;i<=pieces;i++)
+    d->Bounds[i] = int(int64_t(count)*i/pieces);
+  scope.Run(scope.NewTask(sStsSortPieceCode<Order>,d,pieces,1));
+
+  int *idx = new int[count*2];
+  for(int i=0;i<count;i++)
+    idx[i] = i;
+  d->Src = idx;
+  d->Dest = idx+count;
+  for(d->Width=1;d->Width<pieces;d->Width*=2)
+  {
+    scope.Run(scope.NewTask(sStsSortMergeCode<Order>,d,(pieces+d->Width*2-1)/(d->Width*2),1));
+    sSwap(d->Src,d->Dest);
+  }
+
+  sSortPermute(o,d->Src,count);
+  delete[] idx;
+}
+
+template <class ArrayType> void sParallelSortUp(ArrayType &a,sStsManager *m=sSched)
+{
+  sParallelSort(sSortOrderUp<ArrayType>(a),a.GetCount(),m);
+}
+
+template <class ArrayType> void sParallelSortDown(ArrayType &a,sStsManager *m=sSched)
+{
+  sParallelSort(sSortOrderDown<ArrayType>(a),a.GetCount(),m);
+}
+
+template <class ArrayType,class BaseType,class MemberType> void sParallelSortUp(ArrayType &a,MemberType BaseType::*o,sStsManager *m=sSched)
+{
+  sParallelSort(sSortOrderMemberUp<ArrayType,BaseType,MemberType>(a,o),a.GetCount(),m);
+}
+
+template <class ArrayType,class BaseType,class MemberType> void sParallelSortDown(ArrayType &a,MemberType BaseType::*o,sStsManager *m=sSched)
+{
+  sParallelSort(sSortOrderMemberDown<ArrayType,BaseType,MemberType>(a,o),a.GetCount(),m);
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Task graph                                                         ***/
+/***                                                                      ***/
+/***   Nodes are tasks, edges tell which nodes must be finished before a  ***/
+/***   node may start. Build the graph once and launch it as often as you ***/
+/***   like, a launch only takes a few bytes per node from the workload.  ***/
+/***   Nodes that become ready go straight into the stealing queue of the ***/
+/***   thread that finished the last predecessor, the node with the       ***/
+/***   longest path to the end of the graph is executed first.            ***/
+/***                                                                      ***/
+/***     int decode = g.AddNode(DecodeCode,0,1);                          ***/
+/***     int mip = g.AddNode(MipCode,0,12);                               ***/
+/***     int pack = g.AddNode(PackCode,0,1);                              ***/
+/***     g.AddEdge(decode,mip);                                           ***/
+/***     g.AddEdge(mip,pack);                                             ***/
+/***     g.Run();                                                         ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+class sStsGraph
+{
+  struct Node
+  {
+    sStsCode Code;
+    void *Data;
+    int Subtasks;
+    int Granularity;
+    int Cost;                     // estimated work, -1 for subtasks
+    int Rank;                     // cost of the longest path from here to the end
+    int PredCount;
+    int SuccFirst;                // in Succs, most critical last
+    int SuccCount;
+  };
+  struct Launched                 // one per launch, in workload memory
+  {
+    sStsGraph *Graph;
+    sStsWorkload *Workload;
+    uint32_t *Pending;            // unfinished predecessors of each node
+  };
+
+  sArray<Node> Nodes;
+  sArray<int> EdgeFrom;
+  sArray<int> EdgeTo;
+  sArray<int> Succs;
+  sArray<int> Roots;              // most critical last
+  int CriticalPath;
+  sBool Dirty;
+
+  void Prepare();
+  void SortByRank(int *list,int count);
+  sStsTask *MakeTask(sStsWorkload *wl,Launched *l,int node);
+  static void ReleaseCode(sStsManager *,sStsThread *,int start,int count,void *data);
+public:
+  sStsGraph();
+  ~sStsGraph();
+  void Clear();
+
+  int AddNode(sStsCode code,void *data,int subtasks,int granularity=1,int cost=-1); // returns node index
+  void AddEdge(int before,int after);
+  void SetData(int node,void *data) { Nodes[node].Data = data; }
+  void SetSubtasks(int node,int subtasks);
+  int GetNodeCount() { return Nodes.GetCount(); }
+  int GetCriticalPath();          // cost of the longest path through the graph
+
+  void Launch(sStsWorkload *wl,sStsThread *th=0);  // master before starting the workload, or from a task
+  void Run(sStsManager *m=sSched);  // launch in a new workload and wait (master thread)
+};
+
 /****************************************************************************/
 /***                                                                      ***/
 /***   Cool Performance Meter                                             ***/
@@ -249,16 +757,30 @@ public:
 extern "C" unsigned __int64 __rdtsc();
 #pragma intrinsic(__rdtsc)
 inline uint64_t sGetTimeStamp() { return __rdtsc(); }
+#elif sCONFIG_COMPILER_GCC && (defined(__i386__) || defined(__x86_64__))
+inline uint64_t sGetTimeStamp() { return __builtin_ia32_rdtsc(); }
 #else
 inline uint64_t sGetTimeStamp() { return sGetTimeUS(); }
 #endif
+uint64_t sGetTimeStampFrequency();  // ticks per second, measured on first call
+
+enum sStsPerfEvent
+{
+  sSPE_BEGIN = 0,                 // arg: color
+  sSPE_END,
+  sSPE_STEAL,                     // arg: victim thread
+  sSPE_SPIN,                      // arg: us spent spinning before going to sleep
+  sSPE_SLEEP,
+  sSPE_WAKE,
+};
 
 class sStsPerfMon
 {
   struct Entry
   {
-    uint32_t Timestamp;
-    uint32_t Color;
+    uint64_t Timestamp;           // sGetTimeStamp()
+    uint32_t Arg;
+    uint32_t Event;
   };
   int ThreadCount;
   int DataCount;
@@ -274,6 +796,14 @@ class sStsPerfMon
   uint64_t TimeStart;
   int Enable;
 
+  sFile *CaptureFile;
+  uint64_t CaptureStart;
+  int CaptureEvents;
+  int CaptureLost;
+  sTextBuffer CaptureText;
+  void WriteCapture(int **counters,Entry **datas);
+  void FlushCapture();
+
   sRect *Rects;
 
   class sGeometry *Geo;
@@ -287,8 +817,16 @@ public:
   ~sStsPerfMon();
 
   void FlipFrame();
-  void Begin(int thread,uint32_t color)  { if(!Enable) return; int cnt = *Counters[thread]; *Counters[thread]=cnt+1; Entry *e = &Datas[thread][cnt&CountMask]; e->Timestamp = uint32_t(sGetTimeStamp()-TimeStart); e->Color = color|0xff000000; }
-  void End(int thread)               { if(!Enable) return; int cnt = *Counters[thread]; *Counters[thread]=cnt+1; Entry *e = &Datas[thread][cnt&CountMask]; e->Timestamp = uint32_t(sGetTimeStamp()-TimeStart); e->Color = 0; }
+  void Add(int thread,int event,uint32_t arg)  { if(!Enable || thread>=ThreadCount) return; int cnt = *Counters[thread]; *Counters[thread]=cnt+1; Entry *e = &Datas[thread][cnt&CountMask]; e->Timestamp = sGetTimeStamp(); e->Arg = arg; e->Event = event; }
+  void Begin(int thread,uint32_t color)  { Add(thread,sSPE_BEGIN,color|0xff000000); }
+  void End(int thread)                   { Add(thread,sSPE_END,0); }
+
+  // capture to a chrome trace json file (chrome://tracing, ui.perfetto.dev).
+  // every FlipFrame() appends the last frame, call it regularly.
+
+  sBool StartCapture(const sChar *filename);
+  void StopCapture();
+  sBool IsCapturing() { return CaptureFile!=0; }
 
   void Paint(const struct sTargetSpec &ts);
 